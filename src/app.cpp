@@ -20,12 +20,24 @@ AppArgs AppArgs::parse(int argc, char** argv, bool hasMode) {
     AppArgs args;
     args.mode = NULL;
     args.nThreads = 4;
+    args.spinBudget = TASK_LOOP_DEFAULT_SPIN_BUDGET;
+    args.fusion = true;
+    args.tracePath = NULL;
     args.modelPath = NULL;
     args.tokenizerPath = NULL;
     args.prompt = NULL;
     args.weightsFloatType = FUNK;
     args.bufferFloatType = F32;
+    args.kvCacheFloatType = F32;
+    args.ropeCache = true;
+    args.nBatches = 32;
+    args.nSequences = 1;
+    args.draftModelPath = NULL;
+    args.nDraftTokens = 4;
+    args.lookupNgram = 0;
+    args.sessionPath = NULL;
     args.nWorkers = 0;
+    args.busyPollUs = 0;
     args.port = 9990;
     args.temperature = 0.8f;
     args.topp = 0.9f;
@@ -48,6 +60,29 @@ AppArgs AppArgs::parse(int argc, char** argv, bool hasMode) {
             args.weightsFloatType = parseFloatType(argv[i + 1]);
         } else if (strcmp(argv[i], "--buffer-float-type") == 0) {
             args.bufferFloatType = parseFloatType(argv[i + 1]);
+        } else if (strcmp(argv[i], "--kv-cache-float-type") == 0) {
+            args.kvCacheFloatType = parseFloatType(argv[i + 1]);
+        } else if (strcmp(argv[i], "--rope-cache") == 0) {
+            if (strcmp(argv[i + 1], "on") == 0) {
+                args.ropeCache = true;
+            } else if (strcmp(argv[i + 1], "off") == 0) {
+                args.ropeCache = false;
+            } else {
+                printf("Invalid rope cache mode %s\n", argv[i + 1]);
+                exit(EXIT_FAILURE);
+            }
+        } else if (strcmp(argv[i], "--nbatches") == 0) {
+            args.nBatches = atoi(argv[i + 1]);
+        } else if (strcmp(argv[i], "--nsequences") == 0) {
+            args.nSequences = atoi(argv[i + 1]);
+        } else if (strcmp(argv[i], "--draft-model") == 0) {
+            args.draftModelPath = argv[i + 1];
+        } else if (strcmp(argv[i], "--draft-tokens") == 0) {
+            args.nDraftTokens = atoi(argv[i + 1]);
+        } else if (strcmp(argv[i], "--lookup-ngram") == 0) {
+            args.lookupNgram = atoi(argv[i + 1]);
+        } else if (strcmp(argv[i], "--session") == 0) {
+            args.sessionPath = argv[i + 1];
         } else if (strcmp(argv[i], "--workers") == 0) {
             int j = i + 1;
             for (; j < argc && argv[j][0] != '-'; j++);
@@ -72,10 +107,25 @@ AppArgs AppArgs::parse(int argc, char** argv, bool hasMode) {
             }
 
             i += count - 1;
+        } else if (strcmp(argv[i], "--busy-poll") == 0) {
+            args.busyPollUs = atoi(argv[i + 1]);
         } else if (strcmp(argv[i], "--port") == 0) {
             args.port = atoi(argv[i + 1]);
         } else if (strcmp(argv[i], "--nthreads") == 0) {
             args.nThreads = atoi(argv[i + 1]);
+        } else if (strcmp(argv[i], "--spin-budget") == 0) {
+            args.spinBudget = atoi(argv[i + 1]);
+        } else if (strcmp(argv[i], "--fusion") == 0) {
+            if (strcmp(argv[i + 1], "on") == 0) {
+                args.fusion = true;
+            } else if (strcmp(argv[i + 1], "off") == 0) {
+                args.fusion = false;
+            } else {
+                printf("Invalid fusion mode %s\n", argv[i + 1]);
+                exit(EXIT_FAILURE);
+            }
+        } else if (strcmp(argv[i], "--trace") == 0) {
+            args.tracePath = argv[i + 1];
         } else if (strcmp(argv[i], "--steps") == 0) {
             args.steps = atoi(argv[i + 1]);
         } else if (strcmp(argv[i], "--temperature") == 0) {
@@ -100,6 +150,73 @@ TransformerArch TransformerArchFactory::create(TransformerSpec* spec) {
     exit(EXIT_FAILURE);
 }
 
+void TransformerArchFactory::fuse(TransformerSpec* spec, TransformerArch* arch) {
+    if (spec->archType == LLAMA) fuseLlamaArch(arch);
+    else if (spec->archType == GROK1) fuseGrok1Arch(arch);
+    else if (spec->archType == MIXTRAL) fuseMixtralArch(arch);
+}
+
+DraftModel::DraftModel(AppArgs* args, TransformerSpec* targetSpec) {
+    spec = Transformer::loadSpecFromFile(args->draftModelPath, 1, args->weightsFloatType, args->bufferFloatType, args->kvCacheFloatType, args->ropeCache, args->nBatches, 1);
+    if (spec.vocabSize != targetSpec->vocabSize) {
+        throw std::runtime_error("The draft model must have the same vocabulary as the target model");
+    }
+    arch = new TransformerArch(TransformerArchFactory::create(&spec));
+    if (args->fusion) {
+        TransformerArchFactory::fuse(&spec, arch);
+    }
+    socketPool = new SocketPool(0, NULL);
+    acc = new AcceleratorContext(0, 1, NULL);
+    transformer = new Transformer(Transformer::loadRootFromFile(args->draftModelPath, &spec, socketPool, acc));
+    inference = new Inference(arch, args->nThreads, args->spinBudget, transformer, socketPool);
+    sampler = new Sampler(spec.vocabSize, args->temperature, args->topp, args->seed + 1);
+    nCached = 0;
+    printf("🔷 Draft model: %s\n", args->draftModelPath);
+}
+
+DraftModel::~DraftModel() {
+    delete sampler;
+    delete inference;
+    delete transformer;
+    delete acc;
+    delete socketPool;
+    delete arch;
+}
+
+unsigned int DraftModel::draft(const int* history, pos_t nHistory, unsigned int nDraft, int* tokens, float* probs) {
+    // the draft model computes the positions up to nHistory + nDraft - 2
+    if (nHistory + nDraft > spec.seqLen + 1) {
+        if (nHistory > spec.seqLen) return 0;
+        nDraft = spec.seqLen + 1 - nHistory;
+    }
+    if (nDraft == 0) return 0;
+
+    assert(nCached < nHistory);
+    float* logits;
+    while (nCached < nHistory) {
+        pos_t nTokens = (pos_t)std::min(nHistory - nCached, (int)spec.nBatches);
+        logits = inference->inferBatch(&history[nCached], nTokens, nCached);
+        nCached += nTokens;
+    }
+
+    for (unsigned int i = 0; i < nDraft; i++) {
+        float* p = &probs[i * spec.vocabSize];
+        memcpy(p, logits, spec.vocabSize * sizeof(float));
+        sampler->probs(p);
+        tokens[i] = sampler->sampleProbs(p);
+        if (i + 1 < nDraft) {
+            logits = inference->infer(tokens[i], nCached);
+            nCached++;
+        }
+    }
+    return nDraft;
+}
+
+void DraftModel::rollback(pos_t nValid) {
+    if (nCached > nValid)
+        nCached = nValid;
+}
+
 void App::run(AppArgs* args, void (*program)(Inference* inference, SocketPool* socketPool, Tokenizer* tokenizer, Sampler* sampler, AppArgs* args, TransformerSpec* spec, AcceleratorContext* acc)) {
     if (args->modelPath == NULL) {
         throw std::runtime_error("Model is required");
@@ -111,8 +228,11 @@ void App::run(AppArgs* args, void (*program)(Inference* inference, SocketPool* s
     SocketPool* socketPool = SocketPool::connect(args->nWorkers, args->workerHosts, args->workerPorts);
     unsigned int nSlices = args->nWorkers + 1;
 
-    TransformerSpec spec = Transformer::loadSpecFromFile(args->modelPath, nSlices, args->weightsFloatType, args->bufferFloatType);
+    TransformerSpec spec = Transformer::loadSpecFromFile(args->modelPath, nSlices, args->weightsFloatType, args->bufferFloatType, args->kvCacheFloatType, args->ropeCache, args->nBatches, args->nSequences);
     TransformerArch arch = TransformerArchFactory::create(&spec);
+    if (args->fusion) {
+        TransformerArchFactory::fuse(&spec, &arch);
+    }
     Tokenizer tokenizer(args->tokenizerPath, spec.vocabSize);
 
     if (args->steps == 0 || args->steps > spec.seqLen) {
@@ -122,12 +242,24 @@ void App::run(AppArgs* args, void (*program)(Inference* inference, SocketPool* s
     AcceleratorContext acc(0, 1, NULL);
     Transformer transformer = Transformer::loadRootFromFile(args->modelPath, &spec, socketPool, &acc);
     socketPool->setTurbo(true);
+    if (args->busyPollUs > 0) {
+        socketPool->setBusyPoll(args->busyPollUs);
+    }
 
-    Inference inference = Inference(&arch, args->nThreads, &transformer, socketPool);
+    Inference inference = Inference(&arch, args->nThreads, args->spinBudget, &transformer, socketPool);
 
     Sampler sampler(spec.vocabSize, args->temperature, args->topp, args->seed);
 
+    if (args->tracePath != NULL) {
+        inference.startTrace();
+    }
+
     program(&inference, socketPool, &tokenizer, &sampler, args, &spec, &acc);
 
+    if (args->tracePath != NULL) {
+        inference.saveTrace(args->tracePath);
+        printf("📄 Saved trace to %s\n", args->tracePath);
+    }
+
     delete socketPool;
 }
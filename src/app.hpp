@@ -17,6 +17,9 @@ class AppArgs {
 public:
     char* mode;
     int nThreads; 
+    unsigned int spinBudget;
+    bool fusion;
+    char* tracePath;
 
     // inference
     char* modelPath;
@@ -24,9 +27,18 @@ public:
     char* prompt;
     FloatType weightsFloatType;
     FloatType bufferFloatType;
+    FloatType kvCacheFloatType;
+    bool ropeCache;
+    unsigned int nBatches;
+    unsigned int nSequences;
+    char* draftModelPath;
+    unsigned int nDraftTokens;
+    unsigned int lookupNgram;
+    char* sessionPath;
     int nWorkers;
     char** workerHosts;
     int* workerPorts;
+    unsigned int busyPollUs;
     float temperature;
     float topp;
     pos_t steps;
@@ -42,6 +54,30 @@ public:
 class TransformerArchFactory {
 public:
     static TransformerArch create(TransformerSpec* spec);
+    static void fuse(TransformerSpec* spec, TransformerArch* arch);
+};
+
+// A small model with the same vocabulary as the target model. It proposes the next tokens, the target model verifies
+// them in one batch (speculative decoding). The draft model runs only on the root node.
+class DraftModel {
+private:
+    TransformerSpec spec;
+    TransformerArch* arch;
+    SocketPool* socketPool;
+    AcceleratorContext* acc;
+    Transformer* transformer;
+    Inference* inference;
+    Sampler* sampler;
+    // The number of tokens in the KV cache of the draft model.
+    pos_t nCached;
+public:
+    DraftModel(AppArgs* args, TransformerSpec* targetSpec);
+    ~DraftModel();
+    // Proposes up to `nDraft` tokens that follow `history` and writes the distribution of every token to `probs`,
+    // `vocabSize` numbers per token. Returns the number of the proposed tokens.
+    unsigned int draft(const int* history, pos_t nHistory, unsigned int nDraft, int* tokens, float* probs);
+    // Drops the KV cache after the first `nValid` tokens of the history, the next `draft` call recomputes them.
+    void rollback(pos_t nValid);
 };
 
 class App {
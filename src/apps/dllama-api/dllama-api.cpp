@@ -7,6 +7,9 @@
 #include <iostream>
 #include <algorithm>
 #include <vector>
+#include <deque>
+#include <csignal>
+#include <ctime>
 
 #ifdef _WIN32
 #include <winsock2.h>
@@ -37,10 +40,25 @@ enum class HttpMethod {
 
 class HttpRequest {
 public:
-    static HttpRequest read(Socket& socket) {
-        HttpRequest req(&socket);
+    // Whether the buffer holds the headers and the whole body announced by `Content-Length`.
+    static bool isComplete(const std::vector<char>& httpRequest) {
+        const char* headersEnd = "\r\n\r\n";
+        auto it = std::search(httpRequest.begin(), httpRequest.end(), headersEnd, headersEnd + 4);
+        if (it == httpRequest.end()) return false;
+        size_t bodyStart = (it - httpRequest.begin()) + 4;
+
+        std::string headers(httpRequest.begin(), it);
+        std::transform(headers.begin(), headers.end(), headers.begin(), ::tolower);
+        size_t contentLength = 0;
+        size_t pos = headers.find("\r\ncontent-length:");
+        if (pos != std::string::npos)
+            contentLength = strtoul(headers.c_str() + pos + 17, NULL, 10);
+        return httpRequest.size() >= bodyStart + contentLength;
+    }
+
+    static HttpRequest parse(Socket* socket, const std::vector<char>& httpRequest) {
+        HttpRequest req(socket);
 
-        std::vector<char> httpRequest = socket.readHttpRequest();
         // Parse the HTTP request
         std::string data = std::string(httpRequest.begin(), httpRequest.end());
 
@@ -90,6 +108,7 @@ public:
 
 private:
     Socket* socket;
+    bool detached;
 public:
     std::string path;
     std::unordered_map<std::string, std::string> headers;
@@ -99,6 +118,20 @@ public:
 
     HttpRequest(Socket* socket) {
         this->socket = socket;
+        this->detached = false;
+    }
+
+    Socket* getSocket() {
+        return socket;
+    }
+
+    // A detached request is answered later, the socket must stay open after the handler returns.
+    void detach() {
+        detached = true;
+    }
+
+    bool isDetached() {
+        return detached;
     }
 
     std::string getMethod() {
@@ -184,170 +217,426 @@ void writeChatCompletionChunk(HttpRequest &request, const std::string &delta, co
     }
 }
 
-class NaiveCacheItem {
+// A sequence has own rows of the KV cache, so every sequence may serve a different request. The KV cache of
+// a finished request stays in the sequence, a next request with the same beginning continues from it (prefix cache).
+class ApiSequence {
 public:
-    pos_t endPos;
-    ChatMessage message;
-    NaiveCacheItem(pos_t endPos, ChatMessage message) {
-        this->endPos = endPos;
-        this->message = message;
-    }
-};
-
-class NaiveCache {
-private:
-    std::vector<NaiveCacheItem> cache;
-public:
-    void push(NaiveCacheItem item) {
-        cache.push_back(item);
-    }
-
-    void clear() {
-        cache.clear();
-    }
-
-    bool resolveDeltaPrompt(std::vector<ChatMessage>& messages, pos_t& startPos) {
-        size_t cacheSize = cache.size();
-        if (cacheSize == 0)
-            return false;
-        if (messages.size() > cacheSize) {
-            size_t i = 0;
-            while (i < cacheSize) {
-                if (
-                    cache[i].message.role != messages[i].role ||
-                    cache[i].message.content != messages[i].content
-                ) break;
-                i++;
-            }
-            if (i == cacheSize) {
-                startPos = cache[i - 1].endPos;
-                messages.erase(messages.begin(), messages.begin() + i);
-                printf("🐤 Found naive cache for %zu messages, pos=%d\n", i, startPos);
-                return true;
-            }
-        }
-        cache.clear();
-        return false;
-    }
+    pos_t index;
+    // The request which is generated now, NULL if the sequence is free.
+    HttpRequest* request;
+    InferenceParams params;
+    Sampler* sampler;
+    EosDetector* eosDetector;
+    int token;
+    pos_t pos;
+    pos_t maxPos;
+    int nPromptTokens;
+    int promptEndPos;
+    std::string buffer;
+    // The tokens of the positions 0, 1, ..., pos, used by the prefix cache and the prompt lookup. The KV cache of
+    // a free sequence contains all these tokens.
+    std::vector<int> history;
+    // The value of the server's counter when the sequence was used last time.
+    unsigned long lastUsed;
 };
 
 class ApiServer {
 private:
     Inference* inference;
     Tokenizer* tokenizer;
-    Sampler* sampler;
     AppArgs* args;
     TransformerSpec* spec;
-    EosDetector* eosDetector;
     ChatTemplate* chatTemplate;
-    NaiveCache naiveCache;
+    std::vector<ApiSequence*> sequences;
+    std::deque<HttpRequest*> queue;
+    unsigned long useCounter;
 
 public:
-    ApiServer( Inference* inference, Tokenizer* tokenizer, Sampler* sampler, AppArgs* args, TransformerSpec* spec, EosDetector* eosDetector, ChatTemplate* chatTemplate) {
+    ApiServer(Inference* inference, Tokenizer* tokenizer, Sampler* sampler, AppArgs* args, TransformerSpec* spec, TokenizerChatStops* stops, ChatTemplate* chatTemplate) {
         this->inference = inference;
         this->tokenizer = tokenizer;
-        this->sampler = sampler;
         this->args = args;
         this->spec = spec;
-        this->eosDetector = eosDetector;
         this->chatTemplate = chatTemplate;
+        this->useCounter = 0;
+
+        for (pos_t i = 0; i < spec->nSequences; i++) {
+            ApiSequence* sequence = new ApiSequence();
+            sequence->index = i;
+            sequence->request = NULL;
+            sequence->lastUsed = 0;
+            sequence->sampler = i == 0 ? sampler : new Sampler(spec->vocabSize, args->temperature, args->topp, args->seed + i);
+            sequence->eosDetector = new EosDetector(tokenizer->chatEosId, stops->nStops, stops->stops, stops->maxStopLength, stops->maxStopLength);
+            sequences.push_back(sequence);
+        }
+    }
+
+    ~ApiServer() {
+        for (ApiSequence* sequence : sequences) {
+            if (sequence->request != NULL) release(sequence);
+            if (sequence->index > 0) delete sequence->sampler;
+            delete sequence->eosDetector;
+            delete sequence;
+        }
+        for (HttpRequest* request : queue) {
+            delete request->getSocket();
+            delete request;
+        }
     }
 
-    void complete(HttpRequest& request) {
-        InferenceParams params = parseRequest(request);
+    // The server takes over the socket of the request, the request waits until a sequence is free.
+    void enqueue(HttpRequest& request) {
+        request.detach();
+        queue.push_back(new HttpRequest(request));
+    }
 
-        pos_t startPos = 0;
-        std::vector<ChatMessage> deltaPrompt = params.messages;
-        naiveCache.resolveDeltaPrompt(deltaPrompt, startPos);
+    // Restores the KV cache of every sequence from the session files `<sessionPath>.<sequence>.<slice>`.
+    void loadSessions() {
+        int tokens[spec->seqLen];
+        for (ApiSequence* sequence : sequences) {
+            std::string path = getSessionPath(sequence);
+            FILE* rootFile = fopen((path + ".0").c_str(), "rb");
+            if (rootFile == NULL) continue;
+            fclose(rootFile);
+            pos_t nPositions = inference->loadKvCache(path.c_str(), sequence->index, tokens);
+            sequence->history.assign(tokens, tokens + nPositions);
+            if (nPositions > 0)
+                printf("📄 Restored %d positions of sequence %d from %s\n", nPositions, sequence->index, path.c_str());
+        }
+    }
 
-        printf("🔸");
-        fflush(stdout);
+    // Saves the KV cache of every sequence, the active sequences are saved up to the current position.
+    void saveSessions() {
+        for (ApiSequence* sequence : sequences) {
+            pos_t nPositions = sequence->history.size();
+            if (sequence->request != NULL && nPositions > sequence->pos)
+                nPositions = sequence->pos;
+            if (nPositions == 0) continue;
+            std::string path = getSessionPath(sequence);
+            if (inference->saveKvCache(path.c_str(), sequence->index, nPositions, sequence->history.data()))
+                printf("📄 Saved %d positions of sequence %d to %s\n", nPositions, sequence->index, path.c_str());
+        }
+    }
+
+    bool isIdle() {
+        if (!queue.empty()) return false;
+        for (ApiSequence* sequence : sequences) {
+            if (sequence->request != NULL) return false;
+        }
+        return true;
+    }
+
+    // Starts the waiting requests in the free sequences, then generates the next token of all active sequences. With
+    // the prompt lookup a sequence adds the tokens that may follow, they are verified in the same forward pass.
+    void step() {
+        while (!queue.empty() && hasFreeSequence()) {
+            HttpRequest* request = queue.front();
+            queue.pop_front();
+            InferenceParams params = parseRequest(*request);
+            ApiSequence* sequence = NULL;
+            try {
+                std::vector<int> promptTokens = encodePrompt(params);
+                sequence = findSequence(promptTokens);
+                start(sequence, request, params, promptTokens);
+            } catch (WriteSocketException& ex) {
+                printf("Write socket error: %d %s\n", ex.code, ex.message);
+                if (sequence != NULL) {
+                    sequence->history.clear();
+                    release(sequence);
+                } else {
+                    delete request->getSocket();
+                    delete request;
+                }
+            }
+        }
+
+        // The tokens of all active sequences are processed in one forward pass (up to `nBatches` at once).
+        int tokens[spec->nBatches];
+        pos_t positions[spec->nBatches];
+        pos_t indexes[spec->nBatches];
+        ApiSequence* batch[spec->nBatches];
+        unsigned int batchStarts[spec->nBatches];
+        unsigned int batchDrafts[spec->nBatches];
+        int drafts[spec->nBatches];
+        unsigned int nTokens = 0;
+        unsigned int nSequences = 0;
+        for (size_t s = 0; s <= sequences.size(); s++) {
+            ApiSequence* sequence = NULL;
+            unsigned int nDrafts = 0;
+            if (s < sequences.size()) {
+                sequence = sequences[s];
+                if (sequence->request == NULL) continue;
+                // the history is empty after a failed KV cache copy
+                if (args->lookupNgram > 0 && sequence->history.size() > sequence->pos) {
+                    unsigned int maxDrafts = std::min(std::min(args->nDraftTokens, spec->nBatches - 1), (unsigned int)(sequence->maxPos - sequence->pos - 1));
+                    nDrafts = lookupNgramDraft(sequence->history.data(), sequence->pos + 1, args->lookupNgram, maxDrafts, drafts);
+                }
+            }
+            // The batch is flushed after the last sequence or when the next one does not fit
+            if (nTokens > 0 && (sequence == NULL || nTokens + 1 + nDrafts > spec->nBatches)) {
+                float* logits = inference->inferBatch(tokens, positions, indexes, nTokens, nTokens);
+                for (unsigned int i = 0; i < nSequences; i++) {
+                    try {
+                        next(batch[i], &logits[batchStarts[i] * spec->vocabSize], &tokens[batchStarts[i] + 1], batchDrafts[i]);
+                    } catch (WriteSocketException& ex) {
+                        printf("Write socket error: %d %s\n", ex.code, ex.message);
+                        batch[i]->history.clear();
+                        release(batch[i]);
+                    }
+                }
+                nTokens = 0;
+                nSequences = 0;
+            }
+            if (sequence != NULL) {
+                batch[nSequences] = sequence;
+                batchStarts[nSequences] = nTokens;
+                batchDrafts[nSequences] = nDrafts;
+                nSequences++;
+                for (unsigned int i = 0; i <= nDrafts; i++) {
+                    tokens[nTokens] = i == 0 ? sequence->token : drafts[i - 1];
+                    positions[nTokens] = sequence->pos + i;
+                    indexes[nTokens] = sequence->index;
+                    nTokens++;
+                }
+            }
+        }
+    }
+
+private:
+    std::string getSessionPath(ApiSequence* sequence) {
+        return std::string(args->sessionPath) + "." + std::to_string(sequence->index);
+    }
+
+    bool hasFreeSequence() {
+        for (ApiSequence* sequence : sequences) {
+            if (sequence->request == NULL) return true;
+        }
+        return false;
+    }
 
-        size_t nInputItems = deltaPrompt.size();
+    std::vector<int> encodePrompt(InferenceParams& params) {
+        size_t nInputItems = params.messages.size();
         ChatItem inputItems[nInputItems];
         for (size_t i = 0; i < nInputItems; i++) {
-            inputItems[i].role = deltaPrompt[i].role;
-            inputItems[i].message = deltaPrompt[i].content;
+            inputItems[i].role = params.messages[i].role;
+            inputItems[i].message = params.messages[i].content;
         }
-
         std::string inputPrompt = chatTemplate->generate(nInputItems, inputItems, true);
-        int promptLength = inputPrompt.size();
+        std::vector<int> promptTokens(inputPrompt.size() + 3);
         int nPromptTokens;
-        int promptTokens[promptLength + 3];
-        tokenizer->encode((char*)inputPrompt.c_str(), promptTokens, &nPromptTokens, true, false);
-        int promptEndPos = startPos + nPromptTokens;
+        tokenizer->encode((char*)inputPrompt.c_str(), promptTokens.data(), &nPromptTokens, true, false);
+        promptTokens.resize(nPromptTokens);
+        return promptTokens;
+    }
 
-        for (size_t j = 0; j < deltaPrompt.size(); j++) {
-            naiveCache.push(NaiveCacheItem(promptEndPos, deltaPrompt[j]));
+    // The number of the first tokens of the prompt which are in the KV cache of the sequence. An active sequence
+    // may share the positions before its current position.
+    pos_t getCachedPrefix(ApiSequence* sequence, const std::vector<int>& promptTokens) {
+        size_t nCached = sequence->history.size();
+        if (sequence->request != NULL && nCached > sequence->pos)
+            nCached = sequence->pos;
+        size_t n = std::min(nCached, promptTokens.size());
+        size_t i = 0;
+        while (i < n && sequence->history[i] == promptTokens[i]) i++;
+        return (pos_t)i;
+    }
+
+    // Picks a free sequence for the prompt: the one whose whole KV cache is the longest prefix of the prompt (an empty
+    // sequence has the empty prefix), otherwise the least recently used one is evicted. If any other sequence has
+    // a longer prefix, its KV cache is copied to the picked sequence. Returns the sequence with the history trimmed to
+    // the reusable prefix.
+    ApiSequence* findSequence(const std::vector<int>& promptTokens) {
+        ApiSequence* best = NULL;
+        pos_t bestPrefix = 0;
+        for (ApiSequence* sequence : sequences) {
+            if (sequence->request != NULL) continue;
+            pos_t prefix = getCachedPrefix(sequence, promptTokens);
+            if (prefix == sequence->history.size() && (best == NULL || prefix > bestPrefix)) {
+                best = sequence;
+                bestPrefix = prefix;
+            }
+        }
+        if (best == NULL) {
+            for (ApiSequence* sequence : sequences) {
+                if (sequence->request == NULL && (best == NULL || sequence->lastUsed < best->lastUsed))
+                    best = sequence;
+            }
+            bestPrefix = getCachedPrefix(best, promptTokens);
+        }
+        assert(best != NULL);
+
+        ApiSequence* source = NULL;
+        pos_t sourcePrefix = bestPrefix;
+        for (ApiSequence* sequence : sequences) {
+            if (sequence == best) continue;
+            pos_t prefix = getCachedPrefix(sequence, promptTokens);
+            if (prefix > sourcePrefix) {
+                source = sequence;
+                sourcePrefix = prefix;
+            }
+        }
+        if (source != NULL) {
+            try {
+                inference->copyKvCache(source->index, best->index, bestPrefix, sourcePrefix);
+            } catch (WriteSocketException& ex) {
+                // the workers may have copied only a part of the positions, none of the two caches is trusted
+                best->history.clear();
+                source->history.clear();
+                throw;
+            }
+            best->history.assign(source->history.begin(), source->history.begin() + sourcePrefix);
+            bestPrefix = sourcePrefix;
+        }
+        best->history.resize(bestPrefix);
+        return best;
+    }
+
+    void start(ApiSequence* sequence, HttpRequest* request, InferenceParams& params, std::vector<int>& promptTokens) {
+        sequence->request = request;
+        sequence->params = params;
+        sequence->lastUsed = ++useCounter;
+        if (request->parsedJson.contains("seed")) {
+            sequence->sampler->setSeed(params.seed);
+        }
+
+        // at least the last token of the prompt is processed to get the logits
+        int nPromptTokens = promptTokens.size();
+        pos_t startPos = std::min((int)sequence->history.size(), nPromptTokens - 1);
+        int promptEndPos = nPromptTokens;
+
+        if (spec->nSequences > 1) {
+            printf("🔸 sequence %d\n", sequence->index);
+        } else {
+            printf("🔸");
         }
+        if (startPos > 0) {
+            printf("🐤 Found %d cached tokens of %d prompt tokens\n", startPos, nPromptTokens);
+        }
+        fflush(stdout);
+
+        sequence->history.assign(promptTokens.begin(), promptTokens.end());
 
         pos_t maxPos = params.max_tokens > 0 ? (promptEndPos + params.max_tokens) : spec->seqLen;
         if (maxPos > spec->seqLen) maxPos = spec->seqLen;
 
         if (params.stream) {
-            request.writeStreamStartChunk();
+            request->writeStreamStartChunk();
         }
 
-        std::string buffer;
-        size_t nStops = params.stop.size();
-
-        int token = promptTokens[0];
+        // the prompt is processed in batches, the logits of its last token are sampled by the generation loop
         pos_t pos = startPos;
-        for (; pos < maxPos; pos++) {
-            float* logits = inference->infer(token, pos);
+        pos_t positions[spec->nBatches];
+        pos_t indexes[spec->nBatches];
+        while (pos + 1 < promptEndPos && pos < maxPos) {
+            pos_t nTokens = (pos_t)std::min(std::min(promptEndPos - 1 - pos, maxPos - pos), (int)spec->nBatches);
+            for (pos_t i = 0; i < nTokens; i++) {
+                positions[i] = pos + i;
+                indexes[i] = sequence->index;
+            }
+            inference->inferBatch(&promptTokens[pos], positions, indexes, nTokens, 1);
+            pos += nTokens;
+        }
+
+        sequence->token = promptTokens[pos];
+        sequence->pos = pos;
+        sequence->maxPos = maxPos;
+        sequence->nPromptTokens = nPromptTokens;
+        sequence->promptEndPos = promptEndPos;
+        sequence->buffer.clear();
+        if (pos >= maxPos) {
+            finish(sequence);
+        }
+    }
 
-            if (pos < promptEndPos - 1) {
-                token = promptTokens[pos - startPos + 1];
+    // Samples the next token from the first logits. If the sequence added `nDrafts` tokens to the batch, the logits of
+    // every token verify the next one.
+    void next(ApiSequence* sequence, float* logits, const int* drafts, unsigned int nDrafts) {
+        for (unsigned int i = 0; i <= nDrafts; i++) {
+            float* tokenLogits = &logits[i * spec->vocabSize];
+            int token;
+            bool isAccepted = false;
+            if (i < nDrafts) {
+                sequence->sampler->probs(tokenLogits);
+                isAccepted = sequence->sampler->verify(tokenLogits, drafts[i], &token);
             } else {
-                int prevToken = token;
-                token = sampler->sample(logits);
+                token = sequence->sampler->sample(tokenLogits);
+            }
+            if (!append(sequence, token) || (i < nDrafts && !isAccepted))
+                break;
+        }
+    }
 
-                char* piece = tokenizer->decode(prevToken, token);
-                bool isSafe = isSafePiece(piece);
+    // Returns false if the sequence has finished.
+    bool append(ApiSequence* sequence, int token) {
+        int prevToken = sequence->token;
+        sequence->token = token;
 
-                EosDetectorType eosType = eosDetector->append(token, isSafe ? piece : "");
+        char* piece = tokenizer->decode(prevToken, sequence->token);
+        bool isSafe = isSafePiece(piece);
 
-                if (isSafePiece(piece)) {
-                    printf("%s", piece);
-                    fflush(stdout);
-                }
+        EosDetectorType eosType = sequence->eosDetector->append(sequence->token, isSafe ? piece : "");
 
-                if (eosType == NOT_EOS || eosType == EOS) {
-                    char* delta = eosDetector->getDelta();
-                    if (delta != NULL) {
-                        std::string deltaStr(delta);
-                        if (params.stream)
-                            writeChatCompletionChunk(request, deltaStr, false);
-                        buffer += deltaStr;
-                    }
-                    eosDetector->clear();
-                }
-                if (eosType == EOS) break;
+        if (isSafe && spec->nSequences == 1) {
+            printf("%s", piece);
+            fflush(stdout);
+        }
+
+        if (eosType == NOT_EOS || eosType == EOS) {
+            char* delta = sequence->eosDetector->getDelta();
+            if (delta != NULL) {
+                std::string deltaStr(delta);
+                if (sequence->params.stream)
+                    writeChatCompletionChunk(*sequence->request, deltaStr, false);
+                sequence->buffer += deltaStr;
             }
+            sequence->eosDetector->clear();
+        }
+        if (eosType == EOS) {
+            finish(sequence);
+            return false;
         }
 
-        ChatMessage chatMessage("assistant", buffer);
-        if (pos == spec->seqLen) {
-            naiveCache.clear();
-        } else {
-            naiveCache.push(NaiveCacheItem(pos, chatMessage));
+        sequence->pos++;
+        sequence->history.resize(sequence->pos);
+        sequence->history.push_back(token);
+        if (sequence->pos >= sequence->maxPos) {
+            finish(sequence);
+            return false;
         }
+        return true;
+    }
 
-        if (params.stream) {
-            writeChatCompletionChunk(request, "", true);
+    void finish(ApiSequence* sequence) {
+        ChatMessage chatMessage("assistant", sequence->buffer);
+        // the token at the current position is not in the KV cache yet
+        if (sequence->history.size() > sequence->pos)
+            sequence->history.resize(sequence->pos);
+
+        if (sequence->params.stream) {
+            writeChatCompletionChunk(*sequence->request, "", true);
         } else {
-            int nCompletionTokens = pos - promptEndPos;
-            ChatUsage usage(nPromptTokens, nCompletionTokens, nPromptTokens + nCompletionTokens);
+            int nCompletionTokens = sequence->pos - sequence->promptEndPos;
+            ChatUsage usage(sequence->nPromptTokens, nCompletionTokens, sequence->nPromptTokens + nCompletionTokens);
             Choice choice(chatMessage);
             ChatCompletion completion(choice, usage);
             std::string chatJson = ((json)completion).dump();
-            request.writeJson(chatJson);
+            sequence->request->writeJson(chatJson);
+        }
+        if (spec->nSequences > 1) {
+            printf("🔶 sequence %d\n", sequence->index);
+        } else {
+            printf("🔶\n");
         }
-        printf("🔶\n");
         fflush(stdout);
+        release(sequence);
+    }
+
+    void release(ApiSequence* sequence) {
+        delete sequence->request->getSocket();
+        delete sequence->request;
+        sequence->request = NULL;
     }
 
-private:
     InferenceParams parseRequest(HttpRequest& request) {
         InferenceParams params;
         params.temperature = args->temperature;
@@ -365,7 +654,6 @@ private:
         }
         if (request.parsedJson.contains("seed")) {
             params.seed = request.parsedJson["seed"].template get<unsigned long long>();
-            sampler->setSeed(params.seed);
         }
         if (request.parsedJson.contains("max_tokens")) {
             params.max_tokens = request.parsedJson["max_tokens"].template get<int>();
@@ -381,7 +669,7 @@ private:
 };
 
 void handleCompletionsRequest(HttpRequest& request, ApiServer* api) {
-    api->complete(request);
+    api->enqueue(request);
 }
 
 void handleModelsRequest(HttpRequest& request) {
@@ -392,13 +680,35 @@ void handleModelsRequest(HttpRequest& request) {
         "] }");
 }
 
+static volatile sig_atomic_t isStopping = 0;
+
+void stop(int signum) {
+    isStopping = 1;
+    // the second signal terminates the server without saving the sessions
+    signal(signum, SIG_DFL);
+}
+
+// A connection that has not sent the whole request yet.
+struct PendingClient {
+    Socket* socket;
+    std::vector<char> data;
+    time_t acceptedAt;
+};
+
+#define HTTP_REQUEST_TIMEOUT 10
+
 void server(Inference* inference, SocketPool* socketPool, Tokenizer *tokenizer, Sampler *sampler, AppArgs* args, TransformerSpec* spec, AcceleratorContext* acc) {
     SocketServer* server = new SocketServer(args->port);
 
     TokenizerChatStops stops(tokenizer);
     ChatTemplate chatTemplate(tokenizer->chatTemplate, stops.stops[0]);
-    EosDetector eosDetector(tokenizer->chatEosId, stops.nStops, stops.stops, stops.maxStopLength, stops.maxStopLength);
-    ApiServer api(inference, tokenizer, sampler, args, spec, &eosDetector, &chatTemplate);
+    ApiServer api(inference, tokenizer, sampler, args, spec, &stops, &chatTemplate);
+
+    if (args->sessionPath != NULL) {
+        api.loadSessions();
+        signal(SIGINT, stop);
+        signal(SIGTERM, stop);
+    }
 
     printf("Server URL: http://127.0.0.1:%d/v1/\n", args->port);
 
@@ -415,19 +725,67 @@ void server(Inference* inference, SocketPool* socketPool, Tokenizer *tokenizer,
         }
     };
 
-    while (true) {
-        try {
-            Socket client = server->accept();
-            HttpRequest request = HttpRequest::read(client);
-            printf("🔷 %s %s\n", request.getMethod().c_str(), request.path.c_str());
-            Router::resolve(request, routes);
-        } catch (ReadSocketException& ex) {
-            printf("Read socket error: %d %s\n", ex.code, ex.message);
-        } catch (WriteSocketException& ex) {
-            printf("Write socket error: %d %s\n", ex.code, ex.message);
+    std::vector<PendingClient> clients;
+    while (!isStopping) {
+        // While any sequence is generated, the server only checks the connections between the forward passes. A request
+        // is read only when all its bytes have arrived, so a slow client never stalls the generation.
+        unsigned long timeoutMs = api.isIdle() ? (clients.empty() ? 1000 : 10) : 0;
+        Socket* newClient = server->tryAccept(timeoutMs);
+        if (newClient != NULL) {
+            newClient->setTurbo(true);
+            PendingClient client;
+            client.socket = newClient;
+            client.acceptedAt = time(NULL);
+            clients.push_back(client);
         }
+
+        for (size_t c = 0; c < clients.size();) {
+            PendingClient& client = clients[c];
+            bool isOpen;
+            try {
+                isOpen = client.socket->readAvailable(client.data);
+            } catch (ReadSocketException& ex) {
+                printf("Read socket error: %d %s\n", ex.code, ex.message);
+                isOpen = false;
+            }
+            bool isComplete = HttpRequest::isComplete(client.data);
+            if (!isComplete && isOpen) {
+                if (time(NULL) - client.acceptedAt <= HTTP_REQUEST_TIMEOUT) {
+                    c++;
+                    continue;
+                }
+                printf("🚧 Incomplete request after %d seconds\n", HTTP_REQUEST_TIMEOUT);
+            }
+
+            Socket* socket = client.socket;
+            std::vector<char> data;
+            data.swap(client.data);
+            clients.erase(clients.begin() + c);
+
+            bool detached = false;
+            if (isComplete) {
+                socket->setTurbo(false);
+                try {
+                    HttpRequest request = HttpRequest::parse(socket, data);
+                    printf("🔷 %s %s\n", request.getMethod().c_str(), request.path.c_str());
+                    Router::resolve(request, routes);
+                    detached = request.isDetached();
+                } catch (ReadSocketException& ex) {
+                    printf("Read socket error: %d %s\n", ex.code, ex.message);
+                } catch (WriteSocketException& ex) {
+                    printf("Write socket error: %d %s\n", ex.code, ex.message);
+                }
+            }
+            if (!detached) delete socket;
+        }
+        api.step();
     }
 
+    if (args->sessionPath != NULL) {
+        api.saveSessions();
+    }
+    for (PendingClient& client : clients)
+        delete client.socket;
     delete server;
 }
 
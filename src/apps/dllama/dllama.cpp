@@ -29,6 +29,28 @@ void generate(Inference* inference, SocketPool* socketPool, Tokenizer *tokenizer
     if (numPromptTokens < 1)
         throw std::runtime_error("Expected at least 1 prompt token");
 
+    // the draft model or the prompt lookup proposes the next tokens, the target model verifies them in one batch
+    bool isSpeculative = args->draftModelPath != NULL || args->lookupNgram > 0;
+    DraftModel* draft = NULL;
+    int* history = NULL;
+    int* batch = NULL;
+    float* draftProbs = NULL;
+    unsigned int totalDrafted = 0;
+    unsigned int totalAccepted = 0;
+    if (isSpeculative) {
+        if (spec->nBatches < 2)
+            throw std::runtime_error("Speculative decoding requires batches of at least 2 tokens");
+        if (args->draftModelPath != NULL && args->lookupNgram > 0)
+            throw std::runtime_error("The draft model and the prompt lookup cannot be used together");
+        if (args->draftModelPath != NULL)
+            draft = new DraftModel(args, spec);
+        history = new int[std::max(numPromptTokens, (int)args->steps)];
+        memcpy(history, promptTokens, numPromptTokens * sizeof(int));
+        batch = new int[spec->nBatches];
+        if (draft != NULL)
+            draftProbs = new float[(spec->nBatches - 1) * spec->vocabSize];
+    }
+
     // start the main loop
     long start = 0;  // used to time our code, only initialized after first iteration
     int next;        // will store the next token in the sequence
@@ -44,20 +66,70 @@ void generate(Inference* inference, SocketPool* socketPool, Tokenizer *tokenizer
     unsigned long totalTransferTime = 0;
     while (pos < args->steps) {
         unsigned long startTime = timeMs();
-        float* logits = inference->infer(token, pos);
+
+        // the prompt tokens are processed in batches, only the logits of the last token of the prompt are sampled
+        pos_t nTokens = 1;
+        if (pos < numPromptTokens - 1) {
+            nTokens = (pos_t)std::min(std::min(numPromptTokens - 1 - pos, args->steps - pos), (int)spec->nBatches);
+        }
+        int* tokens = nTokens > 1 ? &promptTokens[pos] : &token;
+        unsigned int nDrafted = 0;
+        if (isSpeculative && pos >= numPromptTokens - 1) {
+            history[pos] = token;
+            batch[0] = token;
+            unsigned int nDraft = std::min(std::min(args->nDraftTokens, spec->nBatches - 1), (unsigned int)(args->steps - pos - 1));
+            if (draft != NULL)
+                nDrafted = draft->draft(history, pos + 1, nDraft, &batch[1], draftProbs);
+            else
+                nDrafted = lookupNgramDraft(history, pos + 1, args->lookupNgram, nDraft, &batch[1]);
+        }
+
+        float* logits;
+        if (nDrafted > 0) {
+            logits = inference->inferBatch(batch, nDrafted + 1, pos, nDrafted + 1);
+            tokens = batch;
+        } else {
+            logits = inference->inferBatch(tokens, nTokens, pos);
+        }
 
         inference->getStats(&inferenceTime, &transferTime);
         socketPool->getStats(&sentBytes, &recvBytes);
 
         // advance the state machine
-        if (pos < numPromptTokens - 1) {
+        if (nDrafted > 0) {
+            // the logits of the i-th token verify the (i + 1)-th token of the batch, the first rejected draft token is
+            // replaced by a token from the residual distribution, if all are accepted the last logits give one more token
+            unsigned int nAccepted = 0;
+            bool isRejected = false;
+            while (nAccepted < nDrafted) {
+                float* probs = &logits[nAccepted * spec->vocabSize];
+                sampler->probs(probs);
+                bool isAccepted = draft != NULL
+                    ? sampler->verify(probs, &draftProbs[nAccepted * spec->vocabSize], batch[nAccepted + 1], &next)
+                    : sampler->verify(probs, batch[nAccepted + 1], &next);
+                if (!isAccepted || next == tokenizer->bosId) {
+                    isRejected = true;
+                    break;
+                }
+                nAccepted++;
+            }
+            if (!isRejected) {
+                next = sampler->sample(&logits[nDrafted * spec->vocabSize]);
+            }
+            nTokens = nAccepted + 1;
+            memcpy(&history[pos], batch, nTokens * sizeof(int));
+            if (draft != NULL)
+                draft->rollback(pos + nTokens);
+            totalDrafted += nDrafted;
+            totalAccepted += nAccepted;
+        } else if (pos + nTokens < numPromptTokens) {
             // if we are still processing the input prompt, force the next prompt token
-            next = promptTokens[pos + 1];
+            next = promptTokens[pos + nTokens];
         } else {
             // otherwise sample the next token from the logits
             next = sampler->sample(logits);
         }
-        pos++;
+        pos += nTokens;
 
         unsigned long generationTime = timeMs() - startTime;
 
@@ -70,12 +142,13 @@ void generate(Inference* inference, SocketPool* socketPool, Tokenizer *tokenizer
             break;
         }
 
-        // print the token as string, decode it with the Tokenizer object
-        char* piece = tokenizer->decode(token, next);
-
         if (args->benchmark)
             printf("🔶 G %4ld ms I %4ld ms T %4ld ms S %6ld kB R %6ld kB ", generationTime, inferenceTime, transferTime, sentBytes / 1024, recvBytes / 1024);
-        safePrintf(piece);
+        // print the tokens as string, decode them with the Tokenizer object
+        for (pos_t i = 0; i < nTokens; i++) {
+            char* piece = tokenizer->decode(tokens[i], i + 1 < nTokens ? tokens[i + 1] : next);
+            safePrintf(piece);
+        }
         if (args->benchmark)
             printf("\n");
         fflush(stdout);
@@ -83,6 +156,14 @@ void generate(Inference* inference, SocketPool* socketPool, Tokenizer *tokenizer
     }
 
     delete[] promptTokens;
+    if (isSpeculative) {
+        if (draft != NULL) {
+            delete draft;
+            delete[] draftProbs;
+        }
+        delete[] history;
+        delete[] batch;
+    }
 
     if (!args->benchmark) printf("\n");
     double avgGenerationTime = totalGenerationTime / (double)pos;
@@ -91,6 +172,8 @@ void generate(Inference* inference, SocketPool* socketPool, Tokenizer *tokenizer
     printf("Avg generation time: %.2f ms\n", avgGenerationTime);
     printf("Avg inference time:  %.2f ms\n", totalInferenceTime / (double)pos);
     printf("Avg transfer time:   %.2f ms\n", totalTransferTime / (double)pos);
+    if (totalDrafted > 0)
+        printf("Accepted draft tokens: %u / %u (%.1f%%)\n", totalAccepted, totalDrafted, 100.0 * totalAccepted / totalDrafted);
 }
 
 size_t readStdin(const char* guide, char* buffer, size_t bufsize) {
@@ -161,9 +244,12 @@ public:
             tokenizer->encode((char*)inputPrompt.c_str(), inputTokens, &nInputTokens, true, false);
 
             pos_t userPromptEndPos = (pos_t)std::min(spec->seqLen, pos + nInputTokens - 1);
-            for (pos_t i = 0; pos < userPromptEndPos; pos++, i++) {
-                inference->infer(inputTokens[i], pos);
-                token = inputTokens[i + 1];
+            for (pos_t i = 0; pos < userPromptEndPos;) {
+                pos_t nTokens = (pos_t)std::min(userPromptEndPos - pos, (int)spec->nBatches);
+                inference->inferBatch(&inputTokens[i], nTokens, pos);
+                pos += nTokens;
+                i += nTokens;
+                token = inputTokens[i];
             }
 
             printf("\n🤖 Assistant\n");
@@ -213,9 +299,25 @@ void worker(AppArgs* args) {
     AcceleratorContext acc(0, 1, NULL);
     Transformer transformer = Transformer::loadSlice(&spec, &socket, &acc);
     TransformerArch arch = TransformerArchFactory::create(&spec);
+    if (args->fusion) {
+        TransformerArchFactory::fuse(&spec, &arch);
+    }
 
-    Worker worker = Worker(&arch, args->nThreads, &transformer, &socket);
-    worker.work();
+    Worker worker = Worker(&arch, args->nThreads, args->spinBudget, &transformer, &socket);
+    if (args->tracePath == NULL) {
+        worker.work();
+        return;
+    }
+
+    // The worker runs until the root disconnects, so the trace is saved when the socket is closed.
+    worker.startTrace();
+    try {
+        worker.work();
+    } catch (ReadSocketException& e) {
+        worker.saveTrace(args->tracePath);
+        printf("📄 Saved trace to %s\n", args->tracePath);
+        throw;
+    }
 }
 
 int main(int argc, char *argv[]) {
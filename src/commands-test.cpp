@@ -22,48 +22,52 @@ void testRopeSlice(int arch, const int nSliceTests, const int nPosTests, const i
             int nSlices = pow(2, si);
 
             for (int nThreads = 1; nThreads <= nThreadTests; nThreads++) {
-                printf("pos=%d nSlices=%d threads=%d\n", pos, nSlices, nThreads);
+                for (int useCache = 1; useCache >= 0; useCache--) {
+                    printf("pos=%d nSlices=%d threads=%d useCache=%d\n", pos, nSlices, nThreads, useCache);
 
-                for (int j = 0; j < dim; j++) q[j] = 1.0;
-                for (int j = 0; j < kvDim; j++) k[j] = 1.0;
+                    for (int j = 0; j < dim; j++) q[j] = 1.0;
+                    for (int j = 0; j < kvDim; j++) k[j] = 1.0;
 
-                for (slice_index_t sliceIndex = 0; sliceIndex < nSlices; sliceIndex++) {
-                    RopeSlice slice(dim, kvDim, nKvHeads, nSlices, seqLen, headSize, ropeTheta, sliceIndex);
-                    RopeCommand* rope;
-                    if (arch == 1) {
-                        rope = new LlamaRopeCommand(&slice);
-                    } else if (arch == 2) {
-                        rope = new FalconRopeCommand(&slice);
-                    }
+                    for (slice_index_t sliceIndex = 0; sliceIndex < nSlices; sliceIndex++) {
+                        RopeSlice slice(dim, kvDim, nKvHeads, nSlices, seqLen, headSize, ropeTheta, sliceIndex);
+                        RopeCommand* rope;
+                        if (arch == 1) {
+                            rope = new LlamaRopeCommand(&slice, useCache);
+                        } else if (arch == 2) {
+                            rope = new FalconRopeCommand(&slice, useCache);
+                        }
 
-                    for (int threadIndex = 0; threadIndex < nThreads; threadIndex++) {
-                        rope->forward(
-                            true,
-                            &q[(sliceIndex * dim) / nSlices],
-                            pos, nThreads, threadIndex);
-                        rope->forward(
-                            false,
-                            &k[(sliceIndex * kvDim) / nSlices],
-                            pos, nThreads, threadIndex);
-                    }
+                        for (int threadIndex = 0; threadIndex < nThreads; threadIndex++) {
+                            rope->forward(
+                                true,
+                                &q[(sliceIndex * dim) / nSlices],
+                                pos, nThreads, threadIndex);
+                            rope->forward(
+                                false,
+                                &k[(sliceIndex * kvDim) / nSlices],
+                                pos, nThreads, threadIndex);
+                        }
 
-                    delete rope;
-                }
+                        delete rope;
+                    }
 
-                if (si == 0 && nThreads == 1) {
-                    memcpy(correctQ, q, dim * sizeof(float));
-                    memcpy(correctK, k, kvDim * sizeof(float));
-                } else {
-                    for (int j = 0; j < dim; j++) {
-                        if (fabs(q[j] - correctQ[j]) > 1e-6) {
-                            printf("q[%d] mismatch: %f != %f (arch=%d)\n", j, q[j], correctQ[j], arch);
-                            exit(EXIT_FAILURE);
+                    if (si == 0 && nThreads == 1 && useCache) {
+                        memcpy(correctQ, q, dim * sizeof(float));
+                        memcpy(correctK, k, kvDim * sizeof(float));
+                    } else {
+                        // The angles computed on the fly differ from cosf and sinf by a few ulps.
+                        const float tolerance = useCache ? 1e-6 : 1e-5;
+                        for (int j = 0; j < dim; j++) {
+                            if (fabs(q[j] - correctQ[j]) > tolerance) {
+                                printf("q[%d] mismatch: %f != %f (arch=%d)\n", j, q[j], correctQ[j], arch);
+                                exit(EXIT_FAILURE);
+                            }
                         }
-                    }
-                    for (int j = 0; j < kvDim; j++) {
-                        if (fabs(k[j] - correctK[j]) > 1e-6) {
-                            printf("k[%d] mismatch: %f != %f (arch=%d)\n", j, k[j], correctK[j], arch);
-                            exit(EXIT_FAILURE);
+                        for (int j = 0; j < kvDim; j++) {
+                            if (fabs(k[j] - correctK[j]) > tolerance) {
+                                printf("k[%d] mismatch: %f != %f (arch=%d)\n", j, k[j], correctK[j], arch);
+                                exit(EXIT_FAILURE);
+                            }
                         }
                     }
                 }
@@ -1,3 +1,4 @@
+#include <algorithm>
 #include <cassert>
 #include <cstring>
 #include <cmath>
@@ -91,17 +92,30 @@ RopeSlice::RopeSlice(unsigned int dim, unsigned int kvDim, unsigned int nKvHeads
     assert(sliceDim % 2 == 0);
 }
 
-KvCacheSlice::KvCacheSlice(unsigned int kvDim, unsigned int seqLen, unsigned int nSlices) {
+KvCacheSlice::KvCacheSlice(FloatType type, unsigned int kvDim, unsigned int seqLen, unsigned int nSlices) {
     assert(kvDim % nSlices == 0);
+    this->type = type;
     kvDim0 = kvDim / nSlices;
-    keyCacheSize = seqLen * kvDim0 * sizeof(float);
-    valueCacheSize = seqLen * kvDim0 * sizeof(float);
+    keyCacheSize = getBatchBytes(type, kvDim0, seqLen);
+    valueCacheSize = getBatchBytes(type, kvDim0, seqLen);
+}
+
+void* KvCacheSlice::at(void* cache, unsigned int pos, unsigned int offset) {
+    return (char*)cache + getBatchBytes(type, kvDim0, pos) + (offset == 0 ? 0 : getBatchBytes(type, offset, 1));
 }
 
-MultiHeadAttSlice::MultiHeadAttSlice(unsigned int nHeads, unsigned int seqLen, unsigned int nSlices, slice_index_t sliceIndex) {
+MultiHeadAttSlice::MultiHeadAttSlice(unsigned int nHeads, unsigned int headSize, unsigned int nSlices) {
     assert(nHeads % nSlices == 0);
     nHeads0 = nHeads / nSlices;
-    attSize = seqLen * nHeads0 * sizeof(float);
+    this->headSize = headSize;
+    partialsSize = ((MAX_ATTENTION_SPLITS - 1) * nHeads0 * headSize + MAX_ATTENTION_SPLITS * nHeads0 * 2) * sizeof(float);
+}
+
+unsigned int MultiHeadAttSlice::getNSplits(unsigned int nKvHeads0, unsigned int nPositions, unsigned int nThreads) {
+    unsigned int nSplits = nThreads / nKvHeads0;
+    if (nSplits > nPositions / MIN_ATTENTION_SPLIT_LEN) nSplits = nPositions / MIN_ATTENTION_SPLIT_LEN;
+    if (nSplits > MAX_ATTENTION_SPLITS) nSplits = MAX_ATTENTION_SPLITS;
+    return nSplits < 2 ? 1 : nSplits;
 }
 
 AcceleratorContext::AcceleratorContext(unsigned int nominator, unsigned int denominator, Accelerator* accelerator) {
@@ -157,18 +171,44 @@ void MatmulCommand::forward(const void* input, float* output, const unsigned int
     }
 }
 
-LlamaRopeCommand::LlamaRopeCommand(RopeSlice *slice) {
+void MatmulCommand::forwardBatch(const void* input, const size_t inputStride, float* output, const unsigned int outputStride, const unsigned int nBatches, const unsigned int nThreads, const unsigned int threadIndex) {
+    if (nBatches == 1) {
+        forward(input, output, nThreads, threadIndex);
+        return;
+    }
+    if (this->accD != 0 && threadIndex == 0) {
+        // The accelerator computes one input at a time.
+        for (unsigned int b = 0; b < nBatches; b++) {
+            acc->accelerator->beginForwardMatmul(this->accMatmulIndex, (const char*)input + b * inputStride);
+            acc->accelerator->endForwardMatmul(this->accMatmulIndex, &output[b * outputStride + cpuD]);
+        }
+    }
+    matmulBatch(weightsFloatType, inputFloatType, output, input, cpuWeights, n, cpuD, nBatches, inputStride, outputStride, nThreads, threadIndex);
+}
+
+LlamaRopeCommand::LlamaRopeCommand(RopeSlice *slice, bool useCache) {
     this->slice = slice;
 
+    const unsigned int headSize = slice->headSize;
+    freqs = new float[headSize / 2];
+    for (unsigned int headDim = 0; headDim < headSize; headDim += 2) {
+        freqs[headDim / 2] = 1.0f / powf(slice->ropeTheta, headDim / (float)headSize);
+    }
+
+    if (!useCache) {
+        assert(headSize <= ROPE_MAX_HEAD_SIZE);
+        cache = NULL;
+        return;
+    }
+
     size_t cacheBytes = slice->seqLen * slice->sliceDim * sizeof(float);
     cache = (float*)newBuffer(cacheBytes);
     printf("🕒 ropeCache: %ld kB\n", cacheBytes / 1024);
 
     for (pos_t pos = 0; pos < slice->seqLen; pos++) {
         for (unsigned int i = slice->kvDimStart; i < slice->qDimEnd; i += 2) {
-            const unsigned int headDim = i % slice->headSize;
-            const float freq = 1.0f / powf(slice->ropeTheta, headDim / (float)slice->headSize);
-            const float val = pos * freq;
+            const unsigned int headDim = i % headSize;
+            const float val = pos * freqs[headDim / 2];
             const float fcr = cosf(val);
             const float fci = sinf(val);
             cache[pos * slice->sliceDim + (i - slice->kvDimStart)] = fcr;
@@ -178,7 +218,9 @@ LlamaRopeCommand::LlamaRopeCommand(RopeSlice *slice) {
 };
 
 LlamaRopeCommand::~LlamaRopeCommand() {
-    freeBuffer(cache);
+    delete[] freqs;
+    if (cache != NULL)
+        freeBuffer(cache);
 }
 
 void LlamaRopeCommand::forward(bool isQ, float* qOrK, pos_t pos, unsigned int nThreads, unsigned int threadIndex) {
@@ -188,21 +230,68 @@ void LlamaRopeCommand::forward(bool isQ, float* qOrK, pos_t pos, unsigned int nT
     const unsigned int iStart = s * 2;
     const unsigned int iEnd = e * 2;
 
-    for (unsigned int i = iStart; i < iEnd; i += 2) {
-        float fcr = cache[pos * slice->sliceDim + shift + i];
-        float fci = cache[pos * slice->sliceDim + shift + i + 1];
-        float v0 = qOrK[i];
-        float v1 = qOrK[i + 1];
-        qOrK[i]   = v0 * fcr - v1 * fci;
-        qOrK[i + 1] = v0 * fci + v1 * fcr;
+    if (cache != NULL) {
+        ropeLlama(&qOrK[iStart], &cache[pos * slice->sliceDim + shift + iStart], iEnd - iStart);
+        return;
+    }
+    if (iStart == iEnd) return;
+
+    // All heads use the same angles, so the pairs of one head are enough for the whole range.
+    const unsigned int headSize = slice->headSize;
+    const unsigned int half = headSize / 2;
+    float cos[ROPE_MAX_HEAD_SIZE / 2];
+    float sin[ROPE_MAX_HEAD_SIZE / 2];
+    float cosSin[ROPE_MAX_HEAD_SIZE];
+    ropeCosSin(cos, sin, freqs, pos, half);
+    for (unsigned int j = 0; j < half; j++) {
+        cosSin[j * 2] = cos[j];
+        cosSin[j * 2 + 1] = sin[j];
+    }
+
+    const unsigned int dimStart = slice->kvDimStart + shift;
+    for (unsigned int i = iStart; i < iEnd;) {
+        const unsigned int headDim = (dimStart + i) % headSize;
+        const unsigned int n = std::min(headSize - headDim, iEnd - i);
+        ropeLlama(&qOrK[i], &cosSin[headDim], n);
+        i += n;
     }
 }
 
-FalconRopeCommand::FalconRopeCommand(RopeSlice *slice) {
+FalconRopeCommand::FalconRopeCommand(RopeSlice *slice, bool useCache) {
     this->slice = slice;
+
+    const unsigned int headSize = slice->headSize;
+    assert(slice->kvDim / slice->nKvHeads == headSize);
+    freqs = new float[headSize / 2];
+    for (unsigned int j = 0; j < headSize / 2; j++) {
+        freqs[j] = 1.0f / powf(slice->ropeTheta, 2.0f * (float)j / (float)headSize);
+    }
+
+    if (!useCache) {
+        assert(headSize <= ROPE_MAX_HEAD_SIZE);
+        cache = NULL;
+        return;
+    }
+
+    // Every head uses the same angles, for each position the cache contains cos[headSize / 2] and sin[headSize / 2].
+    size_t cacheBytes = slice->seqLen * headSize * sizeof(float);
+    cache = (float*)newBuffer(cacheBytes);
+    printf("🕒 ropeCache: %ld kB\n", cacheBytes / 1024);
+
+    for (pos_t pos = 0; pos < slice->seqLen; pos++) {
+        for (unsigned int j = 0; j < headSize / 2; j++) {
+            const float val = pos * freqs[j];
+            cache[pos * headSize + j] = cosf(val);
+            cache[pos * headSize + headSize / 2 + j] = sinf(val);
+        }
+    }
 }
 
-FalconRopeCommand::~FalconRopeCommand() {}
+FalconRopeCommand::~FalconRopeCommand() {
+    delete[] freqs;
+    if (cache != NULL)
+        freeBuffer(cache);
+}
 
 void FalconRopeCommand::forward(bool isQ, float* qOrK, pos_t pos, unsigned int nThreads, unsigned int threadIndex) {
     // TODO: this implementation allows only a small number of slices (because it requires dim0 % headSize == 0). This could be improved.
@@ -213,17 +302,18 @@ void FalconRopeCommand::forward(bool isQ, float* qOrK, pos_t pos, unsigned int n
     assert(dim0 % headSize == 0);
     unsigned int nHeads0 = dim0 / headSize;
     SPLIT_RANGE_TO_THREADS(h0s, h0e, 0, nHeads0, nThreads, threadIndex);
-
+    if (h0s == h0e) return;
+
+    float angles[ROPE_MAX_HEAD_SIZE];
+    const float* cos;
+    if (cache != NULL) {
+        cos = &cache[pos * headSize];
+    } else {
+        ropeCosSin(angles, &angles[headSize / 2], freqs, pos, headSize / 2);
+        cos = angles;
+    }
+    const float* sin = &cos[headSize / 2];
     for (unsigned int h = h0s; h < h0e; h++) {
-        for (unsigned int j = 0; j < headSize / 2; j++) {
-            float freq = 1.0f / powf(slice->ropeTheta, 2.0f * (float)j / (float)headSize);
-            float val = pos * freq;
-            float fcr = cosf(val);
-            float fci = sinf(val);
-            float q0 = qOrK[h * headSize + j];
-            float q1 = qOrK[h * headSize + j + headSize / 2];
-            qOrK[h * headSize + j] = q0 * fcr - q1 * fci;
-            qOrK[h * headSize + j + headSize / 2] = q0 * fci + q1 * fcr;
-        }
+        ropeFalcon(&qOrK[h * headSize], cos, sin, headSize / 2);
     }
 }
\ No newline at end of file
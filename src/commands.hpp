@@ -62,17 +62,30 @@ public:
 
 class KvCacheSlice {
 public:
+    FloatType type;
     unsigned int kvDim0;
     size_t keyCacheSize;
     size_t valueCacheSize;
-    KvCacheSlice(unsigned int kvDim, unsigned int seqLen, unsigned int nSlices);
+    KvCacheSlice(FloatType type, unsigned int kvDim, unsigned int seqLen, unsigned int nSlices);
+    // The address of the number `offset` at the position `pos` of the cache.
+    void* at(void* cache, unsigned int pos, unsigned int offset);
 };
 
+// When a node has more threads than KV heads, the positions are split into up to this many parts, the threads
+// compute the parts in parallel and the partial results are merged afterwards.
+#define MAX_ATTENTION_SPLITS 16
+// The smallest part of the positions worth a separate thread.
+#define MIN_ATTENTION_SPLIT_LEN 128
+
 class MultiHeadAttSlice {
 public:
     unsigned int nHeads0;
-    size_t attSize;
-    MultiHeadAttSlice(unsigned int nHeads, unsigned int seqLen, unsigned int nSlices, slice_index_t sliceIndex);
+    unsigned int headSize;
+    // The outputs of the parts 1..MAX_ATTENTION_SPLITS-1 (part 0 is written directly to the output), then the
+    // maximum scores and the sums of all parts.
+    size_t partialsSize;
+    MultiHeadAttSlice(unsigned int nHeads, unsigned int headSize, unsigned int nSlices);
+    unsigned int getNSplits(unsigned int nKvHeads0, unsigned int nPositions, unsigned int nThreads);
 };
 
 class Accelerator {
@@ -114,6 +127,8 @@ public:
     ~MatmulCommand();
     size_t loadWeights(const void* source);
     void forward(const void* input, float* output, const unsigned int nThreads, const unsigned int threadIndex);
+    // Multiplies `nBatches` inputs, see matmulBatch().
+    void forwardBatch(const void* input, const size_t inputStride, float* output, const unsigned int outputStride, const unsigned int nBatches, const unsigned int nThreads, const unsigned int threadIndex);
 };
 
 class RopeCommand {
@@ -122,12 +137,18 @@ public:
     virtual void forward(bool isQ, float* qOrK, pos_t pos, unsigned int nThreads, unsigned int threadIndex) = 0;
 };
 
+// Without the cache, the angles of the current position are computed in every call from the frequencies.
+#define ROPE_MAX_HEAD_SIZE 256
+
 class LlamaRopeCommand : public RopeCommand {
 private:
     RopeSlice* slice;
+    // The frequency of every pair of a head.
+    float* freqs;
+    // The (cos, sin) of every pair of the slice at every position, or NULL.
     float* cache;
 public:
-    LlamaRopeCommand(RopeSlice *slice);
+    LlamaRopeCommand(RopeSlice *slice, bool useCache);
     ~LlamaRopeCommand();
     void forward(bool isQ, float* qOrK, pos_t pos, unsigned int nThreads, unsigned int threadIndex);
 };
@@ -135,8 +156,10 @@ public:
 class FalconRopeCommand : public RopeCommand {
 private:
     RopeSlice* slice;
+    float* freqs;
+    float* cache;
 public:
-    FalconRopeCommand(RopeSlice *slice);
+    FalconRopeCommand(RopeSlice *slice, bool useCache);
     ~FalconRopeCommand();
     void forward(bool isQ, float* qOrK, pos_t pos, unsigned int nThreads, unsigned int threadIndex);
 };
@@ -28,6 +28,18 @@ static int pthread_join(dl_thread thread, void * unused) {
     CloseHandle(thread);
     return 0;
 }
+
+typedef CRITICAL_SECTION dl_mutex;
+typedef CONDITION_VARIABLE dl_cond;
+
+static void dl_mutex_init(dl_mutex* mutex) { InitializeCriticalSection(mutex); }
+static void dl_mutex_destroy(dl_mutex* mutex) { DeleteCriticalSection(mutex); }
+static void dl_mutex_lock(dl_mutex* mutex) { EnterCriticalSection(mutex); }
+static void dl_mutex_unlock(dl_mutex* mutex) { LeaveCriticalSection(mutex); }
+static void dl_cond_init(dl_cond* cond) { InitializeConditionVariable(cond); }
+static void dl_cond_destroy(dl_cond* cond) { (void) cond; }
+static void dl_cond_wait(dl_cond* cond, dl_mutex* mutex) { SleepConditionVariableCS(cond, mutex, INFINITE); }
+static void dl_cond_broadcast(dl_cond* cond) { WakeAllConditionVariable(cond); }
 #else
 #include <pthread.h>
 
@@ -35,6 +47,18 @@ typedef pthread_t dl_thread;
 typedef void* thread_ret_t;
 typedef void* (*thread_func_t)(void *);
 
+typedef pthread_mutex_t dl_mutex;
+typedef pthread_cond_t dl_cond;
+
+static inline void dl_mutex_init(dl_mutex* mutex) { pthread_mutex_init(mutex, NULL); }
+static inline void dl_mutex_destroy(dl_mutex* mutex) { pthread_mutex_destroy(mutex); }
+static inline void dl_mutex_lock(dl_mutex* mutex) { pthread_mutex_lock(mutex); }
+static inline void dl_mutex_unlock(dl_mutex* mutex) { pthread_mutex_unlock(mutex); }
+static inline void dl_cond_init(dl_cond* cond) { pthread_cond_init(cond, NULL); }
+static inline void dl_cond_destroy(dl_cond* cond) { pthread_cond_destroy(cond); }
+static inline void dl_cond_wait(dl_cond* cond, dl_mutex* mutex) { pthread_cond_wait(cond, mutex); }
+static inline void dl_cond_broadcast(dl_cond* cond) { pthread_cond_broadcast(cond); }
+
 #endif
 
 #endif  // PTHREAD_WRAPPER
@@ -0,0 +1,405 @@
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <thread>
+#include "funcs.hpp"
+#include "quants.hpp"
+#include "utils.hpp"
+
+// Measures the throughput of the kernels for the shapes of real models. A matmul is memory-bound, so its
+// bandwidth is compared with the read bandwidth of the machine measured with the same number of threads.
+// Small slices fit in the cache, then the bandwidth may exceed 100%.
+
+#define SLICE_NONE 0 // computed only by the root node
+#define SLICE_D 1 // RowMatmulSlice, each node computes d / nSlices rows
+#define SLICE_N 2 // ColMatmulSlice, each node multiplies n / nSlices columns
+
+struct BenchModel {
+    const char* name;
+    unsigned int dim;
+    unsigned int hiddenDim;
+    unsigned int kvDim;
+    unsigned int headSize;
+    unsigned int vocabSize;
+    unsigned int seqLen;
+    unsigned int nExperts;
+    bool isMoe;
+};
+
+static const BenchModel models[] = {
+    { "llama3-8b", 4096, 14336, 1024, 128, 128256, 8192, 0, false },
+    { "llama3-70b", 8192, 28672, 1024, 128, 128256, 8192, 0, false },
+    { "mixtral", 4096, 14336, 1024, 128, 32000, 32768, 8, true },
+};
+
+struct BenchMatmul {
+    const char* name;
+    unsigned int n;
+    unsigned int d;
+    unsigned int slice;
+};
+
+static unsigned int getMatmuls(const BenchModel* m, BenchMatmul* matmuls) {
+    unsigned int i = 0;
+    matmuls[i++] = { "q", m->dim, m->dim, SLICE_D };
+    matmuls[i++] = { "k, v", m->dim, m->kvDim, SLICE_D };
+    matmuls[i++] = { "wo", m->dim, m->dim, SLICE_N };
+    if (m->isMoe) {
+        matmuls[i++] = { "router", m->dim, m->nExperts, SLICE_NONE };
+        matmuls[i++] = { "expert up, gate", m->dim, m->hiddenDim, SLICE_D };
+        matmuls[i++] = { "expert down", m->hiddenDim, m->dim, SLICE_D };
+    } else {
+        matmuls[i++] = { "w1, w3", m->dim, m->hiddenDim, SLICE_D };
+        matmuls[i++] = { "w2", m->hiddenDim, m->dim, SLICE_N };
+    }
+    matmuls[i++] = { "wcls", m->dim, m->vocabSize, SLICE_NONE };
+    return i;
+}
+
+struct BenchCase;
+typedef void (BenchHandler)(BenchCase* c, unsigned int nThreads, unsigned int threadIndex);
+
+struct BenchCase {
+    BenchHandler* handler;
+    bool isMultiThreaded;
+    FloatType weightsFloatType;
+    FloatType inputFloatType;
+    unsigned int n;
+    unsigned int d;
+    void* weights;
+    void* input;
+    float* output;
+    double bytes;
+    double flops;
+};
+
+struct BenchResult {
+    double bestNs;
+    double avgNs;
+};
+
+static void benchTask(unsigned int nThreads, unsigned int threadIndex, void* userData) {
+    BenchCase* c = (BenchCase*)userData;
+    if (c->isMultiThreaded) {
+        c->handler(c, nThreads, threadIndex);
+    } else if (threadIndex == 0) {
+        c->handler(c, 1, 0);
+    }
+}
+
+static BenchResult measure(BenchCase* c, unsigned int nThreads, unsigned long minTimeNs) {
+    TaskLoopTask tasks[] = { { benchTask, 0, 0, "bench" } };
+    TaskLoop loop(nThreads, 1, 1, tasks, c, TASK_LOOP_DEFAULT_SPIN_BUDGET);
+    loop.run(); // warm up
+
+    unsigned long best = ~0UL;
+    unsigned long total = 0;
+    unsigned int nRuns = 0;
+    while (nRuns < 3 || total < minTimeNs) {
+        unsigned long t0 = timeNs();
+        loop.run();
+        unsigned long t = timeNs() - t0;
+        if (t < best) best = t;
+        total += t;
+        nRuns++;
+    }
+    BenchResult result;
+    result.bestNs = (double)best;
+    result.avgNs = (double)total / nRuns;
+    return result;
+}
+
+static void readMemory(BenchCase* c, unsigned int nThreads, unsigned int threadIndex) {
+    SPLIT_RANGE_TO_THREADS(start, end, 0, c->n, nThreads, threadIndex);
+    const unsigned long long* x = &((unsigned long long*)c->input)[start];
+    const unsigned long long* e = &((unsigned long long*)c->input)[end];
+    unsigned long long s[8] = { 0, 0, 0, 0, 0, 0, 0, 0 };
+    for (; x + 8 <= e; x += 8) {
+        for (unsigned int j = 0; j < 8; j++) s[j] += x[j];
+    }
+    for (; x < e; x++) s[0] += *x;
+    c->output[threadIndex] = (float)(s[0] + s[1] + s[2] + s[3] + s[4] + s[5] + s[6] + s[7]);
+}
+
+static void benchMatmul(BenchCase* c, unsigned int nThreads, unsigned int threadIndex) {
+    matmul(c->weightsFloatType, c->inputFloatType, c->output, c->input, c->weights, c->n, c->d, nThreads, threadIndex);
+}
+
+static void benchQuantizeQ80(BenchCase* c, unsigned int nThreads, unsigned int threadIndex) {
+    quantizeQ80Row((float*)c->input, (BlockQ80*)c->weights, c->n, nThreads, threadIndex);
+}
+
+static void benchDequantizeQ80(BenchCase* c, unsigned int nThreads, unsigned int threadIndex) {
+    dequantizeQ80Row((BlockQ80*)c->weights, c->output, c->n, nThreads, threadIndex);
+}
+
+static void benchRmsnorm(BenchCase* c, unsigned int nThreads, unsigned int threadIndex) {
+    const float* x = (float*)c->input;
+    rmsnorm(c->output, x, rms(x, c->n), (float*)c->weights, c->n, nThreads, threadIndex);
+}
+
+static void benchSoftmax(BenchCase* c, unsigned int nThreads, unsigned int threadIndex) {
+    memcpy(c->output, c->input, c->n * sizeof(float));
+    softmax(c->output, c->n);
+}
+
+// Attention scores of one head: the query multiplied by the keys of all positions.
+static void benchDotProduct(BenchCase* c, unsigned int nThreads, unsigned int threadIndex) {
+    const float* q = (float*)c->input;
+    const float* k = (float*)c->weights;
+    SPLIT_RANGE_TO_THREADS(start, end, 0, c->d, nThreads, threadIndex);
+    for (unsigned int p = start; p < end; p++) {
+        c->output[p] = dotProduct(q, &k[p * c->n], c->n);
+    }
+}
+
+static void benchSilu(BenchCase* c, unsigned int nThreads, unsigned int threadIndex) {
+    SPLIT_RANGE_TO_THREADS(start, end, 0, c->n, nThreads, threadIndex);
+    memcpy(&c->output[start], &((float*)c->input)[start], (end - start) * sizeof(float));
+    silu(c->output, c->n, nThreads, threadIndex);
+}
+
+static void benchMul(BenchCase* c, unsigned int nThreads, unsigned int threadIndex) {
+    mul(c->output, (float*)c->input, c->n, nThreads, threadIndex);
+}
+
+static void benchAdd(BenchCase* c, unsigned int nThreads, unsigned int threadIndex) {
+    add(c->output, (float*)c->input, c->n, nThreads, threadIndex);
+}
+
+static const char* floatTypeNames[] = { "f32", "f16", "q40", "q80" };
+
+FloatType parseFloatType(char* val) {
+    for (int i = 0; i < 4; i++) {
+        if (strcmp(val, floatTypeNames[i]) == 0) return (FloatType)i;
+    }
+    printf("Invalid float type %s\n", val);
+    exit(EXIT_FAILURE);
+}
+
+static void fillRandom(FloatType type, void* data, unsigned long n, unsigned long long* state) {
+    if (type == F32) {
+        float* x = (float*)data;
+        for (unsigned long i = 0; i < n; i++) x[i] = randomF32(state) - 0.5f;
+    } else if (type == F16) {
+        uint16_t* x = (uint16_t*)data;
+        for (unsigned long i = 0; i < n; i++) x[i] = convertF32ToF16(randomF32(state) - 0.5f);
+    } else if (type == Q40) {
+        BlockQ40* x = (BlockQ40*)data;
+        for (unsigned long i = 0; i < n / QK40; i++) {
+            x[i].d = 0x2000 + randomU32(state) % 0x1000;
+            for (int j = 0; j < QK40 / 2; j++) x[i].qs[j] = randomU32(state) & 0xFF;
+        }
+    } else if (type == Q80) {
+        BlockQ80* x = (BlockQ80*)data;
+        for (unsigned long i = 0; i < n / QK80; i++) {
+            x[i].d = 0x2000 + randomU32(state) % 0x1000;
+            for (int j = 0; j < QK80; j++) x[i].qs[j] = (int8_t)((int)(randomU32(state) % 255) - 127);
+        }
+    }
+}
+
+struct BenchArgs {
+    const char* model;
+    int weightsFloatType;
+    int bufferFloatType;
+    unsigned int nThreads;
+    unsigned int nSlices;
+    unsigned long minTimeNs;
+};
+
+static BenchArgs parseArgs(int argc, char** argv) {
+    BenchArgs args;
+    args.model = NULL;
+    args.weightsFloatType = -1;
+    args.bufferFloatType = -1;
+    args.nThreads = std::thread::hardware_concurrency();
+    if (args.nThreads == 0) args.nThreads = 1;
+    args.nSlices = 1;
+    args.minTimeNs = 250 * 1000000UL;
+
+    for (int i = 1; i + 1 < argc; i += 2) {
+        if (strcmp(argv[i], "--model") == 0) {
+            args.model = argv[i + 1];
+        } else if (strcmp(argv[i], "--weights-float-type") == 0) {
+            args.weightsFloatType = parseFloatType(argv[i + 1]);
+        } else if (strcmp(argv[i], "--buffer-float-type") == 0) {
+            args.bufferFloatType = parseFloatType(argv[i + 1]);
+        } else if (strcmp(argv[i], "--nthreads") == 0) {
+            args.nThreads = atoi(argv[i + 1]);
+        } else if (strcmp(argv[i], "--nslices") == 0) {
+            args.nSlices = atoi(argv[i + 1]);
+        } else if (strcmp(argv[i], "--min-time") == 0) {
+            args.minTimeNs = atol(argv[i + 1]) * 1000000UL;
+        } else {
+            printf("Unknown option %s\n", argv[i]);
+            exit(EXIT_FAILURE);
+        }
+    }
+    if (args.nThreads < 1 || args.nSlices < 1) {
+        printf("Invalid --nthreads or --nslices\n");
+        exit(EXIT_FAILURE);
+    }
+    return args;
+}
+
+// 1, 2, 4, ... and the maximum.
+static unsigned int getThreadCounts(unsigned int maxThreads, unsigned int* counts) {
+    unsigned int n = 0;
+    for (unsigned int t = 1; t < maxThreads; t *= 2) counts[n++] = t;
+    counts[n++] = maxThreads;
+    return n;
+}
+
+static void printHeader() {
+    printf("%-11s %-16s %6s %6s %-7s %5s %10s %10s %8s %8s %5s\n",
+        "model", "op", "n", "d", "types", "thr", "best us", "avg us", "GFLOP/s", "GB/s", "bw");
+}
+
+static void printResult(const char* model, const char* op, BenchCase* c, const char* types, unsigned int nThreads, BenchResult r, double peakBytesPerNs) {
+    const double gbs = c->bytes / r.bestNs;
+    printf("%-11s %-16s %6u %6u %-7s %5u %10.1f %10.1f ", model, op, c->n, c->d, types, nThreads, r.bestNs / 1000.0, r.avgNs / 1000.0);
+    if (c->flops > 0) {
+        printf("%8.2f ", c->flops / r.bestNs);
+    } else {
+        printf("%8s ", "-");
+    }
+    printf("%8.2f %4.0f%%\n", gbs, 100.0 * gbs / peakBytesPerNs);
+}
+
+int main(int argc, char** argv) {
+    initQuants();
+    BenchArgs args = parseArgs(argc, argv);
+    unsigned long long state = 800000010L;
+
+    unsigned int threadCounts[32];
+    const unsigned int nThreadCounts = getThreadCounts(args.nThreads, threadCounts);
+
+    printf("💡 kernels: %s\n", getKernelsName());
+    printf("💡 nSlices: %u\n", args.nSlices);
+
+    // The buffer is much larger than the last level cache.
+    const unsigned long readSize = 256 * 1024 * 1024;
+    BenchCase read;
+    memset(&read, 0, sizeof(BenchCase));
+    read.handler = readMemory;
+    read.isMultiThreaded = true;
+    read.n = readSize / sizeof(unsigned long long);
+    read.input = newBuffer(readSize);
+    read.output = new float[args.nThreads];
+    read.bytes = (double)readSize;
+    memset(read.input, 1, readSize);
+    double peakBytesPerNs[32];
+    for (unsigned int t = 0; t < nThreadCounts; t++) {
+        BenchResult r = measure(&read, threadCounts[t], args.minTimeNs);
+        peakBytesPerNs[t] = read.bytes / r.bestNs;
+        printf("💡 memory read: %.2f GB/s (%u threads)\n", peakBytesPerNs[t], threadCounts[t]);
+    }
+    freeBuffer(read.input);
+    delete[] read.output;
+
+    printHeader();
+    for (unsigned int mi = 0; mi < sizeof(models) / sizeof(BenchModel); mi++) {
+        const BenchModel* model = &models[mi];
+        if (args.model != NULL && strcmp(args.model, model->name) != 0) continue;
+
+        BenchMatmul matmuls[8];
+        const unsigned int nMatmuls = getMatmuls(model, matmuls);
+        for (unsigned int i = 0; i < nMatmuls; i++) {
+            BenchMatmul* mm = &matmuls[i];
+            const unsigned int n = mm->slice == SLICE_N ? mm->n / args.nSlices : mm->n;
+            const unsigned int d = mm->slice == SLICE_D ? mm->d / args.nSlices : mm->d;
+            if (n % QK80 != 0 || d == 0) continue;
+
+            for (int w = F32; w <= Q80; w++) {
+                if (args.weightsFloatType >= 0 && args.weightsFloatType != w) continue;
+                const FloatType weightsFloatType = (FloatType)w;
+                const unsigned long weightsBytes = getBatchBytes(weightsFloatType, n, d);
+                void* weights = newBuffer(weightsBytes);
+                fillRandom(weightsFloatType, weights, (unsigned long)n * d, &state);
+
+                const FloatType inputFloatTypes[] = { F32, Q80 };
+                for (unsigned int b = 0; b < 2; b++) {
+                    const FloatType inputFloatType = inputFloatTypes[b];
+                    if (args.bufferFloatType >= 0 && args.bufferFloatType != inputFloatType) continue;
+                    if (weightsFloatType == F32 && inputFloatType == Q80) continue;
+
+                    BenchCase c;
+                    c.handler = benchMatmul;
+                    c.isMultiThreaded = true;
+                    c.weightsFloatType = weightsFloatType;
+                    c.inputFloatType = inputFloatType;
+                    c.n = n;
+                    c.d = d;
+                    c.weights = weights;
+                    c.input = newBuffer(getBatchBytes(inputFloatType, n, 1));
+                    c.output = new float[d];
+                    fillRandom(inputFloatType, c.input, n, &state);
+                    c.bytes = (double)weightsBytes + getBatchBytes(inputFloatType, n, 1) + d * sizeof(float);
+                    c.flops = 2.0 * n * d;
+
+                    char types[16];
+                    snprintf(types, sizeof(types), "%sx%s", floatTypeNames[w], floatTypeNames[inputFloatType]);
+                    for (unsigned int t = 0; t < nThreadCounts; t++) {
+                        BenchResult r = measure(&c, threadCounts[t], args.minTimeNs);
+                        printResult(model->name, mm->name, &c, types, threadCounts[t], r, peakBytesPerNs[t]);
+                    }
+                    freeBuffer(c.input);
+                    delete[] c.output;
+                }
+                freeBuffer(weights);
+            }
+        }
+
+        // Other kernels, always F32 buffers.
+        struct {
+            const char* name;
+            BenchHandler* handler;
+            bool isMultiThreaded;
+            unsigned int n;
+            unsigned int d;
+            double bytes;
+        } ops[] = {
+            { "quantizeQ80Row", benchQuantizeQ80, true, model->dim, 1, model->dim * 4.0 + getBatchBytes(Q80, model->dim, 1) },
+            { "dequantizeQ80Row", benchDequantizeQ80, true, model->dim, 1, model->dim * 4.0 + getBatchBytes(Q80, model->dim, 1) },
+            { "rmsnorm", benchRmsnorm, false, model->dim, 1, model->dim * 12.0 },
+            { "softmax", benchSoftmax, false, model->seqLen, 1, model->seqLen * 8.0 },
+            { "dotProduct", benchDotProduct, true, model->headSize, model->seqLen, (double)model->headSize * model->seqLen * 4.0 },
+            { "silu", benchSilu, true, model->hiddenDim, 1, model->hiddenDim * 16.0 },
+            { "mul", benchMul, true, model->hiddenDim, 1, model->hiddenDim * 12.0 },
+            { "add", benchAdd, true, model->dim, 1, model->dim * 12.0 },
+        };
+        for (unsigned int i = 0; i < sizeof(ops) / sizeof(ops[0]); i++) {
+            const unsigned long size = (unsigned long)ops[i].n * ops[i].d;
+            BenchCase c;
+            c.handler = ops[i].handler;
+            c.isMultiThreaded = ops[i].isMultiThreaded;
+            c.weightsFloatType = F32;
+            c.inputFloatType = F32;
+            c.n = ops[i].n;
+            c.d = ops[i].d;
+            c.input = newBuffer(size * sizeof(float));
+            c.weights = newBuffer(size * sizeof(float));
+            c.output = new float[size];
+            fillRandom(F32, c.input, size, &state);
+            fillRandom(F32, c.weights, size, &state);
+            fillRandom(F32, c.output, size, &state);
+            if (c.handler == benchMul) {
+                // Repeated runs keep the magnitude of the output, so it doesn't become denormal.
+                for (unsigned long j = 0; j < size; j++) ((float*)c.input)[j] = (randomU32(&state) & 1) ? 1.0f : -1.0f;
+            }
+            c.bytes = ops[i].bytes;
+            c.flops = 0;
+
+            for (unsigned int t = 0; t < nThreadCounts; t++) {
+                if (!c.isMultiThreaded && threadCounts[t] > 1) break;
+                BenchResult r = measure(&c, threadCounts[t], args.minTimeNs);
+                printResult(model->name, ops[i].name, &c, "f32", threadCounts[t], r, peakBytesPerNs[t]);
+            }
+            freeBuffer(c.input);
+            freeBuffer(c.weights);
+            delete[] c.output;
+        }
+    }
+    return EXIT_SUCCESS;
+}
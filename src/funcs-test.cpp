@@ -4,6 +4,7 @@
 #include <cstdlib>
 #include <cmath>
 #include <cassert>
+#include <cstring>
 
 void testRms() {
     float x[] = {0.1f, 0.2f, 0.3f, 0.4f, 0.5f, 0.6f, 0.7f, 0.8f};
@@ -59,6 +60,338 @@ void testMatmulQ80() {
     delete[] wQ;
 }
 
+void testMatmulQ40vQ80() {
+    const int n = 512;
+    const int d = 61; // not divisible by the number of rows computed at once
+    const int nb = n / QK40;
+    unsigned long long state = 99999999L;
+    float x[n];
+    float xDq[n];
+    float row[n];
+    float y[d];
+    float yQ[d];
+    int i;
+    for (i = 0; i < n; i++) x[i] = randomF32(&state) / 127.0f;
+
+    BlockQ80* xQ = new BlockQ80[nb];
+    BlockQ40* wQ = new BlockQ40[nb * d];
+    quantizeQ80Row(x, xQ, n, 1, 0);
+    dequantizeQ80Row(xQ, xDq, n, 1, 0);
+    for (i = 0; i < nb * d; i++) {
+        wQ[i].d = 0x2000 + randomU32(&state) % 0x1000;
+        for (int j = 0; j < QK40 / 2; j++) wQ[i].qs[j] = randomU32(&state) & 0xFF;
+    }
+
+    for (i = 0; i < d; i++) {
+        dequantizeQ40Row(&wQ[i * nb], row, n);
+        double sum = 0.0;
+        for (int j = 0; j < n; j++) sum += row[j] * xDq[j];
+        y[i] = (float)sum;
+    }
+
+    for (int nThreads = 1; nThreads < 4; nThreads++) {
+        for (int threadIndex = 0; threadIndex < nThreads; threadIndex++) {
+            matmul(Q40, Q80, yQ, xQ, wQ, n, d, nThreads, threadIndex);
+        }
+
+        for (i = 0; i < d; i++) {
+            float diff = fabs(y[i] - yQ[i]);
+            if (diff > 0.0001) {
+                printf("❌ matmulQ40vQ80() ix=%d %f != %f diff=%f (nThreads=%d)\n", i, y[i], yQ[i], diff, nThreads);
+                exit(EXIT_FAILURE);
+            }
+        }
+    }
+    printf("✅ matmulQ40vQ80\n");
+
+    delete[] xQ;
+    delete[] wQ;
+}
+
+void testMatmulQ80Rows() {
+    const int n = 512;
+    const int d = 61; // not divisible by the number of rows computed at once
+    const int nb = n / QK80;
+    unsigned long long state = 77777777L;
+    float x[n];
+    float xDq[n];
+    float row[n];
+    float yF[d];
+    float yQ[d];
+    float y[d];
+    float yQF[d];
+    int i;
+    for (i = 0; i < n; i++) x[i] = randomF32(&state) / 127.0f;
+
+    BlockQ80* xQ = new BlockQ80[nb];
+    BlockQ80* wQ = new BlockQ80[nb * d];
+    quantizeQ80Row(x, xQ, n, 1, 0);
+    dequantizeQ80Row(xQ, xDq, n, 1, 0);
+    for (i = 0; i < nb * d; i++) {
+        wQ[i].d = 0x2000 + randomU32(&state) % 0x1000;
+        // The full range of the quantizer, [-127, 127]
+        for (int j = 0; j < QK80; j++) wQ[i].qs[j] = (int8_t)((int)(randomU32(&state) % 255) - 127);
+    }
+
+    for (i = 0; i < d; i++) {
+        dequantizeQ80Row(&wQ[i * nb], row, n, 1, 0);
+        double sumF = 0.0;
+        double sumQ = 0.0;
+        for (int j = 0; j < n; j++) {
+            sumF += row[j] * x[j];
+            sumQ += row[j] * xDq[j];
+        }
+        yF[i] = (float)sumF;
+        yQ[i] = (float)sumQ;
+    }
+
+    for (int nThreads = 1; nThreads < 4; nThreads++) {
+        for (int threadIndex = 0; threadIndex < nThreads; threadIndex++) {
+            matmul(Q80, F32, yQF, x, wQ, n, d, nThreads, threadIndex);
+            matmul(Q80, Q80, y, xQ, wQ, n, d, nThreads, threadIndex);
+        }
+
+        for (i = 0; i < d; i++) {
+            float diff = fabs(yF[i] - yQF[i]);
+            if (diff > 0.0001) {
+                printf("❌ matmulQ80() ix=%d %f != %f diff=%f (nThreads=%d)\n", i, yF[i], yQF[i], diff, nThreads);
+                exit(EXIT_FAILURE);
+            }
+            diff = fabs(yQ[i] - y[i]);
+            if (diff > 0.0001) {
+                printf("❌ matmulQ80vQ80() ix=%d %f != %f diff=%f (nThreads=%d)\n", i, yQ[i], y[i], diff, nThreads);
+                exit(EXIT_FAILURE);
+            }
+        }
+    }
+    printf("✅ matmulQ80Rows\n");
+
+    delete[] xQ;
+    delete[] wQ;
+}
+
+void testMatmulF16() {
+    const int n = 512;
+    const int d = 61; // not divisible by the number of rows computed at once
+    const int nb = n / QK80;
+    unsigned long long state = 66666666L;
+    float x[n];
+    float xDq[n];
+    float yF[d];
+    float yQ[d];
+    float y[d];
+    float yQF[d];
+    int i;
+    for (i = 0; i < n; i++) x[i] = randomF32(&state) / 127.0f;
+
+    BlockQ80* xQ = new BlockQ80[nb];
+    uint16_t* w = new uint16_t[n * d];
+    quantizeQ80Row(x, xQ, n, 1, 0);
+    dequantizeQ80Row(xQ, xDq, n, 1, 0);
+    for (i = 0; i < n * d; i++) w[i] = convertF32ToF16(randomF32(&state) - 0.5f);
+
+    for (i = 0; i < d; i++) {
+        double sumF = 0.0;
+        double sumQ = 0.0;
+        for (int j = 0; j < n; j++) {
+            const float ww = convertF16ToF32(w[i * n + j]);
+            sumF += ww * x[j];
+            sumQ += ww * xDq[j];
+        }
+        yF[i] = (float)sumF;
+        yQ[i] = (float)sumQ;
+    }
+
+    for (int nThreads = 1; nThreads < 4; nThreads++) {
+        for (int threadIndex = 0; threadIndex < nThreads; threadIndex++) {
+            matmul(F16, F32, yQF, x, w, n, d, nThreads, threadIndex);
+            matmul(F16, Q80, y, xQ, w, n, d, nThreads, threadIndex);
+        }
+
+        for (i = 0; i < d; i++) {
+            float diff = fabs(yF[i] - yQF[i]);
+            if (diff > 0.0001) {
+                printf("❌ matmulF16() ix=%d %f != %f diff=%f (nThreads=%d)\n", i, yF[i], yQF[i], diff, nThreads);
+                exit(EXIT_FAILURE);
+            }
+            diff = fabs(yQ[i] - y[i]);
+            if (diff > 0.0001) {
+                printf("❌ matmulF16vQ80() ix=%d %f != %f diff=%f (nThreads=%d)\n", i, yQ[i], y[i], diff, nThreads);
+                exit(EXIT_FAILURE);
+            }
+        }
+    }
+    printf("✅ matmulF16\n");
+
+    delete[] xQ;
+    delete[] w;
+}
+
+void testMatmulBatch() {
+    const int n = 512;
+    const int d = 301; // more than one tile, not divisible by the number of rows computed at once
+    const int nb = n / QK40;
+    const int nBatches = 5;
+    const int inputStride = nb + 1; // the rows of the input don't have to be adjacent
+    const int outputStride = d + 3;
+    unsigned long long state = 55555555L;
+    float x[n];
+    float y[d];
+    float yB[nBatches * outputStride];
+    int i;
+
+    BlockQ80* xQ = new BlockQ80[inputStride * nBatches];
+    BlockQ40* wQ = new BlockQ40[nb * d];
+    for (int b = 0; b < nBatches; b++) {
+        for (i = 0; i < n; i++) x[i] = randomF32(&state) / 127.0f;
+        quantizeQ80Row(x, &xQ[b * inputStride], n, 1, 0);
+    }
+    for (i = 0; i < nb * d; i++) {
+        wQ[i].d = 0x2000 + randomU32(&state) % 0x1000;
+        for (int j = 0; j < QK40 / 2; j++) wQ[i].qs[j] = randomU32(&state) & 0xFF;
+    }
+
+    for (int nThreads = 1; nThreads < 4; nThreads++) {
+        for (int threadIndex = 0; threadIndex < nThreads; threadIndex++) {
+            matmulBatch(Q40, Q80, yB, xQ, wQ, n, d, nBatches, inputStride * sizeof(BlockQ80), outputStride, nThreads, threadIndex);
+        }
+
+        for (int b = 0; b < nBatches; b++) {
+            matmul(Q40, Q80, y, &xQ[b * inputStride], wQ, n, d, 1, 0);
+            for (i = 0; i < d; i++) {
+                if (y[i] != yB[b * outputStride + i]) {
+                    printf("❌ matmulBatch() b=%d ix=%d %f != %f (nThreads=%d)\n", b, i, y[i], yB[b * outputStride + i], nThreads);
+                    exit(EXIT_FAILURE);
+                }
+            }
+        }
+    }
+    printf("✅ matmulBatch\n");
+
+    delete[] xQ;
+    delete[] wQ;
+}
+
+void testAttention() {
+    const int headSize = 128;
+    const int kvStride = 2 * headSize; // two KV heads, the second one is tested
+    const int seqLen = 200;
+    const int maxQueries = 10;
+    unsigned long long state = 55555555L;
+    float q[maxQueries * headSize];
+    float* keys = new float[seqLen * kvStride];
+    float* values = new float[seqLen * kvStride];
+    float* keyCache = new float[seqLen * kvStride];
+    float* valueCache = new float[seqLen * kvStride];
+    char* keyCacheQ = new char[seqLen * kvStride * sizeof(float)];
+    char* valueCacheQ = new char[seqLen * kvStride * sizeof(float)];
+    float scores[seqLen];
+    float expected[maxQueries * headSize];
+    float output[maxQueries * headSize];
+    int i;
+    for (i = 0; i < maxQueries * headSize; i++) q[i] = randomF32(&state) * 4.0f - 2.0f;
+    for (i = 0; i < seqLen * kvStride; i++) {
+        keys[i] = randomF32(&state) * 4.0f - 2.0f;
+        values[i] = randomF32(&state) - 0.5f;
+    }
+
+    const FloatType cacheFloatTypes[] = { F32, F16, Q80 };
+    for (int f = 0; f < 3; f++) {
+        const FloatType cacheFloatType = cacheFloatTypes[f];
+        // The expected values are calculated from the numbers stored in the cache
+        if (cacheFloatType == F32) {
+            memcpy(keyCacheQ, keys, seqLen * kvStride * sizeof(float));
+            memcpy(valueCacheQ, values, seqLen * kvStride * sizeof(float));
+            memcpy(keyCache, keys, seqLen * kvStride * sizeof(float));
+            memcpy(valueCache, values, seqLen * kvStride * sizeof(float));
+        } else if (cacheFloatType == F16) {
+            for (i = 0; i < seqLen * kvStride; i++) {
+                ((uint16_t*)keyCacheQ)[i] = convertF32ToF16(keys[i]);
+                ((uint16_t*)valueCacheQ)[i] = convertF32ToF16(values[i]);
+                keyCache[i] = convertF16ToF32(((uint16_t*)keyCacheQ)[i]);
+                valueCache[i] = convertF16ToF32(((uint16_t*)valueCacheQ)[i]);
+            }
+        } else {
+            quantizeQ80Row(keys, (BlockQ80*)keyCacheQ, seqLen * kvStride, 1, 0);
+            quantizeQ80Row(values, (BlockQ80*)valueCacheQ, seqLen * kvStride, 1, 0);
+            dequantizeQ80Row((BlockQ80*)keyCacheQ, keyCache, seqLen * kvStride, 1, 0);
+            dequantizeQ80Row((BlockQ80*)valueCacheQ, valueCache, seqLen * kvStride, 1, 0);
+        }
+        const long headOffset = getBatchBytes(cacheFloatType, headSize, 1);
+
+        // Not aligned to the tile size, 64; more queries than fit in one group, 8
+        const int nPositions[] = { 1, 63, 64, 65, seqLen };
+        const int nQueries[] = { 1, 4, maxQueries };
+        for (int c = 0; c < 15; c++) {
+            const int n = nPositions[c % 5];
+            const int nq = nQueries[c / 5];
+            for (int g = 0; g < nq; g++) {
+                const float* gq = &q[g * headSize];
+                double maxScore = -1e30;
+                for (int t = 0; t < n; t++) {
+                    double score = 0.0;
+                    for (i = 0; i < headSize; i++) score += gq[i] * keyCache[t * kvStride + headSize + i];
+                    scores[t] = (float)(score / sqrt((double)headSize));
+                    if (scores[t] > maxScore) maxScore = scores[t];
+                }
+                double sum = 0.0;
+                for (int t = 0; t < n; t++) sum += exp(scores[t] - maxScore);
+                for (i = 0; i < headSize; i++) {
+                    double v = 0.0;
+                    for (int t = 0; t < n; t++) v += exp(scores[t] - maxScore) / sum * valueCache[t * kvStride + headSize + i];
+                    expected[g * headSize + i] = (float)v;
+                }
+            }
+
+            attention(cacheFloatType, output, q, keyCacheQ + headOffset, valueCacheQ + headOffset, kvStride, headSize, nq, n);
+
+            for (i = 0; i < nq * headSize; i++) {
+                float diff = fabs(expected[i] - output[i]);
+                if (diff > 0.00001) {
+                    printf("❌ attention() ix=%d %f != %f diff=%f (cacheFloatType=%d, nQueries=%d, nPositions=%d)\n", i, expected[i], output[i], diff, cacheFloatType, nq, n);
+                    exit(EXIT_FAILURE);
+                }
+            }
+
+            // The positions split into 3 parts and merged (log-sum-exp)
+            if (n >= 3) {
+                float partOutput[3][maxQueries * headSize];
+                float partMax[3][maxQueries];
+                float partSum[3][maxQueries];
+                for (int p = 0; p < 3; p++) {
+                    const int t0 = n * p / 3;
+                    const int t1 = n * (p + 1) / 3;
+                    const long offset = headOffset + getBatchBytes(cacheFloatType, t0 * kvStride, 1);
+                    attentionPartial(cacheFloatType, partOutput[p], partMax[p], partSum[p], q, keyCacheQ + offset, valueCacheQ + offset, kvStride, headSize, nq, t1 - t0);
+                }
+                for (int g = 0; g < nq; g++) {
+                    float maxScore = fmaxf(partMax[0][g], fmaxf(partMax[1][g], partMax[2][g]));
+                    float sum = 0.0f;
+                    for (int p = 0; p < 3; p++) sum += expf(partMax[p][g] - maxScore) * partSum[p][g];
+                    for (i = 0; i < headSize; i++) {
+                        float v = 0.0f;
+                        for (int p = 0; p < 3; p++) v += expf(partMax[p][g] - maxScore) * partOutput[p][g * headSize + i];
+                        v /= sum;
+                        float diff = fabs(expected[g * headSize + i] - v);
+                        if (diff > 0.00001) {
+                            printf("❌ attentionPartial() ix=%d %f != %f diff=%f (cacheFloatType=%d, nQueries=%d, nPositions=%d)\n", g * headSize + i, expected[g * headSize + i], v, diff, cacheFloatType, nq, n);
+                            exit(EXIT_FAILURE);
+                        }
+                    }
+                }
+            }
+        }
+    }
+    printf("✅ attention\n");
+
+    delete[] keys;
+    delete[] values;
+    delete[] keyCache;
+    delete[] valueCache;
+    delete[] keyCacheQ;
+    delete[] valueCacheQ;
+}
+
 void testAdd() {
     const int n = 16;
     float a[n];
@@ -85,6 +418,64 @@ void testAdd() {
     printf("✅ add\n");
 }
 
+void testRope() {
+    const int n = 70; // not aligned to the vector width
+    unsigned long long state = 12345678L;
+    float x[n];
+    float y[n];
+    float angles[n];
+    float cos[n / 2];
+    float sin[n / 2];
+    for (int i = 0; i < n; i++) {
+        x[i] = randomF32(&state) * 2.0f - 1.0f;
+        y[i] = x[i];
+    }
+    for (int j = 0; j < n / 2; j++) {
+        cos[j] = cosf(j * 0.1f);
+        sin[j] = sinf(j * 0.1f);
+        angles[j * 2] = cos[j];
+        angles[j * 2 + 1] = sin[j];
+    }
+
+    ropeLlama(y, angles, n);
+    for (int j = 0; j < n / 2; j++) {
+        float e0 = x[j * 2] * cos[j] - x[j * 2 + 1] * sin[j];
+        float e1 = x[j * 2] * sin[j] + x[j * 2 + 1] * cos[j];
+        if (fabs(y[j * 2] - e0) > 1e-6 || fabs(y[j * 2 + 1] - e1) > 1e-6) {
+            printf("❌ ropeLlama() j=%d (%f, %f) != (%f, %f)\n", j, y[j * 2], y[j * 2 + 1], e0, e1);
+            exit(EXIT_FAILURE);
+        }
+    }
+
+    memcpy(y, x, n * sizeof(float));
+    ropeFalcon(y, cos, sin, n / 2);
+    for (int j = 0; j < n / 2; j++) {
+        float e0 = x[j] * cos[j] - x[j + n / 2] * sin[j];
+        float e1 = x[j] * sin[j] + x[j + n / 2] * cos[j];
+        if (fabs(y[j] - e0) > 1e-6 || fabs(y[j + n / 2] - e1) > 1e-6) {
+            printf("❌ ropeFalcon() j=%d (%f, %f) != (%f, %f)\n", j, y[j], y[j + n / 2], e0, e1);
+            exit(EXIT_FAILURE);
+        }
+    }
+
+    float freqs[n / 2];
+    for (int j = 0; j < n / 2; j++)
+        freqs[j] = 1.0f / powf(500000.0f, (j * 2) / (float)n);
+    const unsigned int positions[] = { 0, 1, 7, 1000, 4097, 32767, 65535 };
+    for (unsigned int p : positions) {
+        ropeCosSin(cos, sin, freqs, p, n / 2);
+        for (int j = 0; j < n / 2; j++) {
+            const float val = p * freqs[j];
+            if (fabs(cos[j] - cosf(val)) > 1e-6 || fabs(sin[j] - sinf(val)) > 1e-6) {
+                printf("❌ ropeCosSin() pos=%u j=%d (%f, %f) != (%f, %f)\n", p, j, cos[j], sin[j], cosf(val), sinf(val));
+                exit(EXIT_FAILURE);
+            }
+        }
+    }
+
+    printf("✅ rope\n");
+}
+
 void assertInt(int a, int b) {
     if (a != b) {
         printf("❌ %d != %d\n", a, b);
@@ -140,7 +531,13 @@ int main() {
 
     testRms();
     testMatmulQ80();
+    testMatmulQ80Rows();
+    testMatmulQ40vQ80();
+    testMatmulF16();
+    testMatmulBatch();
+    testAttention();
     testAdd();
+    testRope();
     testSplitRangeToThreads();
     return EXIT_SUCCESS;
 }
\ No newline at end of file
@@ -1,9 +1,11 @@
 #include <cmath>
 #include <cassert>
 #include <cstdio>
+#include <cstring>
 #include <stdexcept>
 #include "common/pthread.h"
 #include "funcs.hpp"
+#include "kernels.hpp"
 #include "utils.hpp"
 
 #if defined(__ARM_NEON)
@@ -12,9 +14,17 @@
     #include <immintrin.h>
 #endif
 
+namespace KERNELS_VARIANT {
+
 #if defined(__AVX2__)
     #define MM256_SET_M128I(a, b) _mm256_insertf128_si256(_mm256_castsi128_si256(b), (a), 1)
 
+    #if defined(__AVX512VNNI__) && defined(__AVX512VL__)
+        #define MM256_DPBUSD(acc, u, s) _mm256_dpbusd_epi32((acc), (u), (s))
+    #elif defined(__AVXVNNI__)
+        #define MM256_DPBUSD(acc, u, s) _mm256_dpbusd_avx_epi32((acc), (u), (s))
+    #endif
+
     static inline __m256i bytes_from_nibbles_32(const uint8_t* rsi) {
         // Load 16 bytes from memory
         __m128i tmpl = _mm_loadu_si128((const __m128i *)rsi);
@@ -33,32 +43,178 @@
         return _mm_cvtss_f32(res);
     }
 
-    // add int16_t pairwise and return as float vector
-    static inline __m256 sum_i16_pairs_float(const __m128i xh, const __m128i xl) {
-        const __m128i ones = _mm_set1_epi16(1);
-        const __m128i summed_pairsl = _mm_madd_epi16(ones, xl);
-        const __m128i summed_pairsh = _mm_madd_epi16(ones, xh);
-        const __m256i summed_pairs = MM256_SET_M128I(summed_pairsh, summed_pairsl);
-        return _mm256_cvtepi32_ps(summed_pairs);
-    }
-
-    // multiply int8_t, add results pairwise twice and return as float vector
-    static inline __m256 mul_sum_i8_pairs_float(const __m256i x, const __m256i y) {
-        const __m128i xl = _mm256_castsi256_si128(x);
-        const __m128i xh = _mm256_extractf128_si256(x, 1);
-        const __m128i yl = _mm256_castsi256_si128(y);
-        const __m128i yh = _mm256_extractf128_si256(y, 1);
-        // Get absolute values of x vectors
-        const __m128i axl = _mm_sign_epi8(xl, xl);
-        const __m128i axh = _mm_sign_epi8(xh, xh);
-        // Sign the values of the y vectors
-        const __m128i syl = _mm_sign_epi8(yl, xl);
-        const __m128i syh = _mm_sign_epi8(yh, xh);
-        // Perform multiplication and create 16-bit values
-        const __m128i dotl = _mm_maddubs_epi16(axl, syl);
-        const __m128i doth = _mm_maddubs_epi16(axh, syh);
-        return sum_i16_pairs_float(doth, dotl);
+    // Sums of four adjacent u8 * i8 products in each 32-bit lane. Without VNNI the products are summed
+    // in int16 pairs first, so a sum of two products must fit in int16.
+    static inline __m256i mul_sum_u8_i8_quads(const __m256i u, const __m256i s) {
+    #if defined(MM256_DPBUSD)
+        return MM256_DPBUSD(_mm256_setzero_si256(), u, s);
+    #else
+        return _mm256_madd_epi16(_mm256_maddubs_epi16(u, s), _mm256_set1_epi16(1));
+    #endif
+    }
+
+    // Computes `nRows` consecutive rows at once, each loaded input block is shared by all rows. The nibbles are
+    // multiplied unsigned, the offset is subtracted via the input sums: sum((x - 8) * y) = sum(x * y) - sum(8 * y).
+    template <unsigned int nRows>
+    static inline void matmulQ40vQ80Rows(float* output, const BlockQ40* w, const BlockQ80* input, const unsigned int n) {
+        const __m256i eights = _mm256_set1_epi8(8);
+        __m256 acc[nRows];
+        for (unsigned int r = 0; r < nRows; r++) {
+            acc[r] = _mm256_setzero_ps();
+        }
+
+        for (unsigned int j = 0; j < n; j++) {
+            const __m256i by = _mm256_loadu_si256((const __m256i *)input[j].qs);
+            const __m256i byOffset = mul_sum_u8_i8_quads(eights, by);
+            const float yd = convertF16ToF32(input[j].d);
+
+            for (unsigned int r = 0; r < nRows; r++) {
+                const BlockQ40* x = &w[r * n + j];
+                // The hardware prefetcher doesn't keep up with several interleaved rows.
+                _mm_prefetch((const char*)(x + 16), _MM_HINT_T0);
+                const __m256 cd = _mm256_set1_ps(convertF16ToF32(x->d) * yd);
+                const __m256i bx = bytes_from_nibbles_32(x->qs);
+                const __m256i dot = mul_sum_u8_i8_quads(bx, by);
+                const __m256 q = _mm256_cvtepi32_ps(_mm256_sub_epi32(dot, byOffset));
+                acc[r] = _mm256_fmadd_ps(cd, q, acc[r]);
+            }
+        }
+
+        for (unsigned int r = 0; r < nRows; r++) {
+            output[r] = hsum_float_8(acc[r]);
+        }
+    }
+
+    // The same approach as `matmulQ40vQ80Rows`. With VNNI the weights are shifted into u8 by flipping the sign bit:
+    // sum(x * y) = sum((x + 128) * y) - sum(128 * y), VNNI doesn't saturate, so this is exact. Without VNNI the sign of
+    // the weights is moved to the input; Q80 values are in [-127, 127], so a sum of two products fits in int16.
+    template <unsigned int nRows>
+    static inline void matmulQ80vQ80Rows(float* output, const BlockQ80* w, const BlockQ80* input, const unsigned int n) {
+    #if defined(MM256_DPBUSD)
+        const __m256i signs = _mm256_set1_epi8((char)0x80);
+    #endif
+        __m256 acc[nRows];
+        for (unsigned int r = 0; r < nRows; r++) {
+            acc[r] = _mm256_setzero_ps();
+        }
+
+        for (unsigned int j = 0; j < n; j++) {
+            const __m256i by = _mm256_loadu_si256((const __m256i *)input[j].qs);
+    #if defined(MM256_DPBUSD)
+            const __m256i byOffset = MM256_DPBUSD(_mm256_setzero_si256(), signs, by);
+    #endif
+            const float yd = convertF16ToF32(input[j].d);
+
+            for (unsigned int r = 0; r < nRows; r++) {
+                const BlockQ80* x = &w[r * n + j];
+                _mm_prefetch((const char*)(x + 8), _MM_HINT_T0);
+                const __m256 cd = _mm256_set1_ps(convertF16ToF32(x->d) * yd);
+                const __m256i bx = _mm256_loadu_si256((const __m256i *)x->qs);
+    #if defined(MM256_DPBUSD)
+                const __m256i dot = _mm256_sub_epi32(MM256_DPBUSD(_mm256_setzero_si256(), _mm256_xor_si256(bx, signs), by), byOffset);
+    #else
+                const __m256i dot = mul_sum_u8_i8_quads(_mm256_sign_epi8(bx, bx), _mm256_sign_epi8(by, bx));
+    #endif
+                acc[r] = _mm256_fmadd_ps(cd, _mm256_cvtepi32_ps(dot), acc[r]);
+            }
+        }
+
+        for (unsigned int r = 0; r < nRows; r++) {
+            output[r] = hsum_float_8(acc[r]);
+        }
+    }
+
+    static inline __m256 load_q80_8_float(const int8_t* qs) {
+        return _mm256_cvtepi32_ps(_mm256_cvtepi8_epi32(_mm_loadl_epi64((const __m128i *)qs)));
     }
+
+    // F32 input, Q80 weights. The input block is loaded once for all rows, each row is scaled once per block.
+    template <unsigned int nRows>
+    static inline void matmulQ80Rows(float* output, const BlockQ80* w, const float* input, const unsigned int n) {
+        __m256 acc[nRows];
+        for (unsigned int r = 0; r < nRows; r++) {
+            acc[r] = _mm256_setzero_ps();
+        }
+
+        for (unsigned int j = 0; j < n; j++) {
+            const float* y = &input[j * QK80];
+            const __m256 y0 = _mm256_loadu_ps(y);
+            const __m256 y1 = _mm256_loadu_ps(y + 8);
+            const __m256 y2 = _mm256_loadu_ps(y + 16);
+            const __m256 y3 = _mm256_loadu_ps(y + 24);
+
+            for (unsigned int r = 0; r < nRows; r++) {
+                const BlockQ80* x = &w[r * n + j];
+                _mm_prefetch((const char*)(x + 8), _MM_HINT_T0);
+                __m256 s = _mm256_mul_ps(load_q80_8_float(x->qs), y0);
+                s = _mm256_fmadd_ps(load_q80_8_float(x->qs + 8), y1, s);
+                s = _mm256_fmadd_ps(load_q80_8_float(x->qs + 16), y2, s);
+                s = _mm256_fmadd_ps(load_q80_8_float(x->qs + 24), y3, s);
+                acc[r] = _mm256_fmadd_ps(_mm256_set1_ps(convertF16ToF32(x->d)), s, acc[r]);
+            }
+        }
+
+        for (unsigned int r = 0; r < nRows; r++) {
+            output[r] = hsum_float_8(acc[r]);
+        }
+    }
+
+    #if defined(__F16C__)
+    static inline __m256 load_f16_8_float(const uint16_t* x) {
+        return _mm256_cvtph_ps(_mm_loadu_si128((const __m128i *)x));
+    }
+
+    template <unsigned int nRows>
+    static inline void matmulF16Rows(float* output, const uint16_t* w, const float* input, const unsigned int n) {
+        __m256 acc[nRows];
+        for (unsigned int r = 0; r < nRows; r++) {
+            acc[r] = _mm256_setzero_ps();
+        }
+
+        for (unsigned int j = 0; j < n; j += 8) {
+            const __m256 y = _mm256_loadu_ps(&input[j]);
+            for (unsigned int r = 0; r < nRows; r++) {
+                const uint16_t* x = &w[r * n + j];
+                _mm_prefetch((const char*)(x + 128), _MM_HINT_T0);
+                acc[r] = _mm256_fmadd_ps(load_f16_8_float(x), y, acc[r]);
+            }
+        }
+
+        for (unsigned int r = 0; r < nRows; r++) {
+            output[r] = hsum_float_8(acc[r]);
+        }
+    }
+
+    // Q80 input, F16 weights. The input block is dequantized once for all rows.
+    template <unsigned int nRows>
+    static inline void matmulF16vQ80Rows(float* output, const uint16_t* w, const BlockQ80* input, const unsigned int n) {
+        __m256 acc[nRows];
+        for (unsigned int r = 0; r < nRows; r++) {
+            acc[r] = _mm256_setzero_ps();
+        }
+
+        for (unsigned int j = 0; j < n; j++) {
+            const __m256 yd = _mm256_set1_ps(convertF16ToF32(input[j].d));
+            const __m256 y0 = _mm256_mul_ps(load_q80_8_float(input[j].qs), yd);
+            const __m256 y1 = _mm256_mul_ps(load_q80_8_float(input[j].qs + 8), yd);
+            const __m256 y2 = _mm256_mul_ps(load_q80_8_float(input[j].qs + 16), yd);
+            const __m256 y3 = _mm256_mul_ps(load_q80_8_float(input[j].qs + 24), yd);
+
+            for (unsigned int r = 0; r < nRows; r++) {
+                const uint16_t* x = &w[(r * n + j) * QK80];
+                _mm_prefetch((const char*)(x + 128), _MM_HINT_T0);
+                acc[r] = _mm256_fmadd_ps(load_f16_8_float(x), y0, acc[r]);
+                acc[r] = _mm256_fmadd_ps(load_f16_8_float(x + 8), y1, acc[r]);
+                acc[r] = _mm256_fmadd_ps(load_f16_8_float(x + 16), y2, acc[r]);
+                acc[r] = _mm256_fmadd_ps(load_f16_8_float(x + 24), y3, acc[r]);
+            }
+        }
+
+        for (unsigned int r = 0; r < nRows; r++) {
+            output[r] = hsum_float_8(acc[r]);
+        }
+    }
+    #endif
 #endif
 
 void softmax(float* x, const unsigned int size) {
@@ -105,7 +261,8 @@ float rms(const float* x, const unsigned int size) {
     ss = vaddvq_f32(fs);
 #elif defined(__AVX2__)
     assert(size % 8 == 0);
-    __m256 a, u;
+    __m256 a;
+    __m256 u = _mm256_setzero_ps();
     for (unsigned int j = 0; j < size; j += 8) {
         a = _mm256_loadu_ps(&x[j]);
         u = _mm256_fmadd_ps(a, a, u);
@@ -200,6 +357,29 @@ void matmulF32(const MatmulThreadInfo* a) {
 void matmulF16(const MatmulThreadInfo* a) {
     const float* input = (float*)a->input;
     const uint16_t* w = (uint16_t*)a->weights;
+
+#if defined(__ARM_NEON)
+    assert(a->n % 8 == 0);
+    for (unsigned int d = a->ds; d < a->de; d++) {
+        float32x4_t z0 = vmovq_n_f32(0);
+        float32x4_t z1 = vmovq_n_f32(0);
+        for (unsigned int j = 0; j < a->n; j += 8) {
+            const float16x8_t p = vld1q_f16((const float16_t*)&w[d * a->n + j]);
+            z0 = vfmaq_f32(z0, vld1q_f32(&input[j]), vcvt_f32_f16(vget_low_f16(p)));
+            z1 = vfmaq_f32(z1, vld1q_f32(&input[j + 4]), vcvt_f32_f16(vget_high_f16(p)));
+        }
+        a->output[d] = vaddvq_f32(vaddq_f32(z0, z1));
+    }
+#elif defined(__AVX2__) && defined(__F16C__)
+    assert(a->n % 8 == 0);
+    unsigned int d = a->ds;
+    for (; d + 4 <= a->de; d += 4) {
+        matmulF16Rows<4>(&a->output[d], &w[d * a->n], input, a->n);
+    }
+    for (; d < a->de; d++) {
+        matmulF16Rows<1>(&a->output[d], &w[d * a->n], input, a->n);
+    }
+#else
     for (unsigned int d = a->ds; d < a->de; d++) {
         float val = 0.0f;
         for (unsigned int j = 0; j < a->n; j++) {
@@ -208,6 +388,53 @@ void matmulF16(const MatmulThreadInfo* a) {
         }
         a->output[d] = val;
     }
+#endif
+}
+
+void matmulF16vQ80(const MatmulThreadInfo* a) {
+    const BlockQ80* input = (BlockQ80*)a->input;
+    const uint16_t* w = (uint16_t*)a->weights;
+    assert(a->n % QK80 == 0);
+    const unsigned int nb = a->n / QK80;
+
+#if defined(__ARM_NEON)
+    for (unsigned int d = a->ds; d < a->de; d++) {
+        float32x4_t sumv = vmovq_n_f32(0);
+        for (unsigned int i = 0; i < nb; i++) {
+            const uint16_t* x = &w[d * a->n + i * QK80];
+            const BlockQ80* y = &input[i];
+            float32x4_t s = vmovq_n_f32(0);
+            for (unsigned int j = 0; j < QK80; j += 8) {
+                const float16x8_t p = vld1q_f16((const float16_t*)(x + j));
+                const int16x8_t y16 = vmovl_s8(vld1_s8(y->qs + j));
+                s = vfmaq_f32(s, vcvt_f32_f16(vget_low_f16(p)), vcvtq_f32_s32(vmovl_s16(vget_low_s16(y16))));
+                s = vfmaq_f32(s, vcvt_f32_f16(vget_high_f16(p)), vcvtq_f32_s32(vmovl_s16(vget_high_s16(y16))));
+            }
+            sumv = vmlaq_n_f32(sumv, s, convertF16ToF32(y->d));
+        }
+        a->output[d] = vaddvq_f32(sumv);
+    }
+#elif defined(__AVX2__) && defined(__F16C__)
+    unsigned int d = a->ds;
+    for (; d + 4 <= a->de; d += 4) {
+        matmulF16vQ80Rows<4>(&a->output[d], &w[d * a->n], input, nb);
+    }
+    for (; d < a->de; d++) {
+        matmulF16vQ80Rows<1>(&a->output[d], &w[d * a->n], input, nb);
+    }
+#else
+    for (unsigned int d = a->ds; d < a->de; d++) {
+        float sum = 0.0;
+        for (unsigned int i = 0; i < nb; i++) {
+            float s = 0.0;
+            for (unsigned int j = 0; j < QK80; j++) {
+                s += convertF16ToF32(w[d * a->n + i * QK80 + j]) * (float)input[i].qs[j];
+            }
+            sum += s * convertF16ToF32(input[i].d);
+        }
+        a->output[d] = sum;
+    }
+#endif
 }
 
 void matmulQ40(const MatmulThreadInfo* a) {
@@ -266,11 +493,36 @@ void matmulQ40(const MatmulThreadInfo* a) {
 }
 
 void matmulQ80(const MatmulThreadInfo* a) {
-    float* input = (float*)a->input;
+    const float* input = (float*)a->input;
     const BlockQ80* weights = (BlockQ80*)a->weights;
     assert(a->n % QK80 == 0);
     const unsigned int nb = a->n / QK80;
 
+#if defined(__ARM_NEON)
+    for (unsigned int d = a->ds; d < a->de; d++) {
+        float32x4_t sumv = vmovq_n_f32(0);
+        for (unsigned int i = 0; i < nb; i++) {
+            const BlockQ80* x = &weights[d * nb + i];
+            const float* y = &input[i * QK80];
+            float32x4_t s = vmovq_n_f32(0);
+            for (unsigned int j = 0; j < QK80; j += 8) {
+                const int16x8_t x16 = vmovl_s8(vld1_s8(x->qs + j));
+                s = vfmaq_f32(s, vcvtq_f32_s32(vmovl_s16(vget_low_s16(x16))), vld1q_f32(y + j));
+                s = vfmaq_f32(s, vcvtq_f32_s32(vmovl_s16(vget_high_s16(x16))), vld1q_f32(y + j + 4));
+            }
+            sumv = vmlaq_n_f32(sumv, s, convertF16ToF32(x->d));
+        }
+        a->output[d] = vaddvq_f32(sumv);
+    }
+#elif defined(__AVX2__)
+    unsigned int d = a->ds;
+    for (; d + 4 <= a->de; d += 4) {
+        matmulQ80Rows<4>(&a->output[d], &weights[d * nb], input, nb);
+    }
+    for (; d < a->de; d++) {
+        matmulQ80Rows<1>(&a->output[d], &weights[d * nb], input, nb);
+    }
+#else
     for (unsigned int d = a->ds; d < a->de; d++) {
         float sum = 0.0;
         for (unsigned int i = 0; i < nb; i++) {
@@ -282,6 +534,7 @@ void matmulQ80(const MatmulThreadInfo* a) {
         }
         a->output[d] = sum;
     }
+#endif
 }
 
 void matmulQ40vQ80(const MatmulThreadInfo* a) {
@@ -356,41 +609,74 @@ void matmulQ40vQ80(const MatmulThreadInfo* a) {
         a->output[d] = vaddvq_f32(sumv0) + vaddvq_f32(sumv1);
     }
 #elif defined(__AVX2__)
+    unsigned int d = a->ds;
+    for (; d + 4 <= a->de; d += 4) {
+        matmulQ40vQ80Rows<4>(&a->output[d], &w[d * n], input, n);
+    }
+    for (; d < a->de; d++) {
+        matmulQ40vQ80Rows<1>(&a->output[d], &w[d * n], input, n);
+    }
+#else
     for (unsigned int d = a->ds; d < a->de; d++) {
-        __m256 acc = _mm256_setzero_ps();
-
+        float sum = 0.0;
         for (unsigned int j = 0; j < n; j++) {
-            /* Compute combined scale for the block */
-            const __m256 cd = _mm256_set1_ps( convertF16ToF32(w[d * n + j].d) * convertF16ToF32(input[j].d) );
-
-            __m256i bx = bytes_from_nibbles_32(w[d * n + j].qs);
-
-            // Now we have a vector with bytes in [ 0 .. 15 ] interval. Offset them into [ -8 .. +7 ] interval.
-            const __m256i off = _mm256_set1_epi8( 8 );
-            bx = _mm256_sub_epi8(bx, off);
-
-            __m256i by = _mm256_loadu_si256((const __m256i *)input[j].qs);
-
-            const __m256 q = mul_sum_i8_pairs_float(bx, by);
-
-            /* Multiply q with scale and accumulate */
-            acc = _mm256_fmadd_ps( cd, q, acc );
+            const BlockQ40* x = &w[d * n + j];
+            const BlockQ80* y = &input[j];
+            int s = 0;
+            for (unsigned int k = 0; k < QK40 / 2; k++) {
+                s += ((x->qs[k] & 0x0F) - 8) * y->qs[k];
+                s += ((x->qs[k] >> 4) - 8) * y->qs[k + QK40 / 2];
+            }
+            sum += s * (convertF16ToF32(x->d) * convertF16ToF32(y->d));
         }
-
-        a->output[d] = hsum_float_8(acc);
+        a->output[d] = sum;
     }
-#else
-    printf("matmulQ40vQ80 - not implemented\n");
-    exit(EXIT_FAILURE);
 #endif
 }
 
 void matmulQ80vQ80(const MatmulThreadInfo* a) {
     const BlockQ80* input = (BlockQ80*)a->input;
-    BlockQ80* weights = (BlockQ80*)a->weights;
+    const BlockQ80* weights = (BlockQ80*)a->weights;
     assert(a->n % QK80 == 0);
     const unsigned int nb = a->n / QK80;
 
+#if defined(__ARM_NEON)
+    for (unsigned int d = a->ds; d < a->de; d++) {
+        float32x4_t sumv = vmovq_n_f32(0);
+        for (unsigned int i = 0; i < nb; i++) {
+            const BlockQ80* x = &weights[d * nb + i];
+            const BlockQ80* y = &input[i];
+
+            const int8x16_t x0 = vld1q_s8(x->qs);
+            const int8x16_t x1 = vld1q_s8(x->qs + 16);
+            const int8x16_t y0 = vld1q_s8(y->qs);
+            const int8x16_t y1 = vld1q_s8(y->qs + 16);
+
+#if defined(__ARM_FEATURE_DOTPROD)
+            const int32x4_t p = vdotq_s32(vdotq_s32(vdupq_n_s32(0), x0, y0), x1, y1);
+#else
+            const int16x8_t p0l = vmull_s8(vget_low_s8 (x0), vget_low_s8 (y0));
+            const int16x8_t p0h = vmull_s8(vget_high_s8(x0), vget_high_s8(y0));
+            const int16x8_t p1l = vmull_s8(vget_low_s8 (x1), vget_low_s8 (y1));
+            const int16x8_t p1h = vmull_s8(vget_high_s8(x1), vget_high_s8(y1));
+
+            const int32x4_t p = vaddq_s32(
+                vaddq_s32(vpaddlq_s16(p0l), vpaddlq_s16(p0h)),
+                vaddq_s32(vpaddlq_s16(p1l), vpaddlq_s16(p1h)));
+#endif
+            sumv = vmlaq_n_f32(sumv, vcvtq_f32_s32(p), convertF16ToF32(x->d) * convertF16ToF32(y->d));
+        }
+        a->output[d] = vaddvq_f32(sumv);
+    }
+#elif defined(__AVX2__)
+    unsigned int d = a->ds;
+    for (; d + 4 <= a->de; d += 4) {
+        matmulQ80vQ80Rows<4>(&a->output[d], &weights[d * nb], input, nb);
+    }
+    for (; d < a->de; d++) {
+        matmulQ80vQ80Rows<1>(&a->output[d], &weights[d * nb], input, nb);
+    }
+#else
     for (unsigned int d = a->ds; d < a->de; d++) {
         float sum = 0.0;
         for (unsigned int i = 0; i < nb; i++) {
@@ -402,50 +688,38 @@ void matmulQ80vQ80(const MatmulThreadInfo* a) {
         }
         a->output[d] = sum;
     }
+#endif
 }
 
-//     weights      input    output
-//   ___________     ___      ___
-//   |         |     | |      | |
-// d |         | *   | |  = d | |
-//   |_________|   n | |      |_|
-//        n          |_|       1
-//                    1
-void matmul(const FloatType weightsFloatType, const FloatType inputFloatType, float* output, const void* input, const void* weights, const unsigned int n, const unsigned int d, const unsigned int nThreads, const unsigned int threadIndex) {
-    SPLIT_RANGE_TO_THREADS(ds, de, 0, d, nThreads, threadIndex);
-
-    MatmulThreadInfo s;
-    s.output = output;
-    s.input = input;
-    s.weights = weights;
-    s.n = n;
-    s.ds = ds;
-    s.de = de;
-
+static void matmulRows(const FloatType weightsFloatType, const FloatType inputFloatType, const MatmulThreadInfo* s) {
     if (inputFloatType == F32) {
         if (weightsFloatType == F32) {
-            matmulF32(&s);
+            matmulF32(s);
             return;
         }
         if (weightsFloatType == F16) {
-            matmulF16(&s);
+            matmulF16(s);
             return;
         }
         if (weightsFloatType == Q40) {
-            matmulQ40(&s);
+            matmulQ40(s);
             return;
         }
         if (weightsFloatType == Q80) {
-            matmulQ80(&s);
+            matmulQ80(s);
             return;
         }
     } else if (inputFloatType == Q80) {
+        if (weightsFloatType == F16) {
+            matmulF16vQ80(s);
+            return;
+        }
         if (weightsFloatType == Q40) {
-            matmulQ40vQ80(&s);
+            matmulQ40vQ80(s);
             return;
         }
         if (weightsFloatType == Q80) {
-            matmulQ80vQ80(&s);
+            matmulQ80vQ80(s);
             return;
         }
     }
@@ -454,6 +728,51 @@ void matmul(const FloatType weightsFloatType, const FloatType inputFloatType, fl
     exit(EXIT_FAILURE);
 }
 
+//     weights      input    output
+//   ___________     ___      ___
+//   |         |     | |      | |
+// d |         | *   | |  = d | |
+//   |_________|   n | |      |_|
+//        n          |_|       1
+//                    1
+void matmul(const FloatType weightsFloatType, const FloatType inputFloatType, float* output, const void* input, const void* weights, const unsigned int n, const unsigned int d, const unsigned int nThreads, const unsigned int threadIndex) {
+    SPLIT_RANGE_TO_THREADS(ds, de, 0, d, nThreads, threadIndex);
+
+    MatmulThreadInfo s;
+    s.output = output;
+    s.input = input;
+    s.weights = weights;
+    s.n = n;
+    s.ds = ds;
+    s.de = de;
+    matmulRows(weightsFloatType, inputFloatType, &s);
+}
+
+// The rows of the weights are processed in tiles of about this size. A tile stays in the cache while it's
+// multiplied by all inputs of the batch, so the weights are read from the memory once per batch.
+#define MATMUL_BATCH_TILE_BYTES 65536
+
+void matmulBatch(const FloatType weightsFloatType, const FloatType inputFloatType, float* output, const void* input, const void* weights, const unsigned int n, const unsigned int d, const unsigned int nBatches, const size_t inputStride, const unsigned int outputStride, const unsigned int nThreads, const unsigned int threadIndex) {
+    SPLIT_RANGE_TO_THREADS(ds, de, 0, d, nThreads, threadIndex);
+
+    // A multiple of 4 rows, the kernels compute 4 rows at once.
+    unsigned int tileRows = (MATMUL_BATCH_TILE_BYTES / getBatchBytes(weightsFloatType, n, 1)) & ~3u;
+    if (tileRows < 4) tileRows = 4;
+
+    MatmulThreadInfo s;
+    s.weights = weights;
+    s.n = n;
+    for (unsigned int ts = ds; ts < de; ts += tileRows) {
+        s.ds = ts;
+        s.de = ts + tileRows < de ? ts + tileRows : de;
+        for (unsigned int b = 0; b < nBatches; b++) {
+            s.input = (const char*)input + b * inputStride;
+            s.output = &output[b * outputStride];
+            matmulRows(weightsFloatType, inputFloatType, &s);
+        }
+    }
+}
+
 float dotProduct(const float* a, const float* b, const unsigned int size) {
 #if defined(__ARM_NEON)
     assert(size % 4 == 0);
@@ -485,6 +804,265 @@ float dotProduct(const float* a, const float* b, const unsigned int size) {
 #endif
 }
 
+// scores[t] = scale * q * keys[t], the keys are `kvStride` apart. Four keys are multiplied at once, so the sums
+// of the products don't wait for each other.
+static inline void attentionScores(float* scores, const float* q, const float* keys, const unsigned int kvStride, const unsigned int headSize, const unsigned int n, const float scale) {
+    unsigned int t = 0;
+#if defined(__ARM_NEON)
+    assert(headSize % 4 == 0);
+    for (; t + 4 <= n; t += 4) {
+        const float* k = &keys[t * kvStride];
+        float32x4_t a0 = vmovq_n_f32(0);
+        float32x4_t a1 = vmovq_n_f32(0);
+        float32x4_t a2 = vmovq_n_f32(0);
+        float32x4_t a3 = vmovq_n_f32(0);
+        for (unsigned int i = 0; i < headSize; i += 4) {
+            const float32x4_t qv = vld1q_f32(&q[i]);
+            a0 = vfmaq_f32(a0, qv, vld1q_f32(&k[i]));
+            a1 = vfmaq_f32(a1, qv, vld1q_f32(&k[kvStride + i]));
+            a2 = vfmaq_f32(a2, qv, vld1q_f32(&k[2 * kvStride + i]));
+            a3 = vfmaq_f32(a3, qv, vld1q_f32(&k[3 * kvStride + i]));
+        }
+        const float32x4_t s = vpaddq_f32(vpaddq_f32(a0, a1), vpaddq_f32(a2, a3));
+        vst1q_f32(&scores[t], vmulq_n_f32(s, scale));
+    }
+#elif defined(__AVX2__)
+    assert(headSize % 8 == 0);
+    for (; t + 4 <= n; t += 4) {
+        const float* k = &keys[t * kvStride];
+        __m256 a0 = _mm256_setzero_ps();
+        __m256 a1 = _mm256_setzero_ps();
+        __m256 a2 = _mm256_setzero_ps();
+        __m256 a3 = _mm256_setzero_ps();
+        for (unsigned int i = 0; i < headSize; i += 8) {
+            const __m256 qv = _mm256_loadu_ps(&q[i]);
+            a0 = _mm256_fmadd_ps(qv, _mm256_loadu_ps(&k[i]), a0);
+            a1 = _mm256_fmadd_ps(qv, _mm256_loadu_ps(&k[kvStride + i]), a1);
+            a2 = _mm256_fmadd_ps(qv, _mm256_loadu_ps(&k[2 * kvStride + i]), a2);
+            a3 = _mm256_fmadd_ps(qv, _mm256_loadu_ps(&k[3 * kvStride + i]), a3);
+        }
+        // [a0 a1 a2 a3] sums of the low halves | the same of the high halves
+        const __m256 h = _mm256_hadd_ps(_mm256_hadd_ps(a0, a1), _mm256_hadd_ps(a2, a3));
+        const __m128 s = _mm_add_ps(_mm256_castps256_ps128(h), _mm256_extractf128_ps(h, 1));
+        _mm_storeu_ps(&scores[t], _mm_mul_ps(s, _mm_set1_ps(scale)));
+    }
+#endif
+    for (; t < n; t++) {
+        scores[t] = dotProduct(q, &keys[t * kvStride], headSize) * scale;
+    }
+}
+
+// output += sum(p[t] * values[t]), the values are `kvStride` apart. A slice of the output stays in registers
+// while all values are accumulated into it.
+static inline void attentionValues(float* output, const float* p, const float* values, const unsigned int kvStride, const unsigned int headSize, const unsigned int n) {
+    unsigned int i = 0;
+#if defined(__ARM_NEON)
+    assert(headSize % 4 == 0);
+    for (; i + 16 <= headSize; i += 16) {
+        float32x4_t o0 = vld1q_f32(&output[i]);
+        float32x4_t o1 = vld1q_f32(&output[i + 4]);
+        float32x4_t o2 = vld1q_f32(&output[i + 8]);
+        float32x4_t o3 = vld1q_f32(&output[i + 12]);
+        for (unsigned int t = 0; t < n; t++) {
+            const float* v = &values[t * kvStride + i];
+            o0 = vfmaq_n_f32(o0, vld1q_f32(v), p[t]);
+            o1 = vfmaq_n_f32(o1, vld1q_f32(v + 4), p[t]);
+            o2 = vfmaq_n_f32(o2, vld1q_f32(v + 8), p[t]);
+            o3 = vfmaq_n_f32(o3, vld1q_f32(v + 12), p[t]);
+        }
+        vst1q_f32(&output[i], o0);
+        vst1q_f32(&output[i + 4], o1);
+        vst1q_f32(&output[i + 8], o2);
+        vst1q_f32(&output[i + 12], o3);
+    }
+#elif defined(__AVX2__)
+    assert(headSize % 8 == 0);
+    for (; i + 32 <= headSize; i += 32) {
+        __m256 o0 = _mm256_loadu_ps(&output[i]);
+        __m256 o1 = _mm256_loadu_ps(&output[i + 8]);
+        __m256 o2 = _mm256_loadu_ps(&output[i + 16]);
+        __m256 o3 = _mm256_loadu_ps(&output[i + 24]);
+        for (unsigned int t = 0; t < n; t++) {
+            const float* v = &values[t * kvStride + i];
+            const __m256 pv = _mm256_set1_ps(p[t]);
+            o0 = _mm256_fmadd_ps(pv, _mm256_loadu_ps(v), o0);
+            o1 = _mm256_fmadd_ps(pv, _mm256_loadu_ps(v + 8), o1);
+            o2 = _mm256_fmadd_ps(pv, _mm256_loadu_ps(v + 16), o2);
+            o3 = _mm256_fmadd_ps(pv, _mm256_loadu_ps(v + 24), o3);
+        }
+        _mm256_storeu_ps(&output[i], o0);
+        _mm256_storeu_ps(&output[i + 8], o1);
+        _mm256_storeu_ps(&output[i + 16], o2);
+        _mm256_storeu_ps(&output[i + 24], o3);
+    }
+#endif
+    for (; i < headSize; i++) {
+        float o = output[i];
+        for (unsigned int t = 0; t < n; t++) {
+            o += p[t] * values[t * kvStride + i];
+        }
+        output[i] = o;
+    }
+}
+
+// Converts `n` rows of a F16 or Q80 cache, `kvStride` numbers apart, to F32 rows of `headSize` numbers.
+static inline void loadCacheRows(const FloatType cacheFloatType, float* output, const void* cache, const unsigned int kvStride, const unsigned int headSize, const unsigned int n) {
+    if (cacheFloatType == F16) {
+        for (unsigned int t = 0; t < n; t++) {
+            const uint16_t* row = &((const uint16_t*)cache)[t * kvStride];
+            float* o = &output[t * headSize];
+            unsigned int i = 0;
+#if defined(__ARM_NEON)
+            for (; i + 8 <= headSize; i += 8) {
+                const float16x8_t p = vld1q_f16((const float16_t*)&row[i]);
+                vst1q_f32(&o[i], vcvt_f32_f16(vget_low_f16(p)));
+                vst1q_f32(&o[i + 4], vcvt_f32_f16(vget_high_f16(p)));
+            }
+#elif defined(__AVX2__) && defined(__F16C__)
+            for (; i + 8 <= headSize; i += 8) {
+                _mm256_storeu_ps(&o[i], load_f16_8_float(&row[i]));
+            }
+#endif
+            for (; i < headSize; i++) {
+                o[i] = convertF16ToF32(row[i]);
+            }
+        }
+    } else if (cacheFloatType == Q80) {
+        assert(kvStride % QK80 == 0);
+        assert(headSize % QK80 == 0);
+        const unsigned int nBlocks = headSize / QK80;
+        for (unsigned int t = 0; t < n; t++) {
+            const BlockQ80* row = &((const BlockQ80*)cache)[t * (kvStride / QK80)];
+            float* o = &output[t * headSize];
+            for (unsigned int b = 0; b < nBlocks; b++, o += QK80) {
+                const float d = convertF16ToF32(row[b].d);
+#if defined(__ARM_NEON)
+                for (unsigned int j = 0; j < QK80; j += 16) {
+                    const int8x16_t q8 = vld1q_s8(&row[b].qs[j]);
+                    const int16x8_t q16l = vmovl_s8(vget_low_s8(q8));
+                    const int16x8_t q16h = vmovl_s8(vget_high_s8(q8));
+                    vst1q_f32(&o[j], vmulq_n_f32(vcvtq_f32_s32(vmovl_s16(vget_low_s16(q16l))), d));
+                    vst1q_f32(&o[j + 4], vmulq_n_f32(vcvtq_f32_s32(vmovl_s16(vget_high_s16(q16l))), d));
+                    vst1q_f32(&o[j + 8], vmulq_n_f32(vcvtq_f32_s32(vmovl_s16(vget_low_s16(q16h))), d));
+                    vst1q_f32(&o[j + 12], vmulq_n_f32(vcvtq_f32_s32(vmovl_s16(vget_high_s16(q16h))), d));
+                }
+#elif defined(__AVX2__)
+                const __m256 dv = _mm256_set1_ps(d);
+                for (unsigned int j = 0; j < QK80; j += 8) {
+                    _mm256_storeu_ps(&o[j], _mm256_mul_ps(load_q80_8_float(&row[b].qs[j]), dv));
+                }
+#else
+                for (unsigned int j = 0; j < QK80; j++) {
+                    o[j] = row[b].qs[j] * d;
+                }
+#endif
+            }
+        }
+    } else {
+        fprintf(stderr, "Unsupported cache float type %d\n", cacheFloatType);
+        exit(EXIT_FAILURE);
+    }
+}
+
+#define ATTENTION_TILE 64
+#define ATTENTION_MAX_QUERIES 8
+#define ATTENTION_MAX_HEAD_SIZE 256
+
+// Attention of `nQueries` query heads sharing one KV head (grouped-query attention) over the positions
+// 0..nPositions-1 of the cache in a single pass. The scores are computed for a tile of positions, then the
+// values of the tile are accumulated relative to the running maximum score; when the maximum grows, the
+// accumulated values and the sum are rescaled (online softmax). Every query of the group is processed while
+// the tile is in the cache, so each key and value is read from the memory once. A F16 or Q80 tile is
+// converted to F32 once and then used by all queries of the group.
+// `kvStride` is the distance in numbers between two positions in the caches, the queries and the outputs are contiguous.
+// The output is not normalized, `maxScore` and `sum` receive the maximum score and the sum of the exponentials of each query.
+static void attentionTiles(const FloatType cacheFloatType, float* output, float* maxScore, float* sum, const float* q, const void* keyCache, const void* valueCache, const unsigned int kvStride, const unsigned int headSize, const unsigned int nQueries, const unsigned int nPositions) {
+    assert(nQueries <= ATTENTION_MAX_QUERIES);
+    const float scale = 1.0f / sqrtf(headSize);
+    const bool isF32 = cacheFloatType == F32;
+    const size_t positionBytes = isF32 ? 0 : getBatchBytes(cacheFloatType, kvStride, 1);
+    float tile[ATTENTION_TILE * ATTENTION_MAX_HEAD_SIZE];
+    float scores[ATTENTION_MAX_QUERIES][ATTENTION_TILE];
+    assert(isF32 || headSize <= ATTENTION_MAX_HEAD_SIZE);
+    for (unsigned int g = 0; g < nQueries; g++) {
+        maxScore[g] = -INFINITY;
+        sum[g] = 0.0f;
+    }
+    memset(output, 0, nQueries * headSize * sizeof(float));
+
+    for (unsigned int t0 = 0; t0 < nPositions; t0 += ATTENTION_TILE) {
+        const unsigned int tileSize = nPositions - t0 < ATTENTION_TILE ? nPositions - t0 : ATTENTION_TILE;
+        const float* keys;
+        unsigned int keysStride;
+        if (isF32) {
+            keys = &((const float*)keyCache)[t0 * kvStride];
+            keysStride = kvStride;
+        } else {
+            loadCacheRows(cacheFloatType, tile, (const char*)keyCache + t0 * positionBytes, kvStride, headSize, tileSize);
+            keys = tile;
+            keysStride = headSize;
+        }
+        for (unsigned int g = 0; g < nQueries; g++) {
+            attentionScores(scores[g], &q[g * headSize], keys, keysStride, headSize, tileSize, scale);
+        }
+
+        const float* values;
+        unsigned int valuesStride;
+        if (isF32) {
+            values = &((const float*)valueCache)[t0 * kvStride];
+            valuesStride = kvStride;
+        } else {
+            loadCacheRows(cacheFloatType, tile, (const char*)valueCache + t0 * positionBytes, kvStride, headSize, tileSize);
+            values = tile;
+            valuesStride = headSize;
+        }
+        for (unsigned int g = 0; g < nQueries; g++) {
+            float* gScores = scores[g];
+            float* gOutput = &output[g * headSize];
+            float tileMaxScore = maxScore[g];
+            for (unsigned int i = 0; i < tileSize; i++) {
+                if (gScores[i] > tileMaxScore) tileMaxScore = gScores[i];
+            }
+            if (tileMaxScore > maxScore[g]) {
+                if (t0 > 0) {
+                    const float c = expf(maxScore[g] - tileMaxScore);
+                    sum[g] *= c;
+                    for (unsigned int i = 0; i < headSize; i++) gOutput[i] *= c;
+                }
+                maxScore[g] = tileMaxScore;
+            }
+
+            for (unsigned int i = 0; i < tileSize; i++) {
+                gScores[i] = expf(gScores[i] - maxScore[g]);
+                sum[g] += gScores[i];
+            }
+            attentionValues(gOutput, gScores, values, valuesStride, headSize, tileSize);
+        }
+    }
+}
+
+void attention(const FloatType cacheFloatType, float* output, const float* q, const void* keyCache, const void* valueCache, const unsigned int kvStride, const unsigned int headSize, const unsigned int nQueries, const unsigned int nPositions) {
+    float maxScore[ATTENTION_MAX_QUERIES];
+    float sum[ATTENTION_MAX_QUERIES];
+    for (unsigned int g0 = 0; g0 < nQueries; g0 += ATTENTION_MAX_QUERIES) {
+        const unsigned int n = nQueries - g0 < ATTENTION_MAX_QUERIES ? nQueries - g0 : ATTENTION_MAX_QUERIES;
+        float* gOutput = &output[g0 * headSize];
+        attentionTiles(cacheFloatType, gOutput, maxScore, sum, &q[g0 * headSize], keyCache, valueCache, kvStride, headSize, n, nPositions);
+
+        for (unsigned int g = 0; g < n; g++) {
+            const float invSum = 1.0f / sum[g];
+            for (unsigned int i = 0; i < headSize; i++) gOutput[g * headSize + i] *= invSum;
+        }
+    }
+}
+
+void attentionPartial(const FloatType cacheFloatType, float* output, float* maxScore, float* sum, const float* q, const void* keyCache, const void* valueCache, const unsigned int kvStride, const unsigned int headSize, const unsigned int nQueries, const unsigned int nPositions) {
+    for (unsigned int g0 = 0; g0 < nQueries; g0 += ATTENTION_MAX_QUERIES) {
+        const unsigned int n = nQueries - g0 < ATTENTION_MAX_QUERIES ? nQueries - g0 : ATTENTION_MAX_QUERIES;
+        attentionTiles(cacheFloatType, &output[g0 * headSize], &maxScore[g0], &sum[g0], &q[g0 * headSize], keyCache, valueCache, kvStride, headSize, n, nPositions);
+    }
+}
+
 #define SQRT_2_OVER_PI 0.79788456080286535587989211986876f
 #define GELU_COEF_A 0.044715f
 
@@ -529,3 +1107,254 @@ void add(float* output, const float* input, const unsigned int n, const unsigned
         output[i] += input[i];
     }
 }
+
+// The rotations use separate multiplications and subtractions (no FMA), so every variant gives the same result.
+void ropeLlama(float* x, const float* cosSin, const unsigned int n) {
+    assert(n % 2 == 0);
+    unsigned int i = 0;
+#if defined(__ARM_NEON)
+    for (; i + 8 <= n; i += 8) {
+        const float32x4x2_t v = vld2q_f32(&x[i]);
+        const float32x4x2_t c = vld2q_f32(&cosSin[i]);
+        float32x4x2_t r;
+        r.val[0] = vsubq_f32(vmulq_f32(v.val[0], c.val[0]), vmulq_f32(v.val[1], c.val[1]));
+        r.val[1] = vaddq_f32(vmulq_f32(v.val[0], c.val[1]), vmulq_f32(v.val[1], c.val[0]));
+        vst2q_f32(&x[i], r);
+    }
+#elif defined(__AVX2__)
+    for (; i + 8 <= n; i += 8) {
+        const __m256 v = _mm256_loadu_ps(&x[i]);
+        const __m256 c = _mm256_loadu_ps(&cosSin[i]);
+        // [v0*cos - v1*sin, v1*cos + v0*sin, ...]
+        const __m256 vCos = _mm256_mul_ps(v, _mm256_moveldup_ps(c));
+        const __m256 vSin = _mm256_mul_ps(_mm256_permute_ps(v, 0xB1), _mm256_movehdup_ps(c));
+        _mm256_storeu_ps(&x[i], _mm256_addsub_ps(vCos, vSin));
+    }
+#endif
+    for (; i < n; i += 2) {
+        const float v0 = x[i];
+        const float v1 = x[i + 1];
+        x[i] = v0 * cosSin[i] - v1 * cosSin[i + 1];
+        x[i + 1] = v0 * cosSin[i + 1] + v1 * cosSin[i];
+    }
+}
+
+void ropeFalcon(float* x, const float* cos, const float* sin, const unsigned int half) {
+    float* y = &x[half];
+    unsigned int j = 0;
+#if defined(__ARM_NEON)
+    for (; j + 4 <= half; j += 4) {
+        const float32x4_t a = vld1q_f32(&x[j]);
+        const float32x4_t b = vld1q_f32(&y[j]);
+        const float32x4_t c = vld1q_f32(&cos[j]);
+        const float32x4_t s = vld1q_f32(&sin[j]);
+        vst1q_f32(&x[j], vsubq_f32(vmulq_f32(a, c), vmulq_f32(b, s)));
+        vst1q_f32(&y[j], vaddq_f32(vmulq_f32(a, s), vmulq_f32(b, c)));
+    }
+#elif defined(__AVX2__)
+    for (; j + 8 <= half; j += 8) {
+        const __m256 a = _mm256_loadu_ps(&x[j]);
+        const __m256 b = _mm256_loadu_ps(&y[j]);
+        const __m256 c = _mm256_loadu_ps(&cos[j]);
+        const __m256 s = _mm256_loadu_ps(&sin[j]);
+        _mm256_storeu_ps(&x[j], _mm256_sub_ps(_mm256_mul_ps(a, c), _mm256_mul_ps(b, s)));
+        _mm256_storeu_ps(&y[j], _mm256_add_ps(_mm256_mul_ps(a, s), _mm256_mul_ps(b, c)));
+    }
+#endif
+    for (; j < half; j++) {
+        const float a = x[j];
+        const float b = y[j];
+        x[j] = a * cos[j] - b * sin[j];
+        y[j] = a * sin[j] + b * cos[j];
+    }
+}
+
+// The vectorized cos and sin use the Cephes sinf/cosf polynomials on [-pi/4, pi/4]. The angle is reduced by
+// a multiple of pi/4 split into two parts, FMA keeps the reduction accurate for angles up to the largest position.
+#define ROPE_4_PI 1.27323954473516f
+#define ROPE_PI_4_A 0.78539818525314331f
+#define ROPE_PI_4_B -2.1855695e-08f
+#define ROPE_COS_C0 2.443315711809948e-5f
+#define ROPE_COS_C1 -1.388731625493765e-3f
+#define ROPE_COS_C2 4.166664568298827e-2f
+#define ROPE_SIN_C0 -1.9515295891e-4f
+#define ROPE_SIN_C1 8.3321608736e-3f
+#define ROPE_SIN_C2 -1.6666654611e-1f
+
+void ropeCosSin(float* cos, float* sin, const float* freqs, const unsigned int pos, const unsigned int n) {
+    const float p = (float)pos;
+    unsigned int j = 0;
+#if defined(__ARM_NEON)
+    const float32x4_t pv = vdupq_n_f32(p);
+    for (; j + 4 <= n; j += 4) {
+        const float32x4_t x = vmulq_f32(pv, vld1q_f32(&freqs[j]));
+        // The angles are not negative, so the truncation rounds down. The octant is rounded up to an even one.
+        uint32x4_t o = vreinterpretq_u32_s32(vcvtq_s32_f32(vmulq_n_f32(x, ROPE_4_PI)));
+        o = vandq_u32(vaddq_u32(o, vdupq_n_u32(1)), vdupq_n_u32(~1u));
+        const float32x4_t y = vcvtq_f32_u32(o);
+        float32x4_t r = vfmsq_f32(x, y, vdupq_n_f32(ROPE_PI_4_A));
+        r = vfmsq_f32(r, y, vdupq_n_f32(ROPE_PI_4_B));
+        const float32x4_t z = vmulq_f32(r, r);
+
+        float32x4_t pc = vfmaq_f32(vdupq_n_f32(ROPE_COS_C1), z, vdupq_n_f32(ROPE_COS_C0));
+        pc = vfmaq_f32(vdupq_n_f32(ROPE_COS_C2), z, pc);
+        pc = vmulq_f32(vmulq_f32(pc, z), z);
+        pc = vaddq_f32(vfmsq_f32(pc, z, vdupq_n_f32(0.5f)), vdupq_n_f32(1.0f));
+        float32x4_t ps = vfmaq_f32(vdupq_n_f32(ROPE_SIN_C1), z, vdupq_n_f32(ROPE_SIN_C0));
+        ps = vfmaq_f32(vdupq_n_f32(ROPE_SIN_C2), z, ps);
+        ps = vfmaq_f32(r, vmulq_f32(ps, z), r);
+
+        // In the octants 2 and 6 the polynomials swap places.
+        const uint32x4_t swap = vtstq_u32(o, vdupq_n_u32(2));
+        const uint32x4_t c = vreinterpretq_u32_f32(vbslq_f32(swap, ps, pc));
+        const uint32x4_t s = vreinterpretq_u32_f32(vbslq_f32(swap, pc, ps));
+        const uint32x4_t cSign = vshlq_n_u32(vandq_u32(vaddq_u32(o, vdupq_n_u32(2)), vdupq_n_u32(4)), 29);
+        const uint32x4_t sSign = vshlq_n_u32(vandq_u32(o, vdupq_n_u32(4)), 29);
+        vst1q_f32(&cos[j], vreinterpretq_f32_u32(veorq_u32(c, cSign)));
+        vst1q_f32(&sin[j], vreinterpretq_f32_u32(veorq_u32(s, sSign)));
+    }
+#elif defined(__AVX2__)
+    const __m256 pv = _mm256_set1_ps(p);
+    for (; j + 8 <= n; j += 8) {
+        const __m256 x = _mm256_mul_ps(pv, _mm256_loadu_ps(&freqs[j]));
+        // The angles are not negative, so the truncation rounds down. The octant is rounded up to an even one.
+        __m256i o = _mm256_cvttps_epi32(_mm256_mul_ps(x, _mm256_set1_ps(ROPE_4_PI)));
+        o = _mm256_and_si256(_mm256_add_epi32(o, _mm256_set1_epi32(1)), _mm256_set1_epi32(~1));
+        const __m256 y = _mm256_cvtepi32_ps(o);
+        __m256 r = _mm256_fnmadd_ps(y, _mm256_set1_ps(ROPE_PI_4_A), x);
+        r = _mm256_fnmadd_ps(y, _mm256_set1_ps(ROPE_PI_4_B), r);
+        const __m256 z = _mm256_mul_ps(r, r);
+
+        __m256 pc = _mm256_fmadd_ps(_mm256_set1_ps(ROPE_COS_C0), z, _mm256_set1_ps(ROPE_COS_C1));
+        pc = _mm256_fmadd_ps(pc, z, _mm256_set1_ps(ROPE_COS_C2));
+        pc = _mm256_mul_ps(_mm256_mul_ps(pc, z), z);
+        pc = _mm256_add_ps(_mm256_fnmadd_ps(_mm256_set1_ps(0.5f), z, pc), _mm256_set1_ps(1.0f));
+        __m256 ps = _mm256_fmadd_ps(_mm256_set1_ps(ROPE_SIN_C0), z, _mm256_set1_ps(ROPE_SIN_C1));
+        ps = _mm256_fmadd_ps(ps, z, _mm256_set1_ps(ROPE_SIN_C2));
+        ps = _mm256_fmadd_ps(_mm256_mul_ps(ps, z), r, r);
+
+        // In the octants 2 and 6 the polynomials swap places.
+        const __m256 swap = _mm256_castsi256_ps(_mm256_cmpeq_epi32(
+            _mm256_and_si256(o, _mm256_set1_epi32(2)), _mm256_set1_epi32(2)));
+        const __m256 c = _mm256_blendv_ps(pc, ps, swap);
+        const __m256 s = _mm256_blendv_ps(ps, pc, swap);
+        const __m256i cSign = _mm256_slli_epi32(_mm256_and_si256(_mm256_add_epi32(o, _mm256_set1_epi32(2)), _mm256_set1_epi32(4)), 29);
+        const __m256i sSign = _mm256_slli_epi32(_mm256_and_si256(o, _mm256_set1_epi32(4)), 29);
+        _mm256_storeu_ps(&cos[j], _mm256_xor_ps(c, _mm256_castsi256_ps(cSign)));
+        _mm256_storeu_ps(&sin[j], _mm256_xor_ps(s, _mm256_castsi256_ps(sSign)));
+    }
+#endif
+    for (; j < n; j++) {
+        const float val = p * freqs[j];
+        cos[j] = cosf(val);
+        sin[j] = sinf(val);
+    }
+}
+
+#if defined(__ARM_NEON) && defined(__ARM_FEATURE_DOTPROD)
+    #define KERNELS_NAME "neon+dotprod"
+#elif defined(__ARM_NEON)
+    #define KERNELS_NAME "neon"
+#elif defined(__AVX2__) && defined(MM256_DPBUSD)
+    #define KERNELS_NAME "avx2+vnni"
+#elif defined(__AVX2__)
+    #define KERNELS_NAME "avx2"
+#else
+    #define KERNELS_NAME "scalar"
+#endif
+
+const FuncsKernels funcsKernels = {
+    KERNELS_NAME,
+    softmax,
+    rms,
+    rmsnorm,
+    matmul,
+    matmulBatch,
+    dotProduct,
+    attention,
+    attentionPartial,
+    gelu,
+    silu,
+    mul,
+    mulScalar,
+    add,
+    ropeLlama,
+    ropeFalcon,
+    ropeCosSin
+};
+
+}
+
+#if defined(KERNELS_PRIMARY)
+
+static const FuncsKernels* kernels = SELECT_KERNELS(funcsKernels);
+
+const char* getKernelsName() {
+    return kernels->name;
+}
+
+void softmax(float* x, const unsigned int size) {
+    kernels->softmax(x, size);
+}
+
+float rms(const float* x, const unsigned int size) {
+    return kernels->rms(x, size);
+}
+
+void rmsnorm(float* o, const float* x, const float ms, const float* weight, const unsigned int size, const unsigned int nThreads, const unsigned int threadIndex) {
+    kernels->rmsnorm(o, x, ms, weight, size, nThreads, threadIndex);
+}
+
+void matmul(const FloatType weightsFloatType, const FloatType inputFloatType, float* output, const void* input, const void* weights, const unsigned int n, const unsigned int d, const unsigned int nThreads, const unsigned int threadIndex) {
+    kernels->matmul(weightsFloatType, inputFloatType, output, input, weights, n, d, nThreads, threadIndex);
+}
+
+void matmulBatch(const FloatType weightsFloatType, const FloatType inputFloatType, float* output, const void* input, const void* weights, const unsigned int n, const unsigned int d, const unsigned int nBatches, const size_t inputStride, const unsigned int outputStride, const unsigned int nThreads, const unsigned int threadIndex) {
+    kernels->matmulBatch(weightsFloatType, inputFloatType, output, input, weights, n, d, nBatches, inputStride, outputStride, nThreads, threadIndex);
+}
+
+float dotProduct(const float* a, const float* b, const unsigned int size) {
+    return kernels->dotProduct(a, b, size);
+}
+
+void attention(const FloatType cacheFloatType, float* output, const float* q, const void* keyCache, const void* valueCache, const unsigned int kvStride, const unsigned int headSize, const unsigned int nQueries, const unsigned int nPositions) {
+    kernels->attention(cacheFloatType, output, q, keyCache, valueCache, kvStride, headSize, nQueries, nPositions);
+}
+
+void attentionPartial(const FloatType cacheFloatType, float* output, float* maxScore, float* sum, const float* q, const void* keyCache, const void* valueCache, const unsigned int kvStride, const unsigned int headSize, const unsigned int nQueries, const unsigned int nPositions) {
+    kernels->attentionPartial(cacheFloatType, output, maxScore, sum, q, keyCache, valueCache, kvStride, headSize, nQueries, nPositions);
+}
+
+void gelu(float* t, const unsigned int n, const unsigned int nThreads, const unsigned int threadIndex) {
+    kernels->gelu(t, n, nThreads, threadIndex);
+}
+
+void silu(float* t, const unsigned int n, const unsigned int nThreads, const unsigned int threadIndex) {
+    kernels->silu(t, n, nThreads, threadIndex);
+}
+
+void mul(float* output, const float* input, const unsigned int n, const unsigned int nThreads, const unsigned int threadIndex) {
+    kernels->mul(output, input, n, nThreads, threadIndex);
+}
+
+void mulScalar(float* output, const float c, const unsigned int n, const unsigned int nThreads, const unsigned int threadIndex) {
+    kernels->mulScalar(output, c, n, nThreads, threadIndex);
+}
+
+void add(float* output, const float* input, const unsigned int n, const unsigned int nThreads, const unsigned int threadIndex) {
+    kernels->add(output, input, n, nThreads, threadIndex);
+}
+
+void ropeLlama(float* x, const float* cosSin, const unsigned int n) {
+    kernels->ropeLlama(x, cosSin, n);
+}
+
+void ropeFalcon(float* x, const float* cos, const float* sin, const unsigned int half) {
+    kernels->ropeFalcon(x, cos, sin, half);
+}
+
+void ropeCosSin(float* cos, float* sin, const float* freqs, const unsigned int pos, const unsigned int n) {
+    kernels->ropeCosSin(cos, sin, freqs, pos, n);
+}
+
+#endif
@@ -1,17 +1,34 @@
 #ifndef FUNCS_HPP
 #define FUNCS_HPP
 
+#include <cstddef>
 #include "quants.hpp"
 
+// The instruction set of the kernels selected for this CPU.
+const char* getKernelsName();
+
 void softmax(float* x, const unsigned int size);
 float rms(const float* x, const unsigned int size);
 void rmsnorm(float* o, const float* x, const float ms, const float* weight, const unsigned int size, const unsigned int nThreads, const unsigned int threadIndex);
 void matmul(const FloatType weightsFloatType, const FloatType inputFloatType, float* output, const void* input, const void* weights, const unsigned int n, const unsigned int d, const unsigned int nThreads, const unsigned int threadIndex);
+// The same for `nBatches` inputs, the input `b` starts at `b * inputStride` bytes, its output at `b * outputStride` floats.
+void matmulBatch(const FloatType weightsFloatType, const FloatType inputFloatType, float* output, const void* input, const void* weights, const unsigned int n, const unsigned int d, const unsigned int nBatches, const size_t inputStride, const unsigned int outputStride, const unsigned int nThreads, const unsigned int threadIndex);
 float dotProduct(const float* a, const float* b, const unsigned int size);
+// softmax(q * K^T / sqrt(headSize)) * V for query heads sharing one KV head, computed in one pass over the cache.
+void attention(const FloatType cacheFloatType, float* output, const float* q, const void* keyCache, const void* valueCache, const unsigned int kvStride, const unsigned int headSize, const unsigned int nQueries, const unsigned int nPositions);
+// The same for a part of the positions: the output is not normalized, `maxScore` and `sum` receive the maximum score
+// and the sum of exp(score - maxScore) of every query. Parts are merged by rescaling them to the largest maximum.
+void attentionPartial(const FloatType cacheFloatType, float* output, float* maxScore, float* sum, const float* q, const void* keyCache, const void* valueCache, const unsigned int kvStride, const unsigned int headSize, const unsigned int nQueries, const unsigned int nPositions);
 void gelu(float* t, const unsigned int n, const unsigned int nThreads, const unsigned int threadIndex);
 void silu(float* t, const unsigned int n, const unsigned int nThreads, const unsigned int threadIndex);
 void mul(float* output, const float* input, const unsigned int n, const unsigned int nThreads, const unsigned int threadIndex);
 void mulScalar(float* output, const float c, const unsigned int n, const unsigned int nThreads, const unsigned int threadIndex);
 void add(float* output, const float* input, const unsigned int n, const unsigned int nThreads, const unsigned int threadIndex);
+// Rotates the pairs (x[i], x[i + 1]) by the angles given as interleaved (cos, sin) pairs.
+void ropeLlama(float* x, const float* cosSin, const unsigned int n);
+// Rotates the pairs (x[j], x[j + half]) of one head by the angles given as cos[j] and sin[j].
+void ropeFalcon(float* x, const float* cos, const float* sin, const unsigned int half);
+// Computes cos[j] and sin[j] of the angles pos * freqs[j].
+void ropeCosSin(float* cos, float* sin, const float* freqs, const unsigned int pos, const unsigned int n);
 
 #endif
@@ -26,6 +26,28 @@ void compare(float* a, float* b, int n) {
     }
 }
 
+void forward(TransformerArch* arch, Transformer* transformer, SocketPool* socketPool, const char* name) {
+    int nThreads = 4;
+    TransformerContext context;
+    context.transformer = transformer;
+    context.currentBlockIndex = 0;
+    context.socket = NULL;
+    context.socketPool = socketPool;
+
+    int skipLastNTasks = 4;
+    TaskLoop loop(nThreads, arch->inference.nTasks - skipLastNTasks, TASK_N_TYPES, arch->inference.tasks, &context, TASK_LOOP_DEFAULT_SPIN_BUDGET);
+    long t0 = timeMs();
+    loop.run();
+    long t1 = timeMs();
+
+    float* x = transformer->x;
+    compare(&x[0], expectedOutput_0_4, 4);
+    compare(&x[256], expectedOutput_256_260, 4);
+    compare(&x[5012], expectedOutput_5012_5016, 4);
+
+    printf("✅ %s in %ldms\n", name, t1 - t0);
+}
+
 int main() {
     TransformerSpec spec;
     spec.headerSize = sizeof(TransformerFileOldHeader) + sizeof(int);
@@ -43,6 +65,10 @@ int main() {
     spec.nActiveExperts = 2;
     spec.weightsFloatType = F32;
     spec.bufferFloatType = F32;
+    spec.kvCacheFloatType = F32;
+    spec.ropeCache = true;
+    spec.nBatches = 1;
+    spec.nSequences = 1;
     spec.nSlices = 1;
     spec.hiddenAct = GELU;
     spec.ropeTheta = 10000.0f;
@@ -62,31 +88,20 @@ int main() {
     SocketPool socketPool(0, NULL);
     AcceleratorContext acc(0, 1, NULL);
     Transformer transformer = Transformer::loadRoot(weights, &spec, &socketPool, &acc);
-    transformer.pos = 0;
+    transformer.positions[0] = 0;
 
     float* x = transformer.x;
     for (int i = 0; i < spec.dim; i++) x[i] = (randomF32(&state) / 100.0) / 78.38367176906169f;
+    float* input = new float[spec.dim];
+    memcpy(input, x, spec.dim * sizeof(float));
 
     TransformerArch arch = buildGrok1Arch(&spec);
+    forward(&arch, &transformer, &socketPool, "Block forwarded correctly");
 
-    int nThreads = 4;
-    TransformerContext context;
-    context.transformer = &transformer;
-    context.currentBlockIndex = 0;
-    context.socket = NULL;
-    context.socketPool = &socketPool;
-
-    int skipLastNTasks = 4;
-    TaskLoop loop(nThreads, arch.inference.nTasks - skipLastNTasks, TASK_N_TYPES, arch.inference.tasks, &context);
-    long t0 = timeMs();
-    loop.run();
-    long t1 = timeMs();
+    memcpy(x, input, spec.dim * sizeof(float));
+    fuseGrok1Arch(&arch);
+    forward(&arch, &transformer, &socketPool, "Fused block forwarded correctly");
 
+    delete[] input;
     freeBuffer(weights);
-
-    compare(&x[0], expectedOutput_0_4, 4);
-    compare(&x[256], expectedOutput_256_260, 4);
-    compare(&x[5012], expectedOutput_5012_5016, 4);
-
-    printf("✅ Block forwarded correctly in %ldms\n", t1 - t0);
 }
@@ -22,7 +22,7 @@ void grokRmfFfn(TASK_ARGS) {
             float* xbv = (float*)transformer->buffer->getSliced(TB_SLICED_XBV, s);
             add(xb2, xbv, spec->dim, 1, 0);
         }
-        transformer->rms = rms(xb2, spec->dim);
+        transformer->rms[0] = rms(xb2, spec->dim);
     }
 }
 
@@ -30,7 +30,7 @@ void grokRmfFfnNorm(TASK_ARGS) {
     TASK_VARIABLES;
     float* xb2 = (float*)transformer->buffer->getUnit(TB_SLICED_XB2);
 
-    rmsnorm(xb2, xb2, transformer->rms, block->rmsFfn, spec->dim, nThreads, threadIndex);
+    rmsnorm(xb2, xb2, transformer->rms[0], block->rmsFfn, spec->dim, nThreads, threadIndex);
 }
 
 void grokRmfFfnNormJoin(TASK_ARGS) {
@@ -43,14 +43,14 @@ void grokRmfFfnNormJoin(TASK_ARGS) {
 void grokMoeRms(TASK_ARGS) {
     TASK_VARIABLES;
     if (threadIndex == 0) {
-        transformer->rms = rms(transformer->x, spec->dim);
+        transformer->rms[0] = rms(transformer->x, spec->dim);
     }
 }
 
 void grokMoeRmsNorm(TASK_ARGS) {
     TASK_VARIABLES;
     float* xb = (float*)transformer->buffer->getUnit(TB_UNIT_XB);
-    rmsnorm(xb, transformer->x, transformer->rms, block->rmsMoe, spec->dim, nThreads, threadIndex);
+    rmsnorm(xb, transformer->x, transformer->rms[0], block->rmsMoe, spec->dim, nThreads, threadIndex);
 }
 
 void grokMoeRouter(TASK_ARGS) {
@@ -246,14 +246,14 @@ void grokMoeRmsFinal(TASK_ARGS) {
     TASK_VARIABLES;
     if (threadIndex == 0) {
         float* xb2 = (float*)transformer->buffer->getUnit(TB_SLICED_XB2);
-        transformer->rms = rms(xb2, spec->dim);
+        transformer->rms[0] = rms(xb2, spec->dim);
     }
 }
 
 void grokMoeRmsNormFinal(TASK_ARGS) {
     TASK_VARIABLES;
     float* xb2 = (float*)transformer->buffer->getUnit(TB_SLICED_XB2);
-    rmsnorm(xb2, xb2, transformer->rms, block->rmsFfn2, spec->dim, nThreads, threadIndex);
+    rmsnorm(xb2, xb2, transformer->rms[0], block->rmsFfn2, spec->dim, nThreads, threadIndex);
 }
 
 void grokMoeAdd(TASK_ARGS) {
@@ -272,82 +272,137 @@ void grokFinalize2(TASK_ARGS) {
     mulScalar(transformer->logits, 0.5773502691896257f, spec->vocabSize, nThreads, threadIndex);
 }
 
+void grokFusedRmfFfnNorm(TASK_ARGS) {
+    grokRmfFfnNorm(nThreads, threadIndex, userData);
+    grokRmfFfnNormJoin(nThreads, threadIndex, userData);
+}
+
+void grokFusedMoeRms(TASK_ARGS) {
+    TASK_VARIABLES;
+    rmsnormUnitBuffer(nThreads, threadIndex, ctx, transformer->x, block->rmsMoe, TB_UNIT_XB, false, 0);
+}
+
+void grokFusedMoeTopk(TASK_ARGS) {
+    grokMoeRouterSoftmax(nThreads, threadIndex, userData);
+    grokMoeTopk(nThreads, threadIndex, userData);
+    grokMoeNormWeights(nThreads, threadIndex, userData);
+}
+
+void grokFusedMoeBlock0(TASK_ARGS) {
+    // The activation is split between threads in the same way as the rows of the matmul, so each thread
+    // reads only the values computed by itself.
+    grokMoeBlock0(nThreads, threadIndex, userData);
+    grokMoeBlock1(nThreads, threadIndex, userData);
+}
+
+void grokFusedMoeAdd(TASK_ARGS) {
+    grokMoeRmsNormFinal(nThreads, threadIndex, userData);
+    grokMoeAdd(nThreads, threadIndex, userData);
+}
+
+void fuseGrok1Arch(TransformerArch* a) {
+    // Quantizations of the root slice are no-ops on the root, see fuseLlamaArch().
+    const TaskFusion inference[] = {
+        { 3, { llamaRmsAtt, llamaRmsAttNorm, llamaQuantizeRmsAtt }, TASK(llamaFusedRmsAtt) },
+        { 2, { llamaMergeMultiheadAtt, llamaQuantizeMultiheadAtt }, TASK(llamaFusedMergeMultiheadAtt) },
+        { 2, { llamaAtt, llamaQuantizeAtt }, TASK(llamaAtt) },
+        { 2, { grokRmfFfnNorm, grokRmfFfnNormJoin }, TASK(grokFusedRmfFfnNorm) },
+        { 2, { grokMoeRms, grokMoeRmsNorm }, TASK(grokFusedMoeRms) },
+        { 3, { grokMoeRouterSoftmax, grokMoeTopk, grokMoeNormWeights }, TASK(grokFusedMoeTopk) },
+        { 2, { grokMoeBlock0, grokMoeBlock1 }, TASK(grokFusedMoeBlock0) },
+        { 2, { grokMoeBlock2, grokQuantizeMoeOutput }, TASK(grokMoeBlock2) },
+        { 2, { grokMoeRmsNormFinal, grokMoeAdd }, TASK(grokFusedMoeAdd) },
+    };
+    const TaskFusion worker[] = {
+        { 2, { llamaMergeMultiheadAtt, llamaQuantizeMultiheadAtt }, TASK(llamaFusedMergeMultiheadAtt) },
+        { 2, { grokMoeBlock0, grokMoeBlock1 }, TASK(grokFusedMoeBlock0) },
+    };
+    a->fuseI(sizeof(inference) / sizeof(TaskFusion), inference);
+    a->fuseW(sizeof(worker) / sizeof(TaskFusion), worker);
+}
+
 TransformerArch buildGrok1Arch(TransformerSpec* spec) {
     TransformerArch a;
 
     // inference
 
-    a.I(sendPos, TASK_TYPE_TRANSFER);
-    a.I(grokMulInput, TASK_TYPE_INFERENCE);
+    // Transfers run on the I/O thread. Reads of the workers' slices are started before the root computes
+    // its own slice, the first task which needs the transferred data joins them.
+    a.I(TASK(sendPos), TASK_TYPE_TRANSFER, TASK_FLAG_ASYNC);
+    a.I(TASK(grokMulInput), TASK_TYPE_INFERENCE);
     for (int i = 0; i < spec->nLayers; i++) {
-        a.I(llamaRmsAtt, TASK_TYPE_INFERENCE);
-        a.I(llamaRmsAttNorm, TASK_TYPE_INFERENCE);
-        a.I(llamaQuantizeRmsAtt, TASK_TYPE_INFERENCE);
-        a.I(llamaSyncRmsAtt, TASK_TYPE_TRANSFER);
-        a.I(llamaQkv, TASK_TYPE_INFERENCE);
-        a.I(llamaRope, TASK_TYPE_INFERENCE);
-        a.I(llamaMultiheadAtt, TASK_TYPE_INFERENCE);
-        a.I(llamaQuantizeMultiheadAtt, TASK_TYPE_INFERENCE);
-        a.I(llamaAtt, TASK_TYPE_INFERENCE);
-        a.I(llamaQuantizeAtt, TASK_TYPE_INFERENCE);
-        a.I(llamaSyncAtt, TASK_TYPE_TRANSFER);
-        a.I(llamaDequantizeAtt, TASK_TYPE_INFERENCE);
-        a.I(grokRmfFfn, TASK_TYPE_INFERENCE);
-        a.I(grokRmfFfnNorm, TASK_TYPE_INFERENCE);
-        a.I(grokRmfFfnNormJoin, TASK_TYPE_INFERENCE);
-
-        a.I(grokMoeRms, TASK_TYPE_INFERENCE);
-        a.I(grokMoeRmsNorm, TASK_TYPE_INFERENCE);
-        a.I(grokMoeRouter, TASK_TYPE_INFERENCE);
-        a.I(grokMoeRouterSoftmax, TASK_TYPE_INFERENCE);
-        a.I(grokMoeTopk, TASK_TYPE_INFERENCE);
-        a.I(grokMoeNormWeights, TASK_TYPE_INFERENCE);
-        a.I(grokQuantizeMoeInput, TASK_TYPE_INFERENCE);
-        a.I(grokSyncMoeInput, TASK_TYPE_TRANSFER);
-        a.I(grokMoeBlock0, TASK_TYPE_INFERENCE);
-        a.I(grokMoeBlock1, TASK_TYPE_INFERENCE);
-        a.I(grokQuantizeMoeMul, TASK_TYPE_INFERENCE);
-        a.I(grokSyncMoeMulA, TASK_TYPE_INFERENCE);
-        a.I(grokSyncMoeMulRearrange, TASK_TYPE_INFERENCE);
-        a.I(grokSyncMoeMulB, TASK_TYPE_INFERENCE);
-        a.I(grokMoeBlock2, TASK_TYPE_INFERENCE);
-        a.I(grokQuantizeMoeOutput, TASK_TYPE_INFERENCE);
-        a.I(grokSyncMoeOutput, TASK_TYPE_TRANSFER);
-        a.I(grokDequantizeMoeOutput, TASK_TYPE_INFERENCE);
-        a.I(grokMoeRmsFinal, TASK_TYPE_INFERENCE);
-        a.I(grokMoeRmsNormFinal, TASK_TYPE_INFERENCE);
-        a.I(grokMoeAdd, TASK_TYPE_INFERENCE);
-        a.I(llamaNextBlock, TASK_TYPE_INFERENCE);
+        a.I(TASK(llamaRmsAtt), TASK_TYPE_INFERENCE);
+        a.I(TASK(llamaRmsAttNorm), TASK_TYPE_INFERENCE);
+        a.I(TASK(llamaQuantizeRmsAtt), TASK_TYPE_INFERENCE);
+        a.I(TASK(llamaSyncRmsAtt), TASK_TYPE_TRANSFER, TASK_FLAG_ASYNC);
+        a.I(TASK(llamaQkv), TASK_TYPE_INFERENCE);
+        a.I(TASK(llamaRope), TASK_TYPE_INFERENCE);
+        if (isKvCacheStaged(spec)) a.I(TASK(llamaStoreKv), TASK_TYPE_INFERENCE);
+        a.I(TASK(llamaMultiheadAtt), TASK_TYPE_INFERENCE, TASK_FLAG_JOIN);
+        a.I(TASK(llamaMergeMultiheadAtt), TASK_TYPE_INFERENCE);
+        a.I(TASK(llamaQuantizeMultiheadAtt), TASK_TYPE_INFERENCE);
+        a.I(TASK(llamaSyncAtt), TASK_TYPE_TRANSFER, TASK_FLAG_ASYNC);
+        a.I(TASK(llamaAtt), TASK_TYPE_INFERENCE);
+        a.I(TASK(llamaQuantizeAtt), TASK_TYPE_INFERENCE);
+        a.I(TASK(llamaDequantizeAtt), TASK_TYPE_INFERENCE, TASK_FLAG_JOIN);
+        a.I(TASK(grokRmfFfn), TASK_TYPE_INFERENCE);
+        a.I(TASK(grokRmfFfnNorm), TASK_TYPE_INFERENCE);
+        a.I(TASK(grokRmfFfnNormJoin), TASK_TYPE_INFERENCE);
+
+        a.I(TASK(grokMoeRms), TASK_TYPE_INFERENCE);
+        a.I(TASK(grokMoeRmsNorm), TASK_TYPE_INFERENCE);
+        a.I(TASK(grokMoeRouter), TASK_TYPE_INFERENCE);
+        a.I(TASK(grokMoeRouterSoftmax), TASK_TYPE_INFERENCE);
+        a.I(TASK(grokMoeTopk), TASK_TYPE_INFERENCE);
+        a.I(TASK(grokMoeNormWeights), TASK_TYPE_INFERENCE);
+        a.I(TASK(grokQuantizeMoeInput), TASK_TYPE_INFERENCE);
+        a.I(TASK(grokSyncMoeInput), TASK_TYPE_TRANSFER, TASK_FLAG_ASYNC);
+        a.I(TASK(grokSyncMoeMulA), TASK_TYPE_TRANSFER, TASK_FLAG_ASYNC);
+        a.I(TASK(grokMoeBlock0), TASK_TYPE_INFERENCE);
+        a.I(TASK(grokMoeBlock1), TASK_TYPE_INFERENCE);
+        a.I(TASK(grokQuantizeMoeMul), TASK_TYPE_INFERENCE);
+        a.I(TASK(grokSyncMoeMulRearrange), TASK_TYPE_INFERENCE, TASK_FLAG_JOIN);
+        a.I(TASK(grokSyncMoeMulB), TASK_TYPE_TRANSFER, TASK_FLAG_ASYNC);
+        a.I(TASK(grokSyncMoeOutput), TASK_TYPE_TRANSFER, TASK_FLAG_ASYNC);
+        a.I(TASK(grokMoeBlock2), TASK_TYPE_INFERENCE);
+        a.I(TASK(grokQuantizeMoeOutput), TASK_TYPE_INFERENCE);
+        a.I(TASK(grokDequantizeMoeOutput), TASK_TYPE_INFERENCE, TASK_FLAG_JOIN);
+        a.I(TASK(grokMoeRmsFinal), TASK_TYPE_INFERENCE);
+        a.I(TASK(grokMoeRmsNormFinal), TASK_TYPE_INFERENCE);
+        a.I(TASK(grokMoeAdd), TASK_TYPE_INFERENCE);
+        a.I(TASK(llamaNextBlock), TASK_TYPE_INFERENCE);
     }
 
-    a.I(llamaRmsFinal, TASK_TYPE_INFERENCE);
-    a.I(llamaRmsFinalNorm, TASK_TYPE_INFERENCE);
-    a.I(grokFinalize, TASK_TYPE_INFERENCE);
-    a.I(grokFinalize2, TASK_TYPE_INFERENCE);
+    a.I(TASK(llamaRmsFinal), TASK_TYPE_INFERENCE);
+    a.I(TASK(llamaRmsFinalNorm), TASK_TYPE_INFERENCE);
+    a.I(TASK(grokFinalize), TASK_TYPE_INFERENCE);
+    a.I(TASK(grokFinalize2), TASK_TYPE_INFERENCE);
 
     // worker
 
     for (int i = 0; i < spec->nLayers; i++) {
-        a.W(llamaSyncRmsAtt, TASK_TYPE_TRANSFER);
-        a.W(llamaQkv, TASK_TYPE_INFERENCE);
-        a.W(llamaRope, TASK_TYPE_INFERENCE);
-        a.W(llamaMultiheadAtt, TASK_TYPE_INFERENCE);
-        a.W(llamaQuantizeMultiheadAtt, TASK_TYPE_INFERENCE);
-        a.W(llamaAtt, TASK_TYPE_INFERENCE);
-        a.W(llamaQuantizeAtt, TASK_TYPE_INFERENCE);
-        a.W(llamaSyncAtt, TASK_TYPE_TRANSFER);
-
-        a.W(grokSyncMoeInput, TASK_TYPE_TRANSFER);
-        a.W(grokMoeBlock0, TASK_TYPE_INFERENCE);
-        a.W(grokMoeBlock1, TASK_TYPE_INFERENCE);
-        a.W(grokQuantizeMoeMul, TASK_TYPE_INFERENCE);
-        a.W(grokSyncMoeMulA, TASK_TYPE_INFERENCE);
-        a.W(grokSyncMoeMulB, TASK_TYPE_INFERENCE);
-        a.W(grokMoeBlock2, TASK_TYPE_INFERENCE);
-        a.W(grokQuantizeMoeOutput, TASK_TYPE_INFERENCE);
-        a.W(grokSyncMoeOutput, TASK_TYPE_TRANSFER);
-
-        a.W(llamaNextBlock, TASK_TYPE_INFERENCE);
+        a.W(TASK(llamaSyncRmsAtt), TASK_TYPE_TRANSFER);
+        a.W(TASK(llamaQkv), TASK_TYPE_INFERENCE);
+        a.W(TASK(llamaRope), TASK_TYPE_INFERENCE);
+        if (isKvCacheStaged(spec)) a.W(TASK(llamaStoreKv), TASK_TYPE_INFERENCE);
+        a.W(TASK(llamaMultiheadAtt), TASK_TYPE_INFERENCE);
+        a.W(TASK(llamaMergeMultiheadAtt), TASK_TYPE_INFERENCE);
+        a.W(TASK(llamaQuantizeMultiheadAtt), TASK_TYPE_INFERENCE);
+        a.W(TASK(llamaAtt), TASK_TYPE_INFERENCE);
+        a.W(TASK(llamaQuantizeAtt), TASK_TYPE_INFERENCE);
+        a.W(TASK(llamaSyncAtt), TASK_TYPE_TRANSFER);
+
+        a.W(TASK(grokSyncMoeInput), TASK_TYPE_TRANSFER);
+        a.W(TASK(grokMoeBlock0), TASK_TYPE_INFERENCE);
+        a.W(TASK(grokMoeBlock1), TASK_TYPE_INFERENCE);
+        a.W(TASK(grokQuantizeMoeMul), TASK_TYPE_INFERENCE);
+        a.W(TASK(grokSyncMoeMulA), TASK_TYPE_TRANSFER);
+        a.W(TASK(grokSyncMoeMulB), TASK_TYPE_TRANSFER);
+        a.W(TASK(grokMoeBlock2), TASK_TYPE_INFERENCE);
+        a.W(TASK(grokQuantizeMoeOutput), TASK_TYPE_INFERENCE);
+        a.W(TASK(grokSyncMoeOutput), TASK_TYPE_TRANSFER);
+
+        a.W(TASK(llamaNextBlock), TASK_TYPE_INFERENCE);
     }
 
     return a;
@@ -27,7 +27,10 @@ void grokDequantizeMoeOutput(TASK_ARGS);
 void grokMoeRmsFinal(TASK_ARGS);
 void grokMoeRmsNormFinal(TASK_ARGS);
 void grokMoeAdd(TASK_ARGS);
+void grokFusedMoeTopk(TASK_ARGS);
+void grokFusedMoeBlock0(TASK_ARGS);
 
 TransformerArch buildGrok1Arch(TransformerSpec* spec);
+void fuseGrok1Arch(TransformerArch* a);
 
 #endif
\ No newline at end of file
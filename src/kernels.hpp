@@ -0,0 +1,63 @@
+#ifndef KERNELS_HPP
+#define KERNELS_HPP
+
+#include "quants.hpp"
+#include "utils.hpp"
+
+// funcs.cpp and quants.cpp put their kernels into the `KERNELS_VARIANT` namespace and expose them through
+// the tables below. A regular build compiles them once, into the `base` namespace. A `PORTABLE=1` build
+// compiles the `base` variant for the baseline instruction set, compiles them again with extra instruction
+// sets enabled (`-DKERNELS_VARIANT=avx2` etc.) and selects the best variant for the CPU at startup.
+#ifndef KERNELS_VARIANT
+    #define KERNELS_VARIANT base
+    #define KERNELS_PRIMARY
+#endif
+
+struct FuncsKernels {
+    const char* name;
+    void (*softmax)(float* x, const unsigned int size);
+    float (*rms)(const float* x, const unsigned int size);
+    void (*rmsnorm)(float* o, const float* x, const float ms, const float* weight, const unsigned int size, const unsigned int nThreads, const unsigned int threadIndex);
+    void (*matmul)(const FloatType weightsFloatType, const FloatType inputFloatType, float* output, const void* input, const void* weights, const unsigned int n, const unsigned int d, const unsigned int nThreads, const unsigned int threadIndex);
+    void (*matmulBatch)(const FloatType weightsFloatType, const FloatType inputFloatType, float* output, const void* input, const void* weights, const unsigned int n, const unsigned int d, const unsigned int nBatches, const size_t inputStride, const unsigned int outputStride, const unsigned int nThreads, const unsigned int threadIndex);
+    float (*dotProduct)(const float* a, const float* b, const unsigned int size);
+    void (*attention)(const FloatType cacheFloatType, float* output, const float* q, const void* keyCache, const void* valueCache, const unsigned int kvStride, const unsigned int headSize, const unsigned int nQueries, const unsigned int nPositions);
+    void (*attentionPartial)(const FloatType cacheFloatType, float* output, float* maxScore, float* sum, const float* q, const void* keyCache, const void* valueCache, const unsigned int kvStride, const unsigned int headSize, const unsigned int nQueries, const unsigned int nPositions);
+    void (*gelu)(float* t, const unsigned int n, const unsigned int nThreads, const unsigned int threadIndex);
+    void (*silu)(float* t, const unsigned int n, const unsigned int nThreads, const unsigned int threadIndex);
+    void (*mul)(float* output, const float* input, const unsigned int n, const unsigned int nThreads, const unsigned int threadIndex);
+    void (*mulScalar)(float* output, const float c, const unsigned int n, const unsigned int nThreads, const unsigned int threadIndex);
+    void (*add)(float* output, const float* input, const unsigned int n, const unsigned int nThreads, const unsigned int threadIndex);
+    void (*ropeLlama)(float* x, const float* cosSin, const unsigned int n);
+    void (*ropeFalcon)(float* x, const float* cos, const float* sin, const unsigned int half);
+    void (*ropeCosSin)(float* cos, float* sin, const float* freqs, const unsigned int pos, const unsigned int n);
+};
+
+struct QuantsKernels {
+    void (*dequantizeQ40Row)(const BlockQ40* x, float* y, int k);
+    void (*quantizeQ80Row)(float* input, BlockQ80* output, int k, unsigned int nThreads, unsigned int threadIndex);
+    void (*dequantizeQ80Row)(const BlockQ80* input, float* output, int k, unsigned int nThreads, unsigned int threadIndex);
+};
+
+#define DECLARE_KERNELS_VARIANT(variant) \
+    namespace variant { \
+        extern const FuncsKernels funcsKernels; \
+        extern const QuantsKernels quantsKernels; \
+    }
+
+DECLARE_KERNELS_VARIANT(base)
+
+#if defined(KERNELS_PORTABLE) && (defined(__x86_64__) || defined(_M_X64))
+    DECLARE_KERNELS_VARIANT(avx2)
+    DECLARE_KERNELS_VARIANT(avx512)
+    #define SELECT_KERNELS(table) \
+        ((getCpuFeatures() & CPU_AVX512) ? &avx512::table : (getCpuFeatures() & CPU_AVX2) ? &avx2::table : &base::table)
+#elif defined(KERNELS_PORTABLE) && defined(__aarch64__)
+    DECLARE_KERNELS_VARIANT(dotprod)
+    #define SELECT_KERNELS(table) \
+        ((getCpuFeatures() & CPU_DOTPROD) ? &dotprod::table : &base::table)
+#else
+    #define SELECT_KERNELS(table) (&base::table)
+#endif
+
+#endif
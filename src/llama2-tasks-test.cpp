@@ -524,7 +524,232 @@ float expectedOutput[4096] = {
     1.00493455, 1.00216055, 1.02500832, 1.01412213, 0.997673035, 1.01922369, 1.01705575, 1.01369667,
 };
 
+void forward(TransformerArch* arch, Transformer* transformer, SocketPool* socketPool, float* expectedOutput, const char* name) {
+    int nThreads = 4;
+    TransformerContext context;
+    context.transformer = transformer;
+    context.currentBlockIndex = 0;
+    context.socket = NULL;
+    context.socketPool = socketPool;
+
+    int skipLastNTasks = 3;
+    TaskLoop loop(nThreads, arch->inference.nTasks - skipLastNTasks, TASK_N_TYPES, arch->inference.tasks, &context, TASK_LOOP_DEFAULT_SPIN_BUDGET);
+    long t0 = timeMs();
+    loop.run();
+    long t1 = timeMs();
+
+    float* x = transformer->x;
+    int ix = -1;
+    for (int i = 0; i < transformer->spec->dim; i++) {
+        if (std::isnan(x[i]) || fabs(x[i] - expectedOutput[i]) > 0.00001) { // Optimization may cause some differences
+            ix = i;
+            break;
+        }
+    }
+    if (ix < 0) {
+        printf("✅ %s in %ldms\n", name, t1 - t0);
+    } else {
+        printf("❌ ix=%d\n", ix);
+        printf("%.9g != %.9g\n", x[ix], expectedOutput[ix]); ix++;
+        printf("%.9g != %.9g\n", x[ix], expectedOutput[ix]); ix++;
+        printf("%.9g != %.9g\n", x[ix], expectedOutput[ix]); ix++;
+        printf("%.9g != %.9g\n", x[ix], expectedOutput[ix]); ix++;
+        exit(EXIT_FAILURE);
+    }
+}
+
+TransformerSpec createSmallSpec(FloatType kvCacheFloatType, unsigned int nSequences) {
+    TransformerSpec spec;
+    spec.headerSize = sizeof(TransformerFileOldHeader) + sizeof(int);
+    spec.archType = LLAMA;
+    spec.dim = 256;
+    spec.nLayers = 2;
+    spec.headSize = 32;
+    spec.nKvHeads = 4;
+    spec.seqLen = 16;
+    spec.hiddenDim = 512;
+    spec.nHeads = spec.dim / spec.headSize;
+    spec.kvDim = (spec.dim * spec.nKvHeads) / spec.nHeads;
+    spec.nExperts = 0;
+    spec.nActiveExperts = 0;
+    spec.vocabSize = 64;
+    spec.weightsFloatType = F32;
+    spec.bufferFloatType = F32;
+    spec.kvCacheFloatType = kvCacheFloatType;
+    spec.ropeCache = true;
+    spec.nBatches = 4;
+    spec.nSequences = nSequences;
+    spec.nSlices = 1;
+    spec.hiddenAct = SILU;
+    spec.ropeTheta = 10000.0f;
+    return spec;
+}
+
+// The random weights in the order read by `Transformer::loadRoot`.
+char* createSmallModelData(TransformerSpec* spec) {
+    const size_t embeddingSize = spec->vocabSize * spec->dim;
+    const size_t blockSize = 2 * spec->dim * spec->dim + 2 * spec->dim * spec->kvDim + 3 * spec->dim * spec->hiddenDim + 2 * spec->dim;
+    const size_t n = embeddingSize + spec->nLayers * blockSize + spec->dim + embeddingSize;
+    spec->fileSize = n * sizeof(float) + spec->headerSize;
+
+    float* data = (float*)newBuffer(n * sizeof(float));
+    unsigned long long state = 800000010L;
+    for (size_t i = 0; i < n; i++) data[i] = (randomF32(&state) - 0.5f) / 8.0f;
+    return (char*)data;
+}
+
+// A small model with random weights, cheap enough to run the same tokens many times.
+class SmallModel {
+public:
+    TransformerSpec spec;
+    char* data;
+    SocketPool socketPool;
+    AcceleratorContext acc;
+    Transformer transformer;
+    TransformerArch arch;
+    Inference* inference;
+
+    SmallModel(FloatType kvCacheFloatType, unsigned int nSequences, bool fused)
+        : spec(createSmallSpec(kvCacheFloatType, nSequences)), data(createSmallModelData(&spec)), socketPool(0, NULL), acc(0, 1, NULL),
+        transformer(Transformer::loadRoot(data, &spec, &socketPool, &acc)), arch(buildLlamaArch(&spec)) {
+        if (fused) fuseLlamaArch(&arch);
+        inference = new Inference(&arch, 4, TASK_LOOP_DEFAULT_SPIN_BUDGET, &transformer, &socketPool);
+    }
+
+    ~SmallModel() {
+        delete inference;
+        freeBuffer(data);
+    }
+
+    // The size of the output of one token: the row of `x`, the logits and the rows of the KV cache of all blocks.
+    unsigned int getRowSize() {
+        return spec.dim + spec.vocabSize + spec.nLayers * 2 * transformer.blocks[0]->kvCacheSlice->kvDim0;
+    }
+
+    // Copies the output of the token `b` of the last batch, the logits are taken from the logits row `l`.
+    void readRow(unsigned int b, unsigned int l, float* output) {
+        memcpy(output, &transformer.x[b * spec.dim], spec.dim * sizeof(float));
+        output += spec.dim;
+        memcpy(output, &transformer.logits[l * spec.vocabSize], spec.vocabSize * sizeof(float));
+        output += spec.vocabSize;
+
+        const unsigned int row = transformer.sequences[b] * spec.seqLen + transformer.positions[b];
+        for (int i = 0; i < spec.nLayers; i++) {
+            TransformerBlock* block = transformer.blocks[i];
+            KvCacheSlice* slice = block->kvCacheSlice;
+            for (unsigned int j = 0; j < slice->kvDim0; j++) {
+                *output++ = readKvCache(slice, block->keyCache, row, j);
+                *output++ = readKvCache(slice, block->valueCache, row, j);
+            }
+        }
+    }
+
+private:
+    float readKvCache(KvCacheSlice* slice, void* cache, unsigned int row, unsigned int offset) {
+        void* value = slice->at(cache, row, offset);
+        return slice->type == F16 ? convertF16ToF32(*(uint16_t*)value) : *(float*)value;
+    }
+};
+
+// The reference output: every token runs alone on a model with one sequence and a F32 KV cache, so its keys and values
+// are written directly by the matmuls. The sequences run one after another, each one overwrites the rows of the previous.
+void forwardOneByOne(const int* tokens, const pos_t* positions, const pos_t* sequences, unsigned int nTokens, float* output) {
+    SmallModel model(F32, 1, false);
+    const unsigned int rowSize = model.getRowSize();
+    pos_t maxSequence = 0;
+    for (unsigned int b = 0; b < nTokens; b++) {
+        if (sequences[b] > maxSequence) maxSequence = sequences[b];
+    }
+    const pos_t sequence = 0;
+    for (pos_t s = 0; s <= maxSequence; s++) {
+        for (unsigned int b = 0; b < nTokens; b++) {
+            if (sequences[b] != s) continue;
+            model.inference->inferBatch(&tokens[b], &positions[b], &sequence, 1, 1);
+            model.readRow(0, 0, &output[b * rowSize]);
+        }
+    }
+}
+
+// Runs the tokens as one batch, every token must produce the same output as when it runs alone. The rows before the
+// logits rows are not normalized by the final norm, only their KV cache rows are compared.
+void testBatch(FloatType kvCacheFloatType, unsigned int nSequences, bool fused,
+    const int* tokens, const pos_t* positions, const pos_t* sequences, unsigned int nTokens, unsigned int nLogits, const char* name) {
+    SmallModel model(kvCacheFloatType, nSequences, fused);
+    const unsigned int rowSize = model.getRowSize();
+    const unsigned int kvOffset = model.spec.dim + model.spec.vocabSize;
+    const unsigned int firstLogitsRow = nTokens - nLogits;
+    const float tolerance = kvCacheFloatType == F16 ? 0.01f : 0.0001f;
+    float* expected = new float[nTokens * rowSize];
+    float* row = new float[rowSize];
+    forwardOneByOne(tokens, positions, sequences, nTokens, expected);
+
+    model.inference->inferBatch(tokens, positions, sequences, nTokens, nLogits);
+    for (unsigned int b = 0; b < nTokens; b++) {
+        model.readRow(b, b < firstLogitsRow ? 0 : b - firstLogitsRow, row);
+        for (unsigned int i = b < firstLogitsRow ? kvOffset : 0; i < rowSize; i++) {
+            const float e = expected[b * rowSize + i];
+            if (std::isnan(row[i]) || fabs(row[i] - e) > tolerance * (1.0f + fabs(e))) {
+                printf("❌ %s: token=%u i=%u %.9g != %.9g\n", name, b, i, row[i], e);
+                exit(EXIT_FAILURE);
+            }
+        }
+    }
+
+    delete[] expected;
+    delete[] row;
+    printf("✅ %s\n", name);
+}
+
+// Saves the rows of one sequence and loads them into the other one, so a row offset of the save or of the load moves
+// the restored values. Every number of the cache is distinct.
+void testKvCacheSession(SmallModel* model, pos_t sourceSequence, pos_t targetSequence) {
+    Transformer* transformer = &model->transformer;
+    const char* path = "dllama-kv-session-test.0";
+    const pos_t nPositions = 5;
+    const int tokens[nPositions] = { 1, 20, 3, 40, 5 };
+    const unsigned int kvDim0 = transformer->blocks[0]->kvCacheSlice->kvDim0;
+    const unsigned int seqLen = model->spec.seqLen;
+    const unsigned int nNumbers = model->spec.nSequences * seqLen * kvDim0;
+
+    for (int l = 0; l < model->spec.nLayers; l++) {
+        TransformerBlock* block = transformer->blocks[l];
+        for (unsigned int i = 0; i < nNumbers; i++) {
+            ((float*)block->keyCache)[i] = (float)(l * nNumbers + i + 1);
+            ((float*)block->valueCache)[i] = -(float)(l * nNumbers + i + 1);
+        }
+    }
+
+    transformer->saveKvCache(path, sourceSequence, nPositions, tokens, nPositions);
+
+    int loadedTokens[seqLen];
+    pos_t nLoadedTokens;
+    pos_t nLoadedPositions = transformer->loadKvCache(path, targetSequence, loadedTokens, &nLoadedTokens);
+    remove(path);
+
+    bool isOk = nLoadedPositions == nPositions && nLoadedTokens == nPositions &&
+        memcmp(loadedTokens, tokens, sizeof(tokens)) == 0;
+    const unsigned int targetStart = targetSequence * seqLen * kvDim0;
+    for (int l = 0; l < model->spec.nLayers && isOk; l++) {
+        TransformerBlock* block = transformer->blocks[l];
+        for (unsigned int i = 0; i < nNumbers && isOk; i++) {
+            // The restored rows contain the numbers of the source rows, other rows are not changed
+            const unsigned int source = i >= targetStart && i < targetStart + nPositions * kvDim0
+                ? i - targetStart + sourceSequence * seqLen * kvDim0
+                : i;
+            isOk = ((float*)block->keyCache)[i] == (float)(l * nNumbers + source + 1) &&
+                ((float*)block->valueCache)[i] == -(float)(l * nNumbers + source + 1);
+        }
+    }
+    if (!isOk) {
+        printf("❌ KV cache session of the sequence %d is not restored to the sequence %d\n", sourceSequence, targetSequence);
+        exit(EXIT_FAILURE);
+    }
+    printf("✅ KV cache session of the sequence %d restored to the sequence %d\n", sourceSequence, targetSequence);
+}
+
 int main() {
+    initQuants();
+
     TransformerSpec spec;
     spec.headerSize = sizeof(TransformerFileOldHeader) + sizeof(int);
     spec.archType = LLAMA;
@@ -541,6 +766,10 @@ int main() {
     spec.vocabSize = 32000;
     spec.weightsFloatType = F32;
     spec.bufferFloatType = F32;
+    spec.kvCacheFloatType = F32;
+    spec.ropeCache = true;
+    spec.nBatches = 1;
+    spec.nSequences = 1;
     spec.nSlices = 1;
     spec.hiddenAct = SILU;
     spec.ropeTheta = 10000.0f;
@@ -564,43 +793,43 @@ int main() {
     SocketPool socketPool(0, NULL);
     AcceleratorContext acc(0, 1, NULL);
     Transformer transformer = Transformer::loadRoot((char*)data, &spec, &socketPool, &acc);
-    transformer.pos = 0;
+    transformer.positions[0] = 0;
 
     float* x = transformer.x;
     for (int i = 0; i < spec.dim; i++) x[i] = randomF32(&state) / 120.0;
+    float* input = new float[spec.dim];
+    memcpy(input, x, spec.dim * sizeof(float));
 
     TransformerArch arch = buildLlamaArch(&spec);
+    forward(&arch, &transformer, &socketPool, expectedOutput, "Block forwarded correctly");
 
-    int nThreads = 4;
-    TransformerContext context;
-    context.transformer = &transformer;
-    context.currentBlockIndex = 0;
-    context.socket = NULL;
-    context.socketPool = &socketPool;
-
-    int skipLastNTasks = 3;
-    TaskLoop loop(nThreads, arch.inference.nTasks - skipLastNTasks, TASK_N_TYPES, arch.inference.tasks, &context);
-    long t0 = timeMs();
-    loop.run();
-    long t1 = timeMs();
+    memcpy(x, input, spec.dim * sizeof(float));
+    fuseLlamaArch(&arch);
+    forward(&arch, &transformer, &socketPool, expectedOutput, "Fused block forwarded correctly");
 
+    delete[] input;
     freeBuffer(data);
 
-    int ix = -1;
-    for (int i = 0; i < spec.dim; i++) {
-        if (std::isnan(x[i]) || fabs(x[i] - expectedOutput[i]) > 0.00001) { // Optimization may cause some differences
-            ix = i;
-            break;
-        }
-    }
-    if (ix < 0) {
-        printf("✅ Block forwarded correctly in %ldms\n", t1 - t0);
-    } else {
-        printf("❌ ix=%d\n", ix);
-        printf("%.9g != %.9g\n", x[ix], expectedOutput[ix]); ix++;
-        printf("%.9g != %.9g\n", x[ix], expectedOutput[ix]); ix++;
-        printf("%.9g != %.9g\n", x[ix], expectedOutput[ix]); ix++;
-        printf("%.9g != %.9g\n", x[ix], expectedOutput[ix]); ix++;
-        exit(EXIT_FAILURE);
-    }
+    // The F32 cache is written directly by the matmuls, the F16 cache is written by `llamaStoreKv`.
+    const int tokens[4] = { 5, 60, 7, 33 };
+    const pos_t positions[4] = { 0, 1, 2, 3 };
+    const pos_t sequences[4] = { 0, 0, 0, 0 };
+    testBatch(F32, 1, false, tokens, positions, sequences, 4, 4, "Batch forwarded correctly");
+    testBatch(F32, 1, true, tokens, positions, sequences, 4, 4, "Fused batch forwarded correctly");
+    testBatch(F32, 1, false, tokens, positions, sequences, 3, 1, "Batch with one logits row forwarded correctly");
+    testBatch(F16, 1, false, tokens, positions, sequences, 4, 4, "Batch with F16 KV cache forwarded correctly");
+    testBatch(F16, 1, true, tokens, positions, sequences, 4, 2, "Fused batch with F16 KV cache forwarded correctly");
+
+    // Every token of two sequences must attend only the rows of its own sequence.
+    const pos_t positions2[4] = { 0, 0, 1, 1 };
+    const pos_t sequences2[4] = { 0, 1, 0, 1 };
+    const pos_t positions3[4] = { 0, 0, 1, 2 };
+    const pos_t sequences3[4] = { 0, 1, 1, 1 };
+    testBatch(F32, 2, false, tokens, positions2, sequences2, 4, 4, "Batch of two sequences forwarded correctly");
+    testBatch(F32, 2, true, tokens, positions2, sequences2, 4, 4, "Fused batch of two sequences forwarded correctly");
+    testBatch(F16, 2, true, tokens, positions3, sequences3, 4, 4, "Fused batch of two sequences with F16 KV cache forwarded correctly");
+
+    SmallModel model(F32, 2, false);
+    testKvCacheSession(&model, 1, 0);
+    testKvCacheSession(&model, 0, 1);
 }
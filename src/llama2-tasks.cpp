@@ -10,14 +10,18 @@
 void llamaRmsAtt(TASK_ARGS) {
     TASK_VARIABLES;
     if (threadIndex == 0) {
-        transformer->rms = rms(transformer->x, spec->dim);
+        for (unsigned int b = 0; b < transformer->batchSize; b++) {
+            transformer->rms[b] = rms(&transformer->x[b * spec->dim], spec->dim);
+        }
     }
 }
 
 void llamaRmsAttNorm(TASK_ARGS) {
     TASK_VARIABLES;
-    float* xb = (float*)transformer->buffer->getUnit(TB_UNIT_XB);
-    rmsnorm(xb, transformer->x, transformer->rms, block->rmsAtt, spec->dim, nThreads, threadIndex);
+    for (unsigned int b = 0; b < transformer->batchSize; b++) {
+        float* xb = (float*)transformer->buffer->getUnit(TB_UNIT_XB, b);
+        rmsnorm(xb, &transformer->x[b * spec->dim], transformer->rms[b], block->rmsAtt, spec->dim, nThreads, threadIndex);
+    }
 }
 
 void llamaQuantizeRmsAtt(TASK_ARGS) {
@@ -30,69 +34,201 @@ void llamaSyncRmsAtt(TASK_ARGS) {
     syncUnitBuffer(nThreads, threadIndex, ctx, TB_UNIT_XB_QUANTIZED);
 }
 
+// The row of the KV cache for the token `b` of the batch, every sequence has own `seqLen` rows.
+static inline unsigned int getKvCacheRow(Transformer* transformer, unsigned int b) {
+    return transformer->sequences[b] * transformer->spec->seqLen + transformer->positions[b];
+}
+
+// The matmuls may write the keys and the values directly to a F32 cache if the rows of the batch follow each other.
+static bool isKvCacheDirect(Transformer* transformer, TransformerBlock* block) {
+    if (block->kvCacheSlice->type != F32) return false;
+    const unsigned int row0 = getKvCacheRow(transformer, 0);
+    for (unsigned int b = 1; b < transformer->batchSize; b++) {
+        if (getKvCacheRow(transformer, b) != row0 + b) return false;
+    }
+    return true;
+}
+
 void llamaQkv(TASK_ARGS) {
     TASK_VARIABLES;
     assert(block->kvCacheSlice->kvDim0 == block->k0Slice->d0);
     assert(block->kvCacheSlice->kvDim0 == block->v0Slice->d0);
 
-    float *xbq = (float*)transformer->buffer->getUnit(TB_UNIT_XB_QUANTIZED);
-    float *k0 = &block->keyCache[transformer->pos * block->kvCacheSlice->kvDim0];
-    float* v0 = &block->valueCache[transformer->pos * block->kvCacheSlice->kvDim0];
+    const size_t xbqStride = transformer->buffer->getUnitBytes(TB_UNIT_XB_QUANTIZED);
+    const unsigned int kvDim0 = block->kvCacheSlice->kvDim0;
+    void* xbq = transformer->buffer->getUnit(TB_UNIT_XB_QUANTIZED);
+    float* k0;
+    float* v0;
+    if (isKvCacheDirect(transformer, block)) {
+        k0 = (float*)block->kvCacheSlice->at(block->keyCache, getKvCacheRow(transformer, 0), 0);
+        v0 = (float*)block->kvCacheSlice->at(block->valueCache, getKvCacheRow(transformer, 0), 0);
+    } else {
+        k0 = block->k0;
+        v0 = block->v0;
+    }
 
-    block->q0mm->forward(xbq, block->qo0, nThreads, threadIndex);
-    block->k0mm->forward(xbq, k0, nThreads, threadIndex);
-    block->v0mm->forward(xbq, v0, nThreads, threadIndex);
+    block->q0mm->forwardBatch(xbq, xbqStride, block->qo0, block->q0Slice->d0, transformer->batchSize, nThreads, threadIndex);
+    block->k0mm->forwardBatch(xbq, xbqStride, k0, kvDim0, transformer->batchSize, nThreads, threadIndex);
+    block->v0mm->forwardBatch(xbq, xbqStride, v0, kvDim0, transformer->batchSize, nThreads, threadIndex);
 }
 
 void llamaRope(TASK_ARGS) {
     TASK_VARIABLES;
-    float* k0 = &block->keyCache[transformer->pos * block->kvCacheSlice->kvDim0];
-    transformer->rope->forward(true, block->qo0, transformer->pos, nThreads, threadIndex);
-    transformer->rope->forward(false, k0, transformer->pos, nThreads, threadIndex);
+    const unsigned int kvDim0 = block->kvCacheSlice->kvDim0;
+    float* k0 = isKvCacheDirect(transformer, block)
+        ? (float*)block->kvCacheSlice->at(block->keyCache, getKvCacheRow(transformer, 0), 0)
+        : block->k0;
+    for (unsigned int b = 0; b < transformer->batchSize; b++) {
+        const pos_t pos = transformer->positions[b];
+        transformer->rope->forward(true, &block->qo0[b * block->q0Slice->d0], pos, nThreads, threadIndex);
+        transformer->rope->forward(false, &k0[b * kvDim0], pos, nThreads, threadIndex);
+    }
+}
+
+void llamaStoreKv(TASK_ARGS) {
+    TASK_VARIABLES;
+    KvCacheSlice* slice = block->kvCacheSlice;
+    if (isKvCacheDirect(transformer, block)) return;
+    for (unsigned int b = 0; b < transformer->batchSize; b++) {
+        const unsigned int row = getKvCacheRow(transformer, b);
+        void* k = slice->at(block->keyCache, row, 0);
+        void* v = slice->at(block->valueCache, row, 0);
+        const float* k0 = &block->k0[b * slice->kvDim0];
+        const float* v0 = &block->v0[b * slice->kvDim0];
+        if (slice->type == Q80) {
+            quantizeQ80Row((float*)k0, (BlockQ80*)k, slice->kvDim0, nThreads, threadIndex);
+            quantizeQ80Row((float*)v0, (BlockQ80*)v, slice->kvDim0, nThreads, threadIndex);
+        } else {
+            SPLIT_RANGE_TO_THREADS(start, end, 0, slice->kvDim0, nThreads, threadIndex);
+            if (slice->type == F16) {
+                for (unsigned int i = start; i < end; i++) {
+                    ((uint16_t*)k)[i] = convertF32ToF16(k0[i]);
+                    ((uint16_t*)v)[i] = convertF32ToF16(v0[i]);
+                }
+            } else {
+                memcpy(&((float*)k)[start], &k0[start], (end - start) * sizeof(float));
+                memcpy(&((float*)v)[start], &v0[start], (end - start) * sizeof(float));
+            }
+        }
+    }
+}
+
+static unsigned int getMultiheadAttSplits(TransformerSpec* spec, TransformerBlock* block, Transformer* transformer, unsigned int nThreads) {
+    // A batch has enough independent work, every token attends all its positions on one thread.
+    if (transformer->batchSize > 1) return 1;
+    const unsigned int kvMul = spec->nHeads / spec->nKvHeads;
+    return block->multiHeadAttSlice->getNSplits(block->multiHeadAttSlice->nHeads0 / kvMul, transformer->positions[0] + 1, nThreads);
 }
 
 void llamaMultiheadAtt(TASK_ARGS) {
     TASK_VARIABLES;
-    SPLIT_RANGE_TO_THREADS(h0Start, h0End, 0, block->multiHeadAttSlice->nHeads0, nThreads, threadIndex);
+    MultiHeadAttSlice* slice = block->multiHeadAttSlice;
+    KvCacheSlice* kvSlice = block->kvCacheSlice;
+    const unsigned int kvMul = spec->nHeads / spec->nKvHeads; // integer multiplier of the kv sharing in multiquery
+
+    // If there are more threads than kv heads, the threads are divided into groups, each group computes
+    // all heads for a part of the positions. The parts are merged by llamaMergeMultiheadAtt.
+    const unsigned int nSplits = getMultiheadAttSplits(spec, block, transformer, nThreads);
+    if (nSplits == 1) {
+        // The heads of all tokens of the batch are divided between the threads. Every token attends only the positions
+        // of its own sequence up to its own position (causal mask).
+        const unsigned int nHeads0 = slice->nHeads0;
+        SPLIT_RANGE_TO_THREADS(iStart, iEnd, 0, transformer->batchSize * nHeads0, nThreads, threadIndex);
+        unsigned int i = iStart;
+        while (i < iEnd) {
+            const unsigned int b = i / nHeads0;
+            const unsigned int h0 = i % nHeads0;
+            const unsigned int kvHead0 = h0 / kvMul;
+            unsigned int groupEnd = (kvHead0 + 1) * kvMul;
+            if (groupEnd > nHeads0) groupEnd = nHeads0;
+            if (b * nHeads0 + groupEnd > iEnd) groupEnd = iEnd - b * nHeads0;
+            const unsigned int kvOffset = kvHead0 * spec->headSize;
+            const unsigned int row0 = transformer->sequences[b] * spec->seqLen;
+            float* xb = (float*)transformer->buffer->getSliced(TB_UNIT_XB, transformer->sliceIndex, b);
+            const float* q = &block->qo0[b * block->q0Slice->d0];
+            attention(kvSlice->type, &xb[h0 * spec->headSize], &q[h0 * spec->headSize],
+                kvSlice->at(block->keyCache, row0, kvOffset), kvSlice->at(block->valueCache, row0, kvOffset),
+                kvSlice->kvDim0, spec->headSize, groupEnd - h0, transformer->positions[b] + 1);
+            i = b * nHeads0 + groupEnd;
+        }
+        return;
+    }
+
+    const unsigned int nPositions = transformer->positions[0] + 1;
+    const unsigned int row0 = transformer->sequences[0] * spec->seqLen;
+    const unsigned int nSplitThreads = nThreads / nSplits;
+    const unsigned int splitIndex = threadIndex / nSplitThreads;
+    if (splitIndex >= nSplits) return;
+    const unsigned int tStart = nPositions * splitIndex / nSplits;
+    const unsigned int tEnd = nPositions * (splitIndex + 1) / nSplits;
+    SPLIT_RANGE_TO_THREADS(h0Start, h0End, 0, slice->nHeads0, nSplitThreads, threadIndex % nSplitThreads);
 
     float* xb = (float*)transformer->buffer->getSliced(TB_UNIT_XB, transformer->sliceIndex);
+    float* output = splitIndex == 0 ? xb : &block->attPartials[(splitIndex - 1) * slice->nHeads0 * spec->headSize];
+    float* maxScores = &block->attPartials[(MAX_ATTENTION_SPLITS - 1) * slice->nHeads0 * spec->headSize + splitIndex * slice->nHeads0 * 2];
+    float* sums = &maxScores[slice->nHeads0];
+
+    // Consecutive query heads sharing a kv head are processed together, the kv head is read once per group
+    unsigned int h0 = h0Start;
+    while (h0 < h0End) {
+        const unsigned int kvHead0 = h0 / kvMul;
+        const unsigned int groupEnd = (kvHead0 + 1) * kvMul < h0End ? (kvHead0 + 1) * kvMul : h0End;
+        const unsigned int kvOffset = kvHead0 * spec->headSize;
+        const void* keys = kvSlice->at(block->keyCache, row0 + tStart, kvOffset);
+        const void* values = kvSlice->at(block->valueCache, row0 + tStart, kvOffset);
+        attentionPartial(kvSlice->type, &output[h0 * spec->headSize], &maxScores[h0], &sums[h0], &block->qo0[h0 * spec->headSize],
+            keys, values, kvSlice->kvDim0, spec->headSize, groupEnd - h0, tEnd - tStart);
+        h0 = groupEnd;
+    }
+}
 
-    int kvMul = spec->nHeads / spec->nKvHeads; // integer multiplier of the kv sharing in multiquery
-
-    for (int h0 = h0Start; h0 < h0End; h0++) {
-        // get the query vector for this head
-        float* _q = block->qo0 + h0 * spec->headSize;
-        // attention scores for this head
-        float* _att = block->att + h0 * spec->seqLen;
-        // iterate over all timesteps, including the current one
-        for (int t = 0; t <= transformer->pos; t++) {
-            // get the key vector for this head and at this timestep
-            float* k = block->keyCache + t * block->kvCacheSlice->kvDim0 + (h0 / kvMul) * spec->headSize;
-            // calculate the attention score as the dot product of q and k
-            float score = dotProduct(_q, k, spec->headSize) / sqrtf(spec->headSize);
-            _att[t] = score;
+// Merges the numbers start..end-1 of the parts computed by llamaMultiheadAtt: every part is rescaled to the
+// largest maximum score of the head and the sum is normalized by all sums (log-sum-exp).
+static void mergeMultiheadAtt(TransformerSpec* spec, TransformerBlock* block, unsigned int nSplits, float* xb, unsigned int start, unsigned int end) {
+    const unsigned int nHeads0 = block->multiHeadAttSlice->nHeads0;
+    const unsigned int headSize = spec->headSize;
+    const float* partials = block->attPartials;
+    const float* stats = &partials[(MAX_ATTENTION_SPLITS - 1) * nHeads0 * headSize];
+    float weights[MAX_ATTENTION_SPLITS];
+
+    unsigned int i = start;
+    while (i < end) {
+        const unsigned int h = i / headSize;
+        const unsigned int headEnd = (h + 1) * headSize < end ? (h + 1) * headSize : end;
+
+        float maxScore = -INFINITY;
+        for (unsigned int s = 0; s < nSplits; s++) {
+            if (stats[s * nHeads0 * 2 + h] > maxScore) maxScore = stats[s * nHeads0 * 2 + h];
+        }
+        float sum = 0.0f;
+        for (unsigned int s = 0; s < nSplits; s++) {
+            weights[s] = expf(stats[s * nHeads0 * 2 + h] - maxScore);
+            sum += weights[s] * stats[s * nHeads0 * 2 + nHeads0 + h];
+        }
+        for (unsigned int s = 0; s < nSplits; s++) {
+            weights[s] /= sum;
         }
 
-        // softmax the scores to get attention weights, from 0..pos inclusively
-        softmax(_att, transformer->pos + 1);
-
-        // weighted sum of the values, store back into xb
-        float* hxb = xb + h0 * spec->headSize;
-        memset(hxb, 0, spec->headSize * sizeof(float));
-        for (int t = 0; t <= transformer->pos; t++) {
-            // get the value vector for this head and at this timestep
-            float* _v = block->valueCache + t * block->kvCacheSlice->kvDim0 + (h0 / kvMul) * spec->headSize;
-            // get the attention weight for this timestep
-            float a = _att[t];
-
-            // accumulate the weighted value into xb
-            for (int i = 0; i < spec->headSize; i++) {
-                hxb[i] += a * _v[i];
+        for (; i < headEnd; i++) {
+            float v = xb[i] * weights[0];
+            for (unsigned int s = 1; s < nSplits; s++) {
+                v += partials[(s - 1) * nHeads0 * headSize + i] * weights[s];
             }
+            xb[i] = v;
         }
     }
 }
 
+void llamaMergeMultiheadAtt(TASK_ARGS) {
+    TASK_VARIABLES;
+    const unsigned int nSplits = getMultiheadAttSplits(spec, block, transformer, nThreads);
+    if (nSplits == 1) return;
+
+    float* xb = (float*)transformer->buffer->getSliced(TB_UNIT_XB, transformer->sliceIndex);
+    SPLIT_RANGE_TO_THREADS(start, end, 0, block->multiHeadAttSlice->nHeads0 * spec->headSize, nThreads, threadIndex);
+    mergeMultiheadAtt(spec, block, nSplits, xb, start, end);
+}
+
 void llamaQuantizeMultiheadAtt(TASK_ARGS) {
     TASK_VARIABLES;
     quantizeSlicedBuffer(nThreads, threadIndex, ctx, true, TB_UNIT_XB, TB_UNIT_XB_QUANTIZED);
@@ -104,7 +240,8 @@ void llamaAtt(TASK_ARGS) {
     void* xbq0 = transformer->buffer->getSliced(TB_UNIT_XB_QUANTIZED, transformer->sliceIndex);
     float* xbv0 = (float*)transformer->buffer->getSliced(TB_SLICED_XBV, transformer->sliceIndex);
 
-    block->wo0mm->forward(xbq0, xbv0, nThreads, threadIndex);
+    block->wo0mm->forwardBatch(xbq0, transformer->buffer->getUnitBytes(TB_UNIT_XB_QUANTIZED),
+        xbv0, spec->dim, transformer->batchSize, nThreads, threadIndex);
 }
 
 void llamaQuantizeAtt(TASK_ARGS) {
@@ -124,25 +261,31 @@ void llamaDequantizeAtt(TASK_ARGS) {
 
 void llamaMergeAtt(TASK_ARGS) {
     TASK_VARIABLES;
-    for (slice_index_t sliceIndex = 0; sliceIndex < spec->nSlices; sliceIndex++) {
-        float* xbv = (float*)transformer->buffer->getSliced(TB_SLICED_XBV, sliceIndex);
-        add(transformer->x, xbv, spec->dim, nThreads, threadIndex);
+    for (unsigned int b = 0; b < transformer->batchSize; b++) {
+        for (slice_index_t sliceIndex = 0; sliceIndex < spec->nSlices; sliceIndex++) {
+            float* xbv = (float*)transformer->buffer->getSliced(TB_SLICED_XBV, sliceIndex, b);
+            add(&transformer->x[b * spec->dim], xbv, spec->dim, nThreads, threadIndex);
+        }
     }
 }
 
 void llamaRmfFfn(TASK_ARGS) {
     TASK_VARIABLES;
     if (threadIndex == 0) {
-        transformer->rms = rms(transformer->x, spec->dim);
+        for (unsigned int b = 0; b < transformer->batchSize; b++) {
+            transformer->rms[b] = rms(&transformer->x[b * spec->dim], spec->dim);
+        }
     }
 }
 
 void llamaRmfFfnNorm(TASK_ARGS) {
     TASK_VARIABLES;
-    float* xb = (float*)transformer->buffer->getUnit(TB_UNIT_XB);
-    float* x = (float*)transformer->x;
+    for (unsigned int b = 0; b < transformer->batchSize; b++) {
+        float* xb = (float*)transformer->buffer->getUnit(TB_UNIT_XB, b);
+        float* x = &transformer->x[b * spec->dim];
 
-    rmsnorm(xb, x, transformer->rms, block->rmsFfn, spec->dim, nThreads, threadIndex);
+        rmsnorm(xb, x, transformer->rms[b], block->rmsFfn, spec->dim, nThreads, threadIndex);
+    }
 }
 
 void llamaQuantizeRmfFfn(TASK_ARGS) {
@@ -158,20 +301,27 @@ void llamaSyncFfn(TASK_ARGS) {
 void llamaFfn0(TASK_ARGS) {
     TASK_VARIABLES;
 
-    float* xb = (float*)transformer->buffer->getUnit(TB_UNIT_XB_QUANTIZED);
+    void* xb = transformer->buffer->getUnit(TB_UNIT_XB_QUANTIZED);
+    const size_t xbStride = transformer->buffer->getUnitBytes(TB_UNIT_XB_QUANTIZED);
     float* hb0 = (float*)transformer->buffer->getSliced(TB_SLICED_HB, transformer->sliceIndex);
-
-    block->w10mm->forward(xb, hb0, nThreads, threadIndex);
-    block->w30mm->forward(xb, block->hb20, nThreads, threadIndex);
-
-    if (spec->hiddenAct == SILU) {
-        silu(hb0, block->w10Slice->d0, nThreads, threadIndex);
-    } else if (spec->hiddenDim == GELU) {
-        gelu(hb0, block->w10Slice->d0, nThreads, threadIndex);
-    } else {
-        assert(false);
+    const unsigned int d0 = block->w10Slice->d0;
+
+    block->w10mm->forwardBatch(xb, xbStride, hb0, d0, transformer->batchSize, nThreads, threadIndex);
+    block->w30mm->forwardBatch(xb, xbStride, block->hb20, d0, transformer->batchSize, nThreads, threadIndex);
+
+    // There is no barrier after the matmuls, so the activation is applied row by row to the same range of
+    // numbers as the thread has computed.
+    for (unsigned int b = 0; b < transformer->batchSize; b++) {
+        float* hb = &hb0[b * d0];
+        if (spec->hiddenAct == SILU) {
+            silu(hb, d0, nThreads, threadIndex);
+        } else if (spec->hiddenDim == GELU) {
+            gelu(hb, d0, nThreads, threadIndex);
+        } else {
+            assert(false);
+        }
+        mul(hb, &block->hb20[b * d0], d0, nThreads, threadIndex);
     }
-    mul(hb0, block->hb20, block->w10Slice->d0, nThreads, threadIndex);
 }
 
 void llamaFfn1(TASK_ARGS) {
@@ -182,10 +332,11 @@ void llamaFfn1(TASK_ARGS) {
 void llamaFfn2(TASK_ARGS) {
     TASK_VARIABLES;
 
-    float *hb = (float*)transformer->buffer->getSliced(TB_SLICED_HB_QUANTIZED, transformer->sliceIndex);
-    float *xbv = (float*)transformer->buffer->getSliced(TB_SLICED_XBV, transformer->sliceIndex);
+    void* hb = transformer->buffer->getSliced(TB_SLICED_HB_QUANTIZED, transformer->sliceIndex);
+    float* xbv = (float*)transformer->buffer->getSliced(TB_SLICED_XBV, transformer->sliceIndex);
 
-    block->w20mm->forward(hb, xbv, nThreads, threadIndex);
+    block->w20mm->forwardBatch(hb, transformer->buffer->getSlicedBytes(TB_SLICED_HB_QUANTIZED),
+        xbv, spec->dim, transformer->batchSize, nThreads, threadIndex);
 }
 
 void llamaQuantizeFfn2(TASK_ARGS) {
@@ -205,9 +356,11 @@ void llamaDequantizeFfn2(TASK_ARGS) {
 
 void llamaMergeFfn2(TASK_ARGS) {
     TASK_VARIABLES;
-    for (slice_index_t sliceIndex = 0; sliceIndex < spec->nSlices; sliceIndex++) {
-        float* xbv = (float*)transformer->buffer->getSliced(TB_SLICED_XBV, sliceIndex);
-        add(transformer->x, xbv, spec->dim, nThreads, threadIndex);
+    for (unsigned int b = 0; b < transformer->batchSize; b++) {
+        for (slice_index_t sliceIndex = 0; sliceIndex < spec->nSlices; sliceIndex++) {
+            float* xbv = (float*)transformer->buffer->getSliced(TB_SLICED_XBV, sliceIndex, b);
+            add(&transformer->x[b * spec->dim], xbv, spec->dim, nThreads, threadIndex);
+        }
     }
 }
 
@@ -219,23 +372,100 @@ void llamaNextBlock(TASK_ARGS) {
     }
 }
 
+// The logits are needed only for the last `nLogits` tokens of the batch.
+static unsigned int getFirstLogitsRow(Transformer* transformer) {
+    return transformer->batchSize - transformer->nLogits;
+}
+
 void llamaRmsFinal(TASK_ARGS) {
     TASK_VARIABLES;
     if (threadIndex == 0) {
-        float* x = transformer->x;
-        transformer->rms = rms(x, spec->dim);
+        for (unsigned int b = getFirstLogitsRow(transformer); b < transformer->batchSize; b++) {
+            transformer->rms[b] = rms(&transformer->x[b * spec->dim], spec->dim);
+        }
     }
 }
 
 void llamaRmsFinalNorm(TASK_ARGS) {
     TASK_VARIABLES;
-    float* x = transformer->x;
-    rmsnorm(x, x, transformer->rms, (float*)transformer->rmsFinal, spec->dim, nThreads, threadIndex);
+    for (unsigned int b = getFirstLogitsRow(transformer); b < transformer->batchSize; b++) {
+        float* x = &transformer->x[b * spec->dim];
+        rmsnorm(x, x, transformer->rms[b], (float*)transformer->rmsFinal, spec->dim, nThreads, threadIndex);
+    }
 }
 
 void llamaFinalize(TASK_ARGS) {
     TASK_VARIABLES;
-    transformer->wclsMm->forward(transformer->x, transformer->logits, nThreads, threadIndex);
+    float* x = &transformer->x[getFirstLogitsRow(transformer) * spec->dim];
+    transformer->wclsMm->forwardBatch(x, spec->dim * sizeof(float), transformer->logits, spec->vocabSize,
+        transformer->nLogits, nThreads, threadIndex);
+}
+
+void llamaFusedRmsAtt(TASK_ARGS) {
+    TASK_VARIABLES;
+    rmsnormUnitBuffer(nThreads, threadIndex, ctx, transformer->x, block->rmsAtt, TB_UNIT_XB, true, TB_UNIT_XB_QUANTIZED);
+}
+
+void llamaFusedMergeAtt(TASK_ARGS) {
+    TASK_VARIABLES;
+    dequantizeAndMergeSlicedBuffer(nThreads, threadIndex, ctx, TB_SLICED_XBV_QUANTIZED, TB_SLICED_XBV, transformer->x);
+}
+
+void llamaFusedRmfFfn(TASK_ARGS) {
+    TASK_VARIABLES;
+    rmsnormUnitBuffer(nThreads, threadIndex, ctx, transformer->x, block->rmsFfn, TB_UNIT_XB, true, TB_UNIT_XB_QUANTIZED);
+}
+
+void llamaFusedRmfFfnNorm(TASK_ARGS) {
+    TASK_VARIABLES;
+    rmsnormUnitBuffer(nThreads, threadIndex, ctx, transformer->x, block->rmsFfn, TB_UNIT_XB, false, 0);
+}
+
+void llamaFusedMergeFfn2(TASK_ARGS) {
+    TASK_VARIABLES;
+    dequantizeAndMergeSlicedBuffer(nThreads, threadIndex, ctx, TB_SLICED_XBV_QUANTIZED, TB_SLICED_XBV, transformer->x);
+}
+
+void llamaFusedMergeMultiheadAtt(TASK_ARGS) {
+    TASK_VARIABLES;
+    const unsigned int nSplits = getMultiheadAttSplits(spec, block, transformer, nThreads);
+    const unsigned int dim0 = block->multiHeadAttSlice->nHeads0 * spec->headSize;
+    assert(dim0 % QK80 == 0);
+
+    // The range of a thread is aligned to the quantization blocks, so the thread may quantize its own output.
+    SPLIT_RANGE_TO_THREADS(blockStart, blockEnd, 0, dim0 / QK80, nThreads, threadIndex);
+    const unsigned int start = blockStart * QK80;
+    const unsigned int n = (blockEnd - blockStart) * QK80;
+
+    for (unsigned int b = 0; b < transformer->batchSize; b++) {
+        float* xb = (float*)transformer->buffer->getSliced(TB_UNIT_XB, transformer->sliceIndex, b);
+        if (nSplits > 1) {
+            mergeMultiheadAtt(spec, block, nSplits, xb, start, start + n);
+        }
+        if (spec->bufferFloatType == Q80) {
+            BlockQ80* xbq = (BlockQ80*)transformer->buffer->getSliced(TB_UNIT_XB_QUANTIZED, transformer->sliceIndex, b);
+            quantizeQ80Row(&xb[start], &xbq[blockStart], n, 1, 0);
+        }
+    }
+}
+
+void fuseLlamaArch(TransformerArch* a) {
+    // The root never quantizes its own slice of a sliced buffer, so these quantizations are no-ops on the root.
+    // `llamaNextBlock` is never fused, other threads of the same task would see the index of the next block.
+    const TaskFusion inference[] = {
+        { 3, { llamaRmsAtt, llamaRmsAttNorm, llamaQuantizeRmsAtt }, TASK(llamaFusedRmsAtt) },
+        { 2, { llamaMergeMultiheadAtt, llamaQuantizeMultiheadAtt }, TASK(llamaFusedMergeMultiheadAtt) },
+        { 2, { llamaAtt, llamaQuantizeAtt }, TASK(llamaAtt) },
+        { 2, { llamaDequantizeAtt, llamaMergeAtt }, TASK(llamaFusedMergeAtt) },
+        { 3, { llamaRmfFfn, llamaRmfFfnNorm, llamaQuantizeRmfFfn }, TASK(llamaFusedRmfFfn) },
+        { 2, { llamaFfn2, llamaQuantizeFfn2 }, TASK(llamaFfn2) },
+        { 2, { llamaDequantizeFfn2, llamaMergeFfn2 }, TASK(llamaFusedMergeFfn2) },
+    };
+    const TaskFusion worker[] = {
+        { 2, { llamaMergeMultiheadAtt, llamaQuantizeMultiheadAtt }, TASK(llamaFusedMergeMultiheadAtt) },
+    };
+    a->fuseI(sizeof(inference) / sizeof(TaskFusion), inference);
+    a->fuseW(sizeof(worker) / sizeof(TaskFusion), worker);
 }
 
 TransformerArch buildLlamaArch(TransformerSpec* spec) {
@@ -243,56 +473,62 @@ TransformerArch buildLlamaArch(TransformerSpec* spec) {
 
     // inference
 
-    a.I(sendPos, TASK_TYPE_TRANSFER);
+    // Transfers run on the I/O thread. Reads of the workers' slices are started before the root computes
+    // its own slice, the first task which needs the transferred data joins them.
+    a.I(TASK(sendPos), TASK_TYPE_TRANSFER, TASK_FLAG_ASYNC);
     for (int i = 0; i < spec->nLayers; i++) {
-        a.I(llamaRmsAtt, TASK_TYPE_INFERENCE);
-        a.I(llamaRmsAttNorm, TASK_TYPE_INFERENCE);
-        a.I(llamaQuantizeRmsAtt, TASK_TYPE_INFERENCE);
-        a.I(llamaSyncRmsAtt, TASK_TYPE_TRANSFER);
-        a.I(llamaQkv, TASK_TYPE_INFERENCE);
-        a.I(llamaRope, TASK_TYPE_INFERENCE);
-        a.I(llamaMultiheadAtt, TASK_TYPE_INFERENCE);
-        a.I(llamaQuantizeMultiheadAtt, TASK_TYPE_INFERENCE);
-        a.I(llamaAtt, TASK_TYPE_INFERENCE);
-        a.I(llamaQuantizeAtt, TASK_TYPE_INFERENCE);
-        a.I(llamaSyncAtt, TASK_TYPE_TRANSFER);
-        a.I(llamaDequantizeAtt, TASK_TYPE_INFERENCE);
-        a.I(llamaMergeAtt, TASK_TYPE_INFERENCE);
-        a.I(llamaRmfFfn, TASK_TYPE_INFERENCE);
-        a.I(llamaRmfFfnNorm, TASK_TYPE_INFERENCE);
-        a.I(llamaQuantizeRmfFfn, TASK_TYPE_INFERENCE);
-        a.I(llamaSyncFfn, TASK_TYPE_TRANSFER);
-        a.I(llamaFfn0, TASK_TYPE_INFERENCE);
-        a.I(llamaFfn1, TASK_TYPE_INFERENCE);
-        a.I(llamaFfn2, TASK_TYPE_INFERENCE);
-        a.I(llamaQuantizeFfn2, TASK_TYPE_INFERENCE);
-        a.I(llamaSyncFfn2, TASK_TYPE_TRANSFER);
-        a.I(llamaDequantizeFfn2, TASK_TYPE_INFERENCE);
-        a.I(llamaMergeFfn2, TASK_TYPE_INFERENCE);
-        a.I(llamaNextBlock, TASK_TYPE_INFERENCE);
+        a.I(TASK(llamaRmsAtt), TASK_TYPE_INFERENCE);
+        a.I(TASK(llamaRmsAttNorm), TASK_TYPE_INFERENCE);
+        a.I(TASK(llamaQuantizeRmsAtt), TASK_TYPE_INFERENCE);
+        a.I(TASK(llamaSyncRmsAtt), TASK_TYPE_TRANSFER, TASK_FLAG_ASYNC);
+        a.I(TASK(llamaQkv), TASK_TYPE_INFERENCE);
+        a.I(TASK(llamaRope), TASK_TYPE_INFERENCE);
+        if (isKvCacheStaged(spec)) a.I(TASK(llamaStoreKv), TASK_TYPE_INFERENCE);
+        a.I(TASK(llamaMultiheadAtt), TASK_TYPE_INFERENCE, TASK_FLAG_JOIN);
+        a.I(TASK(llamaMergeMultiheadAtt), TASK_TYPE_INFERENCE);
+        a.I(TASK(llamaQuantizeMultiheadAtt), TASK_TYPE_INFERENCE);
+        a.I(TASK(llamaSyncAtt), TASK_TYPE_TRANSFER, TASK_FLAG_ASYNC);
+        a.I(TASK(llamaAtt), TASK_TYPE_INFERENCE);
+        a.I(TASK(llamaQuantizeAtt), TASK_TYPE_INFERENCE);
+        a.I(TASK(llamaDequantizeAtt), TASK_TYPE_INFERENCE, TASK_FLAG_JOIN);
+        a.I(TASK(llamaMergeAtt), TASK_TYPE_INFERENCE);
+        a.I(TASK(llamaRmfFfn), TASK_TYPE_INFERENCE);
+        a.I(TASK(llamaRmfFfnNorm), TASK_TYPE_INFERENCE);
+        a.I(TASK(llamaQuantizeRmfFfn), TASK_TYPE_INFERENCE);
+        a.I(TASK(llamaSyncFfn), TASK_TYPE_TRANSFER, TASK_FLAG_ASYNC);
+        a.I(TASK(llamaSyncFfn2), TASK_TYPE_TRANSFER, TASK_FLAG_ASYNC);
+        a.I(TASK(llamaFfn0), TASK_TYPE_INFERENCE);
+        a.I(TASK(llamaFfn1), TASK_TYPE_INFERENCE);
+        a.I(TASK(llamaFfn2), TASK_TYPE_INFERENCE);
+        a.I(TASK(llamaQuantizeFfn2), TASK_TYPE_INFERENCE);
+        a.I(TASK(llamaDequantizeFfn2), TASK_TYPE_INFERENCE, TASK_FLAG_JOIN);
+        a.I(TASK(llamaMergeFfn2), TASK_TYPE_INFERENCE);
+        a.I(TASK(llamaNextBlock), TASK_TYPE_INFERENCE);
     }
-    a.I(llamaRmsFinal, TASK_TYPE_INFERENCE);
-    a.I(llamaRmsFinalNorm, TASK_TYPE_INFERENCE);
-    a.I(llamaFinalize, TASK_TYPE_INFERENCE);
+    a.I(TASK(llamaRmsFinal), TASK_TYPE_INFERENCE);
+    a.I(TASK(llamaRmsFinalNorm), TASK_TYPE_INFERENCE);
+    a.I(TASK(llamaFinalize), TASK_TYPE_INFERENCE);
 
     // worker
 
     for (int i = 0; i < spec->nLayers; i++) {
-        a.W(llamaSyncRmsAtt, TASK_TYPE_TRANSFER);
-        a.W(llamaQkv, TASK_TYPE_INFERENCE);
-        a.W(llamaRope, TASK_TYPE_INFERENCE);
-        a.W(llamaMultiheadAtt, TASK_TYPE_INFERENCE);
-        a.W(llamaQuantizeMultiheadAtt, TASK_TYPE_INFERENCE);
-        a.W(llamaAtt, TASK_TYPE_INFERENCE);
-        a.W(llamaQuantizeAtt, TASK_TYPE_INFERENCE);
-        a.W(llamaSyncAtt, TASK_TYPE_TRANSFER);
-        a.W(llamaSyncFfn, TASK_TYPE_TRANSFER);
-        a.W(llamaFfn0, TASK_TYPE_INFERENCE);
-        a.W(llamaFfn1, TASK_TYPE_INFERENCE);
-        a.W(llamaFfn2, TASK_TYPE_INFERENCE);
-        a.W(llamaQuantizeFfn2, TASK_TYPE_INFERENCE);
-        a.W(llamaSyncFfn2, TASK_TYPE_TRANSFER);
-        a.W(llamaNextBlock, TASK_TYPE_INFERENCE);
+        a.W(TASK(llamaSyncRmsAtt), TASK_TYPE_TRANSFER);
+        a.W(TASK(llamaQkv), TASK_TYPE_INFERENCE);
+        a.W(TASK(llamaRope), TASK_TYPE_INFERENCE);
+        if (isKvCacheStaged(spec)) a.W(TASK(llamaStoreKv), TASK_TYPE_INFERENCE);
+        a.W(TASK(llamaMultiheadAtt), TASK_TYPE_INFERENCE);
+        a.W(TASK(llamaMergeMultiheadAtt), TASK_TYPE_INFERENCE);
+        a.W(TASK(llamaQuantizeMultiheadAtt), TASK_TYPE_INFERENCE);
+        a.W(TASK(llamaAtt), TASK_TYPE_INFERENCE);
+        a.W(TASK(llamaQuantizeAtt), TASK_TYPE_INFERENCE);
+        a.W(TASK(llamaSyncAtt), TASK_TYPE_TRANSFER);
+        a.W(TASK(llamaSyncFfn), TASK_TYPE_TRANSFER);
+        a.W(TASK(llamaFfn0), TASK_TYPE_INFERENCE);
+        a.W(TASK(llamaFfn1), TASK_TYPE_INFERENCE);
+        a.W(TASK(llamaFfn2), TASK_TYPE_INFERENCE);
+        a.W(TASK(llamaQuantizeFfn2), TASK_TYPE_INFERENCE);
+        a.W(TASK(llamaSyncFfn2), TASK_TYPE_TRANSFER);
+        a.W(TASK(llamaNextBlock), TASK_TYPE_INFERENCE);
     }
     return a;
 }
@@ -9,7 +9,9 @@ void llamaQuantizeRmsAtt(TASK_ARGS);
 void llamaSyncRmsAtt(TASK_ARGS);
 void llamaQkv(TASK_ARGS);
 void llamaRope(TASK_ARGS);
+void llamaStoreKv(TASK_ARGS);
 void llamaMultiheadAtt(TASK_ARGS);
+void llamaMergeMultiheadAtt(TASK_ARGS);
 void llamaQuantizeMultiheadAtt(TASK_ARGS);
 void llamaAtt(TASK_ARGS);
 void llamaQuantizeAtt(TASK_ARGS);
@@ -18,11 +20,25 @@ void llamaDequantizeAtt(TASK_ARGS);
 void llamaMergeAtt(TASK_ARGS);
 void llamaRmfFfn(TASK_ARGS);
 void llamaRmfFfnNorm(TASK_ARGS);
+void llamaQuantizeRmfFfn(TASK_ARGS);
+void llamaSyncFfn(TASK_ARGS);
+void llamaFfn0(TASK_ARGS);
+void llamaFfn1(TASK_ARGS);
+void llamaFfn2(TASK_ARGS);
+void llamaQuantizeFfn2(TASK_ARGS);
+void llamaSyncFfn2(TASK_ARGS);
+void llamaDequantizeFfn2(TASK_ARGS);
+void llamaMergeFfn2(TASK_ARGS);
 void llamaNextBlock(TASK_ARGS);
 void llamaRmsFinal(TASK_ARGS);
 void llamaRmsFinalNorm(TASK_ARGS);
 void llamaFinalize(TASK_ARGS);
+void llamaFusedRmsAtt(TASK_ARGS);
+void llamaFusedMergeMultiheadAtt(TASK_ARGS);
+void llamaFusedMergeAtt(TASK_ARGS);
+void llamaFusedRmfFfnNorm(TASK_ARGS);
 
 TransformerArch buildLlamaArch(TransformerSpec* spec);
+void fuseLlamaArch(TransformerArch* a);
 
 #endif
\ No newline at end of file
@@ -2,76 +2,102 @@
 #include "grok1-tasks.hpp"
 #include "mixtral-tasks.hpp"
 
+void fuseMixtralArch(TransformerArch* a) {
+    // Quantizations of the root slice are no-ops on the root, see fuseLlamaArch().
+    const TaskFusion inference[] = {
+        { 3, { llamaRmsAtt, llamaRmsAttNorm, llamaQuantizeRmsAtt }, TASK(llamaFusedRmsAtt) },
+        { 2, { llamaMergeMultiheadAtt, llamaQuantizeMultiheadAtt }, TASK(llamaFusedMergeMultiheadAtt) },
+        { 2, { llamaAtt, llamaQuantizeAtt }, TASK(llamaAtt) },
+        { 2, { llamaDequantizeAtt, llamaMergeAtt }, TASK(llamaFusedMergeAtt) },
+        { 2, { llamaRmfFfn, llamaRmfFfnNorm }, TASK(llamaFusedRmfFfnNorm) },
+        { 3, { grokMoeRouterSoftmax, grokMoeTopk, grokMoeNormWeights }, TASK(grokFusedMoeTopk) },
+        { 2, { grokMoeBlock0, grokMoeBlock1 }, TASK(grokFusedMoeBlock0) },
+        { 2, { grokMoeBlock2, grokQuantizeMoeOutput }, TASK(grokMoeBlock2) },
+    };
+    const TaskFusion worker[] = {
+        { 2, { llamaMergeMultiheadAtt, llamaQuantizeMultiheadAtt }, TASK(llamaFusedMergeMultiheadAtt) },
+        { 2, { grokMoeBlock0, grokMoeBlock1 }, TASK(grokFusedMoeBlock0) },
+    };
+    a->fuseI(sizeof(inference) / sizeof(TaskFusion), inference);
+    a->fuseW(sizeof(worker) / sizeof(TaskFusion), worker);
+}
+
 TransformerArch buildMixtralArch(TransformerSpec* spec) {
     TransformerArch a;
 
     // inference
 
-    a.I(sendPos, TASK_TYPE_TRANSFER);
+    // Transfers run on the I/O thread. Reads of the workers' slices are started before the root computes
+    // its own slice, the first task which needs the transferred data joins them.
+    a.I(TASK(sendPos), TASK_TYPE_TRANSFER, TASK_FLAG_ASYNC);
     for (int i = 0; i < spec->nLayers; i++) {
-        a.I(llamaRmsAtt, TASK_TYPE_INFERENCE);
-        a.I(llamaRmsAttNorm, TASK_TYPE_INFERENCE);
-        a.I(llamaQuantizeRmsAtt, TASK_TYPE_INFERENCE);
-        a.I(llamaSyncRmsAtt, TASK_TYPE_TRANSFER);
-        a.I(llamaQkv, TASK_TYPE_INFERENCE);
-        a.I(llamaRope, TASK_TYPE_INFERENCE);
-        a.I(llamaMultiheadAtt, TASK_TYPE_INFERENCE);
-        a.I(llamaQuantizeMultiheadAtt, TASK_TYPE_INFERENCE);
-        a.I(llamaAtt, TASK_TYPE_INFERENCE);
-        a.I(llamaQuantizeAtt, TASK_TYPE_INFERENCE);
-        a.I(llamaSyncAtt, TASK_TYPE_TRANSFER);
-        a.I(llamaDequantizeAtt, TASK_TYPE_INFERENCE);
-        a.I(llamaMergeAtt, TASK_TYPE_INFERENCE);
-        a.I(llamaRmfFfn, TASK_TYPE_INFERENCE);
-        a.I(llamaRmfFfnNorm, TASK_TYPE_INFERENCE);
+        a.I(TASK(llamaRmsAtt), TASK_TYPE_INFERENCE);
+        a.I(TASK(llamaRmsAttNorm), TASK_TYPE_INFERENCE);
+        a.I(TASK(llamaQuantizeRmsAtt), TASK_TYPE_INFERENCE);
+        a.I(TASK(llamaSyncRmsAtt), TASK_TYPE_TRANSFER, TASK_FLAG_ASYNC);
+        a.I(TASK(llamaQkv), TASK_TYPE_INFERENCE);
+        a.I(TASK(llamaRope), TASK_TYPE_INFERENCE);
+        if (isKvCacheStaged(spec)) a.I(TASK(llamaStoreKv), TASK_TYPE_INFERENCE);
+        a.I(TASK(llamaMultiheadAtt), TASK_TYPE_INFERENCE, TASK_FLAG_JOIN);
+        a.I(TASK(llamaMergeMultiheadAtt), TASK_TYPE_INFERENCE);
+        a.I(TASK(llamaQuantizeMultiheadAtt), TASK_TYPE_INFERENCE);
+        a.I(TASK(llamaSyncAtt), TASK_TYPE_TRANSFER, TASK_FLAG_ASYNC);
+        a.I(TASK(llamaAtt), TASK_TYPE_INFERENCE);
+        a.I(TASK(llamaQuantizeAtt), TASK_TYPE_INFERENCE);
+        a.I(TASK(llamaDequantizeAtt), TASK_TYPE_INFERENCE, TASK_FLAG_JOIN);
+        a.I(TASK(llamaMergeAtt), TASK_TYPE_INFERENCE);
+        a.I(TASK(llamaRmfFfn), TASK_TYPE_INFERENCE);
+        a.I(TASK(llamaRmfFfnNorm), TASK_TYPE_INFERENCE);
 
-        a.I(grokMoeRouter, TASK_TYPE_INFERENCE);
-        a.I(grokMoeRouterSoftmax, TASK_TYPE_INFERENCE);
-        a.I(grokMoeTopk, TASK_TYPE_INFERENCE);
-        a.I(grokMoeNormWeights, TASK_TYPE_INFERENCE);
-        a.I(grokQuantizeMoeInput, TASK_TYPE_INFERENCE);
-        a.I(grokSyncMoeInput, TASK_TYPE_TRANSFER);
-        a.I(grokMoeBlock0, TASK_TYPE_INFERENCE);
-        a.I(grokMoeBlock1, TASK_TYPE_INFERENCE);
-        a.I(grokQuantizeMoeMul, TASK_TYPE_INFERENCE);
-        a.I(grokSyncMoeMulA, TASK_TYPE_INFERENCE);
-        a.I(grokSyncMoeMulRearrange, TASK_TYPE_INFERENCE);
-        a.I(grokSyncMoeMulB, TASK_TYPE_INFERENCE);
-        a.I(grokMoeBlock2, TASK_TYPE_INFERENCE);
-        a.I(grokQuantizeMoeOutput, TASK_TYPE_INFERENCE);
-        a.I(grokSyncMoeOutput, TASK_TYPE_TRANSFER);
-        a.I(grokDequantizeMoeOutput, TASK_TYPE_INFERENCE);
-        a.I(grokMoeAdd, TASK_TYPE_INFERENCE);
+        a.I(TASK(grokMoeRouter), TASK_TYPE_INFERENCE);
+        a.I(TASK(grokMoeRouterSoftmax), TASK_TYPE_INFERENCE);
+        a.I(TASK(grokMoeTopk), TASK_TYPE_INFERENCE);
+        a.I(TASK(grokMoeNormWeights), TASK_TYPE_INFERENCE);
+        a.I(TASK(grokQuantizeMoeInput), TASK_TYPE_INFERENCE);
+        a.I(TASK(grokSyncMoeInput), TASK_TYPE_TRANSFER, TASK_FLAG_ASYNC);
+        a.I(TASK(grokSyncMoeMulA), TASK_TYPE_TRANSFER, TASK_FLAG_ASYNC);
+        a.I(TASK(grokMoeBlock0), TASK_TYPE_INFERENCE);
+        a.I(TASK(grokMoeBlock1), TASK_TYPE_INFERENCE);
+        a.I(TASK(grokQuantizeMoeMul), TASK_TYPE_INFERENCE);
+        a.I(TASK(grokSyncMoeMulRearrange), TASK_TYPE_INFERENCE, TASK_FLAG_JOIN);
+        a.I(TASK(grokSyncMoeMulB), TASK_TYPE_TRANSFER, TASK_FLAG_ASYNC);
+        a.I(TASK(grokSyncMoeOutput), TASK_TYPE_TRANSFER, TASK_FLAG_ASYNC);
+        a.I(TASK(grokMoeBlock2), TASK_TYPE_INFERENCE);
+        a.I(TASK(grokQuantizeMoeOutput), TASK_TYPE_INFERENCE);
+        a.I(TASK(grokDequantizeMoeOutput), TASK_TYPE_INFERENCE, TASK_FLAG_JOIN);
+        a.I(TASK(grokMoeAdd), TASK_TYPE_INFERENCE);
 
-        a.I(llamaNextBlock, TASK_TYPE_INFERENCE);
+        a.I(TASK(llamaNextBlock), TASK_TYPE_INFERENCE);
     }
-    a.I(llamaRmsFinal, TASK_TYPE_INFERENCE);
-    a.I(llamaRmsFinalNorm, TASK_TYPE_INFERENCE);
-    a.I(llamaFinalize, TASK_TYPE_INFERENCE);
+    a.I(TASK(llamaRmsFinal), TASK_TYPE_INFERENCE);
+    a.I(TASK(llamaRmsFinalNorm), TASK_TYPE_INFERENCE);
+    a.I(TASK(llamaFinalize), TASK_TYPE_INFERENCE);
 
     // worker
 
     for (int i = 0; i < spec->nLayers; i++) {
-        a.W(llamaSyncRmsAtt, TASK_TYPE_TRANSFER);
-        a.W(llamaQkv, TASK_TYPE_INFERENCE);
-        a.W(llamaRope, TASK_TYPE_INFERENCE);
-        a.W(llamaMultiheadAtt, TASK_TYPE_INFERENCE);
-        a.W(llamaQuantizeMultiheadAtt, TASK_TYPE_INFERENCE);
-        a.W(llamaAtt, TASK_TYPE_INFERENCE);
-        a.W(llamaQuantizeAtt, TASK_TYPE_INFERENCE);
-        a.W(llamaSyncAtt, TASK_TYPE_TRANSFER);
+        a.W(TASK(llamaSyncRmsAtt), TASK_TYPE_TRANSFER);
+        a.W(TASK(llamaQkv), TASK_TYPE_INFERENCE);
+        a.W(TASK(llamaRope), TASK_TYPE_INFERENCE);
+        if (isKvCacheStaged(spec)) a.W(TASK(llamaStoreKv), TASK_TYPE_INFERENCE);
+        a.W(TASK(llamaMultiheadAtt), TASK_TYPE_INFERENCE);
+        a.W(TASK(llamaMergeMultiheadAtt), TASK_TYPE_INFERENCE);
+        a.W(TASK(llamaQuantizeMultiheadAtt), TASK_TYPE_INFERENCE);
+        a.W(TASK(llamaAtt), TASK_TYPE_INFERENCE);
+        a.W(TASK(llamaQuantizeAtt), TASK_TYPE_INFERENCE);
+        a.W(TASK(llamaSyncAtt), TASK_TYPE_TRANSFER);
 
-        a.W(grokSyncMoeInput, TASK_TYPE_TRANSFER);
-        a.W(grokMoeBlock0, TASK_TYPE_INFERENCE);
-        a.W(grokMoeBlock1, TASK_TYPE_INFERENCE);
-        a.W(grokQuantizeMoeMul, TASK_TYPE_INFERENCE);
-        a.W(grokSyncMoeMulA, TASK_TYPE_INFERENCE);
-        a.W(grokSyncMoeMulB, TASK_TYPE_INFERENCE);
-        a.W(grokMoeBlock2, TASK_TYPE_INFERENCE);
-        a.W(grokQuantizeMoeOutput, TASK_TYPE_INFERENCE);
-        a.W(grokSyncMoeOutput, TASK_TYPE_TRANSFER);
+        a.W(TASK(grokSyncMoeInput), TASK_TYPE_TRANSFER);
+        a.W(TASK(grokMoeBlock0), TASK_TYPE_INFERENCE);
+        a.W(TASK(grokMoeBlock1), TASK_TYPE_INFERENCE);
+        a.W(TASK(grokQuantizeMoeMul), TASK_TYPE_INFERENCE);
+        a.W(TASK(grokSyncMoeMulA), TASK_TYPE_TRANSFER);
+        a.W(TASK(grokSyncMoeMulB), TASK_TYPE_TRANSFER);
+        a.W(TASK(grokMoeBlock2), TASK_TYPE_INFERENCE);
+        a.W(TASK(grokQuantizeMoeOutput), TASK_TYPE_INFERENCE);
+        a.W(TASK(grokSyncMoeOutput), TASK_TYPE_TRANSFER);
 
-        a.W(llamaNextBlock, TASK_TYPE_INFERENCE);
+        a.W(TASK(llamaNextBlock), TASK_TYPE_INFERENCE);
     }
 
     return a;
@@ -4,5 +4,6 @@
 #include "tasks.hpp"
 
 TransformerArch buildMixtralArch(TransformerSpec* spec);
+void fuseMixtralArch(TransformerArch* a);
 
 #endif
\ No newline at end of file
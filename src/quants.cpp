@@ -3,11 +3,14 @@
 #include <cmath>
 #include <cassert>
 #include "quants.hpp"
+#include "kernels.hpp"
 
 #if defined(__ARM_NEON)
     #include <arm_neon.h>
 #endif
 
+#if defined(KERNELS_PRIMARY)
+
 int getNumbersPerBatch(FloatType type) {
     switch (type) {
         case F32:
@@ -134,6 +137,10 @@ uint16_t convertF32ToF16(const float x) {
     }
 }
 
+#endif
+
+namespace KERNELS_VARIANT {
+
 void dequantizeQ40Row(const BlockQ40* x, float* y, int k) {
     static const int qk = QK40;
     assert(k % qk == 0);
@@ -287,6 +294,32 @@ void dequantizeQ80Row(const BlockQ80* input, float* output, int k, unsigned int
     }
 }
 
+const QuantsKernels quantsKernels = {
+    dequantizeQ40Row,
+    quantizeQ80Row,
+    dequantizeQ80Row
+};
+
+}
+
+#if defined(KERNELS_PRIMARY)
+
+static const QuantsKernels* kernels = SELECT_KERNELS(quantsKernels);
+
+void dequantizeQ40Row(const BlockQ40* x, float* y, int k) {
+    kernels->dequantizeQ40Row(x, y, k);
+}
+
+void quantizeQ80Row(float* input, BlockQ80* output, int k, unsigned int nThreads, unsigned int threadIndex) {
+    kernels->quantizeQ80Row(input, output, k, nThreads, threadIndex);
+}
+
+void dequantizeQ80Row(const BlockQ80* input, float* output, int k, unsigned int nThreads, unsigned int threadIndex) {
+    kernels->dequantizeQ80Row(input, output, k, nThreads, threadIndex);
+}
+
 void initQuants() {
     initF16ToF32();
 }
+
+#endif
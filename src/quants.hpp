@@ -29,6 +29,7 @@ void initQuants();
 int getNumbersPerBatch(FloatType type);
 long getBatchBytes(FloatType type, int n, int d);
 float convertF16ToF32(uint16_t value);
+uint16_t convertF32ToF16(const float x);
 
 void dequantizeQ40Row(const BlockQ40* x, float* y, int k);
 void quantizeQ80Row(float* input, BlockQ80* output, int k, unsigned int nThreads, unsigned int threadIndex);
@@ -19,13 +19,27 @@ typedef SSIZE_T ssize_t;
 #define close closesocket
 #else
 #include <sys/socket.h>
+#include <sys/select.h>
 #include <netinet/tcp.h>
 #include <arpa/inet.h>
 #include <unistd.h>
 #endif
+#ifdef __linux__
+#include <sys/epoll.h>
+#endif
+#ifdef SOCKET_URING
+#include <linux/io_uring.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#include <sys/uio.h>
+#endif
 
 #define SOCKET_LAST_ERRCODE errno
 #define SOCKET_LAST_ERROR strerror(errno)
+// Passes without progress before readMany/writeMany sleep until a socket is ready
+#define SOCKET_POLL_SPIN_PASSES 64
+// The user data of io_uring cancellations, other requests carry the index of their transfer
+#define SOCKET_RING_CANCEL (~0ULL)
 
 static inline bool isEagainError() {
     #ifdef _WIN32
@@ -132,6 +146,127 @@ static inline void readSocket(int socket, void* data, size_t size) {
     }
 }
 
+#ifdef SOCKET_URING
+class SocketRing {
+private:
+    int fd;
+    void* sqRing;
+    size_t sqRingBytes;
+    void* cqRing;
+    size_t cqRingBytes;
+    struct io_uring_sqe* sqes;
+    size_t sqesBytes;
+    unsigned int* sqHead;
+    unsigned int* sqTail;
+    unsigned int* sqMask;
+    unsigned int sqEntries;
+    unsigned int* sqArray;
+    unsigned int* cqHead;
+    unsigned int* cqTail;
+    unsigned int* cqMask;
+    struct io_uring_cqe* cqes;
+    unsigned int localTail;
+    unsigned int nQueued;
+
+public:
+    bool hasBuffers;
+
+    SocketRing(unsigned int nEntries) {
+        struct io_uring_params params;
+        memset(&params, 0, sizeof(params));
+        fd = syscall(__NR_io_uring_setup, nEntries, &params);
+        if (fd < 0)
+            throw std::runtime_error("Cannot create io_uring instance: " + std::string(SOCKET_LAST_ERROR));
+
+        sqRingBytes = params.sq_off.array + params.sq_entries * sizeof(unsigned int);
+        cqRingBytes = params.cq_off.cqes + params.cq_entries * sizeof(struct io_uring_cqe);
+        bool isSingleMmap = (params.features & IORING_FEAT_SINGLE_MMAP) != 0;
+        if (isSingleMmap) {
+            if (cqRingBytes > sqRingBytes) sqRingBytes = cqRingBytes;
+            cqRingBytes = sqRingBytes;
+        }
+        sqRing = mmap(NULL, sqRingBytes, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, fd, IORING_OFF_SQ_RING);
+        cqRing = isSingleMmap
+            ? sqRing
+            : mmap(NULL, cqRingBytes, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, fd, IORING_OFF_CQ_RING);
+        sqesBytes = params.sq_entries * sizeof(struct io_uring_sqe);
+        sqes = (struct io_uring_sqe*)mmap(NULL, sqesBytes, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, fd, IORING_OFF_SQES);
+        if (sqRing == MAP_FAILED || cqRing == MAP_FAILED || sqes == MAP_FAILED)
+            throw std::runtime_error("Cannot map io_uring instance");
+
+        sqHead = (unsigned int*)((char*)sqRing + params.sq_off.head);
+        sqTail = (unsigned int*)((char*)sqRing + params.sq_off.tail);
+        sqEntries = params.sq_entries;
+        sqMask = (unsigned int*)((char*)sqRing + params.sq_off.ring_mask);
+        sqArray = (unsigned int*)((char*)sqRing + params.sq_off.array);
+        cqHead = (unsigned int*)((char*)cqRing + params.cq_off.head);
+        cqTail = (unsigned int*)((char*)cqRing + params.cq_off.tail);
+        cqMask = (unsigned int*)((char*)cqRing + params.cq_off.ring_mask);
+        cqes = (struct io_uring_cqe*)((char*)cqRing + params.cq_off.cqes);
+        localTail = *sqTail;
+        nQueued = 0;
+        hasBuffers = false;
+    }
+
+    ~SocketRing() {
+        munmap(sqes, sqesBytes);
+        if (cqRing != sqRing)
+            munmap(cqRing, cqRingBytes);
+        munmap(sqRing, sqRingBytes);
+        close(fd);
+    }
+
+    bool registerBuffers(unsigned int n, const struct iovec* iovecs) {
+        if (hasBuffers) {
+            syscall(__NR_io_uring_register, fd, IORING_UNREGISTER_BUFFERS, NULL, 0);
+            hasBuffers = false;
+        }
+        if (syscall(__NR_io_uring_register, fd, IORING_REGISTER_BUFFERS, iovecs, n) < 0)
+            return false;
+        hasBuffers = true;
+        return true;
+    }
+
+    struct io_uring_sqe* push() {
+        // The kernel may have taken only a part of the last submission, the rest is submitted before the queue is full
+        if (localTail - __atomic_load_n(sqHead, __ATOMIC_ACQUIRE) == sqEntries)
+            submit(0);
+        unsigned int index = localTail & *sqMask;
+        struct io_uring_sqe* sqe = &sqes[index];
+        memset(sqe, 0, sizeof(struct io_uring_sqe));
+        sqArray[index] = index;
+        localTail++;
+        nQueued++;
+        return sqe;
+    }
+
+    // Submits the queued requests and waits for at least `minCompleted` completions.
+    void submit(unsigned int minCompleted) {
+        __atomic_store_n(sqTail, localTail, __ATOMIC_RELEASE);
+        while (true) {
+            int r = syscall(__NR_io_uring_enter, fd, nQueued, minCompleted, minCompleted > 0 ? IORING_ENTER_GETEVENTS : 0, NULL, 0);
+            if (r >= 0) {
+                nQueued -= r;
+                return;
+            }
+            if (SOCKET_LAST_ERRCODE != EINTR)
+                throw std::runtime_error("Error submitting io_uring requests");
+        }
+    }
+
+    struct io_uring_cqe* peek() {
+        unsigned int head = *cqHead;
+        if (head == __atomic_load_n(cqTail, __ATOMIC_ACQUIRE))
+            return NULL;
+        return &cqes[head & *cqMask];
+    }
+
+    void pop() {
+        __atomic_store_n(cqHead, *cqHead + 1, __ATOMIC_RELEASE);
+    }
+};
+#endif
+
 void initSockets() {
 #ifdef _WIN32
     WSADATA wsaData;
@@ -187,6 +322,20 @@ SocketPool* SocketPool::connect(unsigned int nSockets, char** hosts, int* ports)
 SocketPool::SocketPool(unsigned int nSockets, int* sockets) {
     this->nSockets = nSockets;
     this->sockets = sockets;
+    this->readPoller = -1;
+    this->writePoller = -1;
+    this->ring = NULL;
+#ifdef SOCKET_URING
+    if (nSockets > 0) {
+        try {
+            // One request per socket and one cancellation per socket after an error
+            ring = new SocketRing(2 * nSockets);
+            printf("🚁 Socket transport: io_uring\n");
+        } catch (const std::runtime_error& e) {
+            printf("🚧 %s, using epoll\n", e.what());
+        }
+    }
+#endif
     this->sentBytes.exchange(0);
     this->recvBytes.exchange(0);
 }
@@ -196,15 +345,171 @@ SocketPool::~SocketPool() {
         shutdown(sockets[i], 2);
         close(sockets[i]);
     }
+    if (readPoller >= 0)
+        close(readPoller);
+    if (writePoller >= 0)
+        close(writePoller);
     delete[] sockets;
+#ifdef SOCKET_URING
+    if (ring != NULL)
+        delete ring;
+#endif
 }
 
 void SocketPool::setTurbo(bool enabled) {
+    // io_uring waits for blocking sockets in the kernel, a non-blocking socket would complete with EAGAIN
+    if (ring != NULL) return;
     for (unsigned int i = 0; i < nSockets; i++) {
         ::setNonBlocking(sockets[i], enabled);
     }
 }
 
+void SocketPool::setBusyPoll(unsigned int us) {
+#ifdef SO_BUSY_POLL
+    int value = us;
+    for (unsigned int i = 0; i < nSockets; i++) {
+        if (setsockopt(sockets[i], SOL_SOCKET, SO_BUSY_POLL, (char*)&value, sizeof(int)) < 0) {
+            printf("🚧 Cannot set busy poll (%s)\n", SOCKET_LAST_ERROR);
+            return;
+        }
+    }
+#else
+    printf("🚧 Busy poll is not supported on this platform\n");
+#endif
+}
+
+void SocketPool::waitForIo(bool isWrite) {
+#ifdef __linux__
+    // Reads and writes have separate instances, so an ACK that frees the send buffer never wakes a reader.
+    int* poller = isWrite ? &writePoller : &readPoller;
+    if (*poller < 0) {
+        int fd = epoll_create1(EPOLL_CLOEXEC);
+        if (fd < 0)
+            throw std::runtime_error("Cannot create epoll instance");
+        for (unsigned int i = 0; i < nSockets; i++) {
+            struct epoll_event event;
+            event.events = (isWrite ? EPOLLOUT : EPOLLIN) | EPOLLET;
+            event.data.u32 = i;
+            // A socket that is already ready is reported by the next wait
+            if (epoll_ctl(fd, EPOLL_CTL_ADD, sockets[i], &event) != 0) {
+                close(fd);
+                throw std::runtime_error("Cannot register socket in epoll instance");
+            }
+        }
+        *poller = fd;
+    }
+    // The caller has drained all pending sockets until EAGAIN, so any new data or buffer space raises an edge.
+    // A stale event, or an event of a socket outside this call, only costs one more pass.
+    struct epoll_event events[8];
+    if (epoll_wait(*poller, events, 8, -1) < 0 && SOCKET_LAST_ERRCODE != EINTR)
+        throw std::runtime_error("Error waiting for sockets");
+#endif
+}
+
+#ifdef SOCKET_URING
+void SocketPool::queueRingIo(unsigned int ioIndex, SocketIo* io, bool isWrite) {
+    struct io_uring_sqe* sqe = ring->push();
+    sqe->fd = sockets[io->socketIndex];
+    sqe->addr = (unsigned long long)io->data;
+    sqe->len = io->size;
+    sqe->user_data = ioIndex;
+    sqe->opcode = isWrite ? IORING_OP_SEND : IORING_OP_RECV;
+    if (!ring->hasBuffers) return;
+    for (unsigned int i = 0; i < buffers.size(); i++) {
+        char* start = (char*)buffers[i].data;
+        if ((char*)io->data >= start && (char*)io->data + io->size <= start + buffers[i].size) {
+            sqe->opcode = isWrite ? IORING_OP_WRITE_FIXED : IORING_OP_READ_FIXED;
+            sqe->buf_index = i;
+            return;
+        }
+    }
+}
+#endif
+
+void SocketPool::registerBuffers(unsigned int n, void** data, size_t* sizes) {
+#ifdef SOCKET_URING
+    if (ring == NULL) return;
+    buffers.clear();
+    struct iovec iovecs[n];
+    for (unsigned int i = 0; i < n; i++) {
+        SocketBuffer buffer;
+        buffer.data = data[i];
+        buffer.size = sizes[i];
+        buffers.push_back(buffer);
+        iovecs[i].iov_base = data[i];
+        iovecs[i].iov_len = sizes[i];
+    }
+    if (!ring->registerBuffers(n, iovecs))
+        printf("🚧 Cannot register buffers in io_uring (%s)\n", SOCKET_LAST_ERROR);
+#endif
+}
+
+void SocketPool::transferRing(unsigned int n, SocketIo* ios, bool isWrite) {
+#ifdef SOCKET_URING
+    unsigned int nPending = 0;
+    for (unsigned int i = 0; i < n; i++) {
+        if (ios[i].size > 0) {
+            queueRingIo(i, &ios[i], isWrite);
+            nPending++;
+        }
+    }
+    bool isFailed = false;
+    int errorCode = 0;
+    const char* errorMessage = NULL;
+    while (nPending > 0) {
+        ring->submit(1);
+        struct io_uring_cqe* cqe;
+        while ((cqe = ring->peek()) != NULL) {
+            unsigned long long userData = cqe->user_data;
+            int result = cqe->res;
+            ring->pop();
+            if (userData == SOCKET_RING_CANCEL) continue;
+
+            unsigned int ioIndex = (unsigned int)userData;
+            SocketIo* io = &ios[ioIndex];
+            if (isFailed) {
+                // A cancelled request or one that completed before its cancellation
+                nPending--;
+                continue;
+            }
+            if (result < 0 && result != -EAGAIN && result != -EINTR) {
+                isFailed = true;
+                errorCode = -result;
+                errorMessage = strerror(-result);
+            } else if (result == 0) {
+                isFailed = true;
+                errorMessage = "Socket closed";
+            } else if (result > 0) {
+                io->size -= result;
+                io->data = (char*)io->data + result;
+            }
+
+            if (isFailed) {
+                // The other requests use the caller's data, so they are cancelled and reaped before the error is thrown
+                nPending--;
+                for (unsigned int i = 0; i < n; i++) {
+                    if (i != ioIndex && ios[i].size > 0) {
+                        struct io_uring_sqe* sqe = ring->push();
+                        sqe->opcode = IORING_OP_ASYNC_CANCEL;
+                        sqe->addr = i;
+                        sqe->user_data = SOCKET_RING_CANCEL;
+                    }
+                }
+            } else if (io->size > 0) {
+                // A short transfer is queued again with the rest
+                queueRingIo(ioIndex, io, isWrite);
+            } else {
+                nPending--;
+            }
+        }
+    }
+    if (isFailed) {
+        if (isWrite) throw WriteSocketException(errorCode, errorMessage);
+        throw ReadSocketException(errorCode, errorMessage);
+    }
+#endif
+}
+
 void SocketPool::write(unsigned int socketIndex, const void* data, size_t size) {
     assert(socketIndex >= 0 && socketIndex < nSockets);
     sentBytes += size;
@@ -219,13 +524,19 @@ void SocketPool::read(unsigned int socketIndex, void* data, size_t size) {
 
 void SocketPool::writeMany(unsigned int n, SocketIo* ios) {
     bool isWriting;
+    unsigned int nIdlePasses = 0;
     for (unsigned int i = 0; i < n; i++) {
         SocketIo* io = &ios[i];
         assert(io->socketIndex >= 0 && io->socketIndex < nSockets);
         sentBytes += io->size;
     }
+    if (ring != NULL) {
+        if (n > 0) transferRing(n, ios, true);
+        return;
+    }
     do {
         isWriting = false;
+        bool isProgress = false;
         for (unsigned int i = 0; i < n; i++) {
             SocketIo* io = &ios[i];
             if (io->size > 0) {
@@ -242,20 +553,33 @@ void SocketPool::writeMany(unsigned int n, SocketIo* ios) {
                 }
                 io->size -= s;
                 io->data = (char*)io->data + s;
+                isProgress = true;
             }
         }
+        if (isWriting && !isProgress && ++nIdlePasses == SOCKET_POLL_SPIN_PASSES) {
+            waitForIo(true);
+            nIdlePasses = 0;
+        } else if (isProgress) {
+            nIdlePasses = 0;
+        }
     } while (isWriting);
 }
 
 void SocketPool::readMany(unsigned int n, SocketIo* ios) {
     bool isReading;
+    unsigned int nIdlePasses = 0;
     for (unsigned int i = 0; i < n; i++) {
         SocketIo* io = &ios[i];
         assert(io->socketIndex >= 0 && io->socketIndex < nSockets);
         recvBytes += io->size;
     }
+    if (ring != NULL) {
+        if (n > 0) transferRing(n, ios, false);
+        return;
+    }
     do {
         isReading = false;
+        bool isProgress = false;
         for (unsigned int i = 0; i < n; i++) {
             SocketIo* io = &ios[i];
             if (io->size > 0) {
@@ -272,8 +596,15 @@ void SocketPool::readMany(unsigned int n, SocketIo* ios) {
                 }
                 io->size -= r;
                 io->data = (char*)io->data + r;
+                isProgress = true;
             }
         }
+        if (isReading && !isProgress && ++nIdlePasses == SOCKET_POLL_SPIN_PASSES) {
+            waitForIo(false);
+            nIdlePasses = 0;
+        } else if (isProgress) {
+            nIdlePasses = 0;
+        }
     } while (isReading);
 }
 
@@ -284,15 +615,36 @@ void SocketPool::getStats(size_t* sentBytes, size_t* recvBytes) {
     this->recvBytes.exchange(0);
 }
 
-Socket SocketServer::accept() {
+static int acceptClient(int serverSocket) {
     struct sockaddr_in clientAddr;
     socklen_t clientAddrSize = sizeof(clientAddr);
-    int clientSocket = ::accept(socket, (struct sockaddr*)&clientAddr, &clientAddrSize);
+    int clientSocket = ::accept(serverSocket, (struct sockaddr*)&clientAddr, &clientAddrSize);
     if (clientSocket < 0)
         throw std::runtime_error("Error accepting connection");
     setNoDelay(clientSocket);
     setQuickAck(clientSocket);
-    return Socket(clientSocket);
+    return clientSocket;
+}
+
+Socket SocketServer::accept() {
+    return Socket(acceptClient(socket));
+}
+
+Socket* SocketServer::tryAccept(unsigned long timeoutMs) {
+    fd_set readSet;
+    FD_ZERO(&readSet);
+    FD_SET(socket, &readSet);
+    struct timeval timeout;
+    timeout.tv_sec = timeoutMs / 1000;
+    timeout.tv_usec = (timeoutMs % 1000) * 1000;
+    int r = select(socket + 1, &readSet, NULL, NULL, &timeout);
+    if (r < 0) {
+        if (SOCKET_LAST_ERRCODE == EINTR) return NULL;
+        throw std::runtime_error("Error waiting for connection");
+    }
+    if (r == 0)
+        return NULL;
+    return new Socket(acceptClient(socket));
 }
 
 Socket::Socket(int socket) {
@@ -320,37 +672,20 @@ bool Socket::tryRead(void* data, size_t size, unsigned long maxAttempts) {
     return tryReadSocket(socket, data, size, maxAttempts);
 }
 
-std::vector<char> Socket::readHttpRequest() {
-        std::vector<char> httpRequest;
-        char buffer[1024 * 1024]; // TODO: this should be refactored asap
-        ssize_t bytesRead;
-        
-        // Peek into the socket buffer to check available data
-        bytesRead = recv(socket, buffer, sizeof(buffer), MSG_PEEK);
-        if (bytesRead <= 0) {
-            // No data available or error occurred
-            if (bytesRead == 0) {
-                // No more data to read
-                return httpRequest;
-            } else {
-                // Error while peeking
-                throw std::runtime_error("Error while peeking into socket");
-            }
-        }
-        
-        // Resize buffer according to the amount of data available
-        std::vector<char> peekBuffer(bytesRead);
-        bytesRead = recv(socket, peekBuffer.data(), bytesRead, 0);
-        if (bytesRead <= 0) {
-            // Error while reading
-            throw std::runtime_error("Error while reading from socket");
+bool Socket::readAvailable(std::vector<char>& buffer) {
+    char chunk[4096];
+    while (true) {
+        ssize_t r = recv(socket, chunk, sizeof(chunk), 0);
+        if (r < 0) {
+            if (isEagainError())
+                return true;
+            throw ReadSocketException(SOCKET_LAST_ERRCODE, SOCKET_LAST_ERROR);
         }
-
-        // Append data to httpRequest
-        httpRequest.insert(httpRequest.end(), peekBuffer.begin(), peekBuffer.end());
-        
-        return httpRequest;
+        if (r == 0)
+            return false;
+        buffer.insert(buffer.end(), chunk, chunk + r);
     }
+}
 
 SocketServer::SocketServer(int port) {
     const char* host = "0.0.0.0";
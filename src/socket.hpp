@@ -23,6 +23,13 @@ public:
     WriteSocketException(int code, const char* message);
 };
 
+struct SocketBuffer {
+    void* data;
+    size_t size;
+};
+
+class SocketRing;
+
 struct SocketIo {
     unsigned int socketIndex;
     const void* data;
@@ -32,9 +39,19 @@ struct SocketIo {
 class SocketPool {
 private:
     int* sockets;
+    // epoll instances of readMany and writeMany with all sockets, -1 until the first wait
+    int readPoller;
+    int writePoller;
+    // NULL if the io_uring transport is not available (`make URING=1`)
+    SocketRing* ring;
+    std::vector<SocketBuffer> buffers;
     std::atomic_uint sentBytes;
     std::atomic_uint recvBytes;
 
+    void waitForIo(bool isWrite);
+    void transferRing(unsigned int n, SocketIo* ios, bool isWrite);
+    void queueRingIo(unsigned int ioIndex, SocketIo* io, bool isWrite);
+
 public:
     static SocketPool* connect(unsigned int nSockets, char** hosts, int* ports);
 
@@ -44,6 +61,9 @@ public:
     ~SocketPool();
 
     void setTurbo(bool enabled);
+    void setBusyPoll(unsigned int us);
+    // Lets the io_uring transport transfer these regions without mapping them for every request, a no-op without it.
+    void registerBuffers(unsigned int n, void** data, size_t* sizes);
     void write(unsigned int socketIndex, const void* data, size_t size);
     void read(unsigned int socketIndex, void* data, size_t size);
     void writeMany(unsigned int n, SocketIo* ios);
@@ -63,7 +83,8 @@ public:
     void write(const void* data, size_t size);
     void read(void* data, size_t size);
     bool tryRead(void* data, size_t size, unsigned long maxAttempts);
-    std::vector<char> readHttpRequest();
+    // Appends the bytes that arrived without waiting for more (turbo mode), returns false if the peer closed the connection.
+    bool readAvailable(std::vector<char>& buffer);
 };
 
 class SocketServer {
@@ -73,6 +94,8 @@ public:
     SocketServer(int port);
     ~SocketServer();
     Socket accept();
+    // Waits up to `timeoutMs` for a connection, returns NULL if there is none. The caller deletes the socket.
+    Socket* tryAccept(unsigned long timeoutMs);
 };
 
 #endif
@@ -2,6 +2,8 @@
 #include <cstring>
 #include <cstdio>
 #include <ctime>
+#include <stdexcept>
+#include "funcs.hpp"
 #include "tasks.hpp"
 
 TransformerArch::TransformerArch() {
@@ -18,7 +20,7 @@ TransformerArch::~TransformerArch() {
     }
 }
 
-void addTask(TaskLoopHandler* handler, unsigned int taskType, TransformerTasks* tasks) {
+void addTask(TaskLoopHandler* handler, const char* name, unsigned int taskType, unsigned int flags, TransformerTasks* tasks) {
     const int alloc = 32;
     if (tasks->nTasks % alloc == 0) {
         TaskLoopTask* newTasks = new TaskLoopTask[tasks->nTasks + alloc];
@@ -30,20 +32,70 @@ void addTask(TaskLoopHandler* handler, unsigned int taskType, TransformerTasks*
     }
     tasks->tasks[tasks->nTasks].handler = handler;
     tasks->tasks[tasks->nTasks].taskType = taskType;
+    tasks->tasks[tasks->nTasks].flags = flags;
+    tasks->tasks[tasks->nTasks].name = name;
     tasks->nTasks++;
 }
 
-void TransformerArch::I(TaskLoopHandler* handler, unsigned int taskType) {
-    addTask(handler, taskType, &inference);
+void TransformerArch::I(TaskLoopHandler* handler, const char* name, unsigned int taskType) {
+    addTask(handler, name, taskType, 0, &inference);
 }
 
-void TransformerArch::W(TaskLoopHandler* handler, unsigned int taskType) {
-    addTask(handler, taskType, &worker);
+void TransformerArch::I(TaskLoopHandler* handler, const char* name, unsigned int taskType, unsigned int flags) {
+    addTask(handler, name, taskType, flags, &inference);
+}
+
+void TransformerArch::W(TaskLoopHandler* handler, const char* name, unsigned int taskType) {
+    addTask(handler, name, taskType, 0, &worker);
+}
+
+void TransformerArch::W(TaskLoopHandler* handler, const char* name, unsigned int taskType, unsigned int flags) {
+    addTask(handler, name, taskType, flags, &worker);
+}
+
+bool canFuseTasks(const TaskFusion* fusion, TransformerTasks* tasks, unsigned int taskIndex) {
+    if (taskIndex + fusion->nHandlers > tasks->nTasks) return false;
+    for (unsigned int i = 0; i < fusion->nHandlers; i++) {
+        TaskLoopTask* task = &tasks->tasks[taskIndex + i];
+        if (task->handler != fusion->handlers[i]) return false;
+        // An async task runs on the I/O thread, it can't be merged with compute tasks. A join inside of
+        // the fused range would be moved before the first task, so it's not allowed either.
+        if (i == 0 ? (task->flags & TASK_FLAG_ASYNC) != 0 : task->flags != 0) return false;
+    }
+    return true;
+}
+
+void fuseTasks(unsigned int nFusions, const TaskFusion* fusions, TransformerTasks* tasks) {
+    unsigned int nTasks = 0;
+    unsigned int taskIndex = 0;
+    while (taskIndex < tasks->nTasks) {
+        TaskLoopTask task = tasks->tasks[taskIndex];
+        unsigned int nFusedTasks = 1;
+        for (unsigned int f = 0; f < nFusions; f++) {
+            if (canFuseTasks(&fusions[f], tasks, taskIndex)) {
+                task.handler = fusions[f].fused;
+                task.name = fusions[f].fusedName;
+                nFusedTasks = fusions[f].nHandlers;
+                break;
+            }
+        }
+        tasks->tasks[nTasks++] = task;
+        taskIndex += nFusedTasks;
+    }
+    tasks->nTasks = nTasks;
+}
+
+void TransformerArch::fuseI(unsigned int nFusions, const TaskFusion* fusions) {
+    fuseTasks(nFusions, fusions, &inference);
+}
+
+void TransformerArch::fuseW(unsigned int nFusions, const TaskFusion* fusions) {
+    fuseTasks(nFusions, fusions, &worker);
 }
 
 void syncUnitBuffer(unsigned int nThreads, unsigned int threadIndex, TransformerContext* ctx, uint8_t bufferIndex) {
     void* buffer = ctx->transformer->buffer->getUnit(bufferIndex);
-    size_t bufferBytes = ctx->transformer->buffer->getUnitBytes(bufferIndex);
+    size_t bufferBytes = ctx->transformer->buffer->getUnitBytes(bufferIndex) * ctx->transformer->batchSize;
 
     if (ctx->socketPool != NULL) {
         // root
@@ -65,7 +117,7 @@ void syncUnitBuffer(unsigned int nThreads, unsigned int threadIndex, Transformer
 }
 
 void syncSliceOfSlicedBuffer(unsigned int nThreads, unsigned int threadIndex, TransformerContext* ctx, uint8_t bufferIndex) {
-    size_t bufferBytes = ctx->transformer->buffer->getSlicedBytes(bufferIndex);
+    size_t bufferBytes = ctx->transformer->buffer->getSlicedBytes(bufferIndex) * ctx->transformer->batchSize;
     if (ctx->socketPool != NULL) {
         // root
 
@@ -90,7 +142,7 @@ void syncSliceOfSlicedBuffer(unsigned int nThreads, unsigned int threadIndex, Tr
 }
 
 void syncMissingSlicesOfSlicedBuffer(unsigned int nThreads, unsigned int threadIndex, TransformerContext* ctx, uint8_t bufferIndex) {
-    size_t sliceBytes = ctx->transformer->buffer->getSlicedBytes(bufferIndex);
+    size_t sliceBytes = ctx->transformer->buffer->getSlicedBytes(bufferIndex) * ctx->transformer->batchSize;
     if (ctx->socketPool != NULL) {
         // root
 
@@ -125,10 +177,11 @@ void quantizeUnitBuffer(unsigned int nThreads, unsigned int threadIndex, Transfo
     if (ctx->transformer->spec->bufferFloatType == F32) return;
     assert(ctx->transformer->spec->bufferFloatType == Q80);
 
+    // The rows of a unit buffer follow each other, so all rows are quantized at once.
     quantizeQ80Row(
         (float*)ctx->transformer->buffer->getUnit(sourceBufferIndex),
         (BlockQ80*)ctx->transformer->buffer->getUnit(targetBufferIndex),
-        ctx->transformer->buffer->getUnitBytes(sourceBufferIndex) / sizeof(float),
+        ctx->transformer->buffer->getUnitBytes(sourceBufferIndex) / sizeof(float) * ctx->transformer->batchSize,
         nThreads,
         threadIndex);
 }
@@ -138,12 +191,14 @@ void quantizeSlicedBuffer(unsigned int nThreads, unsigned int threadIndex, Trans
     if (ctx->transformer->sliceIndex == 0 && !quantizeRootSlice) return;
     assert(ctx->transformer->spec->bufferFloatType == Q80);
 
-    quantizeQ80Row(
-        (float*)ctx->transformer->buffer->getSliced(sourceBufferIndex, ctx->transformer->sliceIndex),
-        (BlockQ80*)ctx->transformer->buffer->getSliced(targetBufferIndex, ctx->transformer->sliceIndex),
-        ctx->transformer->buffer->getSlicedBytes(sourceBufferIndex) / sizeof(float),
-        nThreads,
-        threadIndex);
+    for (unsigned int b = 0; b < ctx->transformer->batchSize; b++) {
+        quantizeQ80Row(
+            (float*)ctx->transformer->buffer->getSliced(sourceBufferIndex, ctx->transformer->sliceIndex, b),
+            (BlockQ80*)ctx->transformer->buffer->getSliced(targetBufferIndex, ctx->transformer->sliceIndex, b),
+            ctx->transformer->buffer->getSlicedBytes(sourceBufferIndex) / sizeof(float),
+            nThreads,
+            threadIndex);
+    }
 }
 
 void dequantizeSlicedBuffer(unsigned int nThreads, unsigned int threadIndex, TransformerContext* ctx, bool dequantizeRootSlice, uint8_t sourceBufferIndex, uint8_t targetBufferIndex) {
@@ -153,35 +208,141 @@ void dequantizeSlicedBuffer(unsigned int nThreads, unsigned int threadIndex, Tra
 
     unsigned int sliceIndex = dequantizeRootSlice ? 0 : 1;
     for (; sliceIndex < ctx->transformer->spec->nSlices; sliceIndex++) {
-        dequantizeQ80Row(
-            (BlockQ80*)ctx->transformer->buffer->getSliced(sourceBufferIndex, sliceIndex),
-            (float*)ctx->transformer->buffer->getSliced(targetBufferIndex, sliceIndex),
-            (ctx->transformer->buffer->getSlicedBytes(sourceBufferIndex) / sizeof(BlockQ80)) * QK80,
-            nThreads,
-            threadIndex);
+        for (unsigned int b = 0; b < ctx->transformer->batchSize; b++) {
+            dequantizeQ80Row(
+                (BlockQ80*)ctx->transformer->buffer->getSliced(sourceBufferIndex, sliceIndex, b),
+                (float*)ctx->transformer->buffer->getSliced(targetBufferIndex, sliceIndex, b),
+                (ctx->transformer->buffer->getSlicedBytes(sourceBufferIndex) / sizeof(BlockQ80)) * QK80,
+                nThreads,
+                threadIndex);
+        }
+    }
+}
+
+void rmsnormUnitBuffer(unsigned int nThreads, unsigned int threadIndex, TransformerContext* ctx, const float* x, const float* weight, uint8_t targetBufferIndex, bool quantize, uint8_t quantizedBufferIndex) {
+    const unsigned int dim = ctx->transformer->spec->dim;
+    assert(dim % QK80 == 0);
+
+    // Every thread computes the rms by itself, so no barrier is needed before the normalization.
+    // The range of a thread is aligned to the quantization blocks, so the thread may quantize its own output.
+    SPLIT_RANGE_TO_THREADS(blockStart, blockEnd, 0, dim / QK80, nThreads, threadIndex);
+    const unsigned int start = blockStart * QK80;
+    const unsigned int n = (blockEnd - blockStart) * QK80;
+
+    for (unsigned int b = 0; b < ctx->transformer->batchSize; b++) {
+        const float* xb = &x[b * dim];
+        const float ms = rms(xb, dim);
+        float* y = (float*)ctx->transformer->buffer->getUnit(targetBufferIndex, b);
+        rmsnorm(&y[start], &xb[start], ms, &weight[start], n, 1, 0);
+
+        if (quantize && ctx->transformer->spec->bufferFloatType == Q80) {
+            BlockQ80* yq = (BlockQ80*)ctx->transformer->buffer->getUnit(quantizedBufferIndex, b);
+            quantizeQ80Row(&y[start], &yq[blockStart], n, 1, 0);
+        }
+    }
+}
+
+void dequantizeAndMergeSlicedBuffer(unsigned int nThreads, unsigned int threadIndex, TransformerContext* ctx, uint8_t sourceBufferIndex, uint8_t targetBufferIndex, float* output) {
+    assert(ctx->socketPool != NULL); // This function may be called only by root.
+    const unsigned int sliceLen = ctx->transformer->buffer->getSlicedBytes(targetBufferIndex) / sizeof(float);
+    assert(sliceLen % QK80 == 0);
+
+    SPLIT_RANGE_TO_THREADS(blockStart, blockEnd, 0, sliceLen / QK80, nThreads, threadIndex);
+    const unsigned int start = blockStart * QK80;
+    const unsigned int n = (blockEnd - blockStart) * QK80;
+
+    for (unsigned int b = 0; b < ctx->transformer->batchSize; b++) {
+        for (slice_index_t sliceIndex = 0; sliceIndex < ctx->transformer->spec->nSlices; sliceIndex++) {
+            float* y = (float*)ctx->transformer->buffer->getSliced(targetBufferIndex, sliceIndex, b);
+            if (sliceIndex > 0 && ctx->transformer->spec->bufferFloatType == Q80) {
+                BlockQ80* yq = (BlockQ80*)ctx->transformer->buffer->getSliced(sourceBufferIndex, sliceIndex, b);
+                dequantizeQ80Row(&yq[blockStart], &y[start], n, 1, 0);
+            }
+            add(&output[b * sliceLen + start], &y[start], n, 1, 0);
+        }
     }
 }
 
+static const char* taskTypeNames[TASK_N_TYPES] = { "inference", "transfer" };
+
 void sendPos(TASK_ARGS) {
     TASK_VARIABLES;
 
     if (ctx->socketPool != NULL) {
+        // The batch size, then the positions and the sequences of the tokens.
+        const unsigned int batchSize = transformer->batchSize;
+        pos_t header[1 + 2 * batchSize];
+        header[0] = batchSize;
+        memcpy(&header[1], transformer->positions, batchSize * sizeof(pos_t));
+        memcpy(&header[1 + batchSize], transformer->sequences, batchSize * sizeof(pos_t));
         unsigned int nSockets = ctx->socketPool->nSockets / nThreads + (ctx->socketPool->nSockets % nThreads > threadIndex ? 1 : 0);
         SocketIo ios[nSockets];
         for (int i = 0; i < nSockets; i++) {
             ios[i].socketIndex = threadIndex + i * nThreads;
-            ios[i].data = &transformer->pos;
-            ios[i].size = sizeof(pos_t);
+            ios[i].data = header;
+            ios[i].size = sizeof(header);
         }
         ctx->socketPool->writeMany(nSockets, ios);
     }
 }
 
+static void getKvSessionPath(char* buffer, size_t size, const char* path, slice_index_t sliceIndex) {
+    snprintf(buffer, size, "%s.%u", path, (unsigned int)sliceIndex);
+}
+
+// Copy: the source sequence, the target sequence and the range. Save and load: the sequence, the number of positions
+// and the length of the path followed by the path, the worker replies the number of saved or restored positions.
+static void handleKvCacheCommand(Transformer* transformer, Socket* socket) {
+    pos_t command;
+    socket->read(&command, sizeof(pos_t));
+    if (command == KV_CACHE_COPY) {
+        pos_t copy[4];
+        socket->read(copy, sizeof(copy));
+        transformer->copyKvCache(copy[0], copy[1], copy[2], copy[3]);
+        return;
+    }
+    if (command != KV_CACHE_SAVE && command != KV_CACHE_LOAD)
+        throw std::runtime_error("Invalid KV cache command");
+
+    pos_t params[3];
+    socket->read(params, sizeof(params));
+    char path[params[2] + 1];
+    socket->read(path, params[2]);
+    path[params[2]] = '\0';
+    char slicePath[params[2] + 16];
+    getKvSessionPath(slicePath, sizeof(slicePath), path, transformer->sliceIndex);
+
+    pos_t result = 0;
+    try {
+        if (command == KV_CACHE_SAVE) {
+            transformer->saveKvCache(slicePath, params[0], params[1], NULL, 0);
+            result = params[1];
+        } else {
+            result = transformer->loadKvCache(slicePath, params[0], NULL, NULL);
+        }
+    } catch (std::runtime_error& e) {
+        printf("❌ %s: %s\n", slicePath, e.what());
+    }
+    socket->write(&result, sizeof(pos_t));
+}
+
 bool tryWaitForPos(Transformer* transformer, Socket* socket, unsigned int maxAttempts) {
-    return socket->tryRead(&transformer->pos, sizeof(pos_t), maxAttempts);
+    pos_t batchSize;
+    if (!socket->tryRead(&batchSize, sizeof(pos_t), maxAttempts))
+        return false;
+    if (batchSize == 0) {
+        handleKvCacheCommand(transformer, socket);
+        return false;
+    }
+    if (batchSize < 1 || batchSize > transformer->spec->nBatches)
+        throw std::runtime_error("Invalid batch size");
+    transformer->batchSize = batchSize;
+    socket->read(transformer->positions, batchSize * sizeof(pos_t));
+    socket->read(transformer->sequences, batchSize * sizeof(pos_t));
+    return true;
 }
 
-Inference::Inference(TransformerArch* arch, unsigned int nThreads, Transformer* transformer, SocketPool* socketPool) {
+Inference::Inference(TransformerArch* arch, unsigned int nThreads, unsigned int spinBudget, Transformer* transformer, SocketPool* socketPool) {
     this->transformer = transformer;
     this->socketPool = socketPool;
     this->arch = arch;
@@ -189,7 +350,22 @@ Inference::Inference(TransformerArch* arch, unsigned int nThreads, Transformer*
     context.socket = NULL;
     context.socketPool = socketPool;
     assert(arch->inference.tasks[0].handler == sendPos);
-    taskLoop = new TaskLoop(nThreads, arch->inference.nTasks, TASK_N_TYPES, arch->inference.tasks, (void*)&context);
+
+    // The transformer buffers are registered for the fixed transfers of the io_uring transport, other builds ignore them
+    TransformerBuffer* buffer = transformer->buffer;
+    void* buffers[TB_LENGTH];
+    size_t bufferSizes[TB_LENGTH];
+    unsigned int nBuffers = 0;
+    for (uint8_t i = 0; i < TB_LENGTH; i++) {
+        if (buffer->bufferBytes[i] > 0 && (i == 0 || buffer->buffers[i] != buffer->buffers[i - 1])) {
+            buffers[nBuffers] = buffer->buffers[i];
+            bufferSizes[nBuffers] = buffer->bufferBytes[i] * buffer->nBatches;
+            nBuffers++;
+        }
+    }
+    socketPool->registerBuffers(nBuffers, buffers, bufferSizes);
+
+    taskLoop = new TaskLoop(nThreads, arch->inference.nTasks, TASK_N_TYPES, arch->inference.tasks, (void*)&context, spinBudget);
 }
 
 Inference::~Inference() {
@@ -197,10 +373,43 @@ Inference::~Inference() {
 }
 
 float* Inference::infer(int token, pos_t pos) {
-    transformer->pos = pos;
+    return inferBatch(&token, 1, pos);
+}
 
-    float* contentRow = ((float*)transformer->tokenEmbeddingTable) + token * transformer->spec->dim;
-    memcpy(transformer->x, contentRow, transformer->spec->dim * sizeof(float));
+float* Inference::inferBatch(const int* tokens, unsigned int nTokens, pos_t pos) {
+    return inferBatch(tokens, nTokens, pos, 1);
+}
+
+float* Inference::inferBatch(const int* tokens, unsigned int nTokens, pos_t pos, unsigned int nLogits) {
+    assert(nTokens <= transformer->spec->nBatches);
+    pos_t positions[nTokens];
+    pos_t sequences[nTokens];
+    for (unsigned int b = 0; b < nTokens; b++) {
+        positions[b] = pos + b;
+        sequences[b] = 0;
+    }
+    return inferBatch(tokens, positions, sequences, nTokens, nLogits);
+}
+
+float* Inference::inferBatch(const int* tokens, const pos_t* positions, const pos_t* sequences, unsigned int nTokens, unsigned int nLogits) {
+    const unsigned int dim = transformer->spec->dim;
+    assert(nTokens > 0 && nTokens <= transformer->spec->nBatches);
+    assert(nLogits > 0 && nLogits <= nTokens);
+    for (unsigned int b = 0; b < nTokens; b++) {
+        assert(positions[b] < transformer->spec->seqLen);
+        assert(sequences[b] < transformer->spec->nSequences);
+        // Without the staging buffers the matmuls write the keys and the values directly to consecutive rows
+        assert(isKvCacheStaged(transformer->spec) || positions[b] == positions[0] + b);
+    }
+    transformer->batchSize = nTokens;
+    transformer->nLogits = nLogits;
+    memcpy(transformer->positions, positions, nTokens * sizeof(pos_t));
+    memcpy(transformer->sequences, sequences, nTokens * sizeof(pos_t));
+
+    for (unsigned int b = 0; b < nTokens; b++) {
+        float* contentRow = ((float*)transformer->tokenEmbeddingTable) + tokens[b] * dim;
+        memcpy(&transformer->x[b * dim], contentRow, dim * sizeof(float));
+    }
 
     context.currentBlockIndex = 0;
 
@@ -209,24 +418,105 @@ float* Inference::infer(int token, pos_t pos) {
     return transformer->logits;
 }
 
+void Inference::copyKvCache(pos_t sourceSequence, pos_t targetSequence, pos_t start, pos_t end) {
+    const pos_t header[6] = { 0, KV_CACHE_COPY, sourceSequence, targetSequence, start, end };
+    for (unsigned int i = 0; i < socketPool->nSockets; i++) {
+        socketPool->write(i, header, sizeof(header));
+    }
+    transformer->copyKvCache(sourceSequence, targetSequence, start, end);
+}
+
+void Inference::sendKvSessionCommand(pos_t command, const char* path, pos_t sequence, pos_t nPositions) {
+    const size_t pathLength = strlen(path);
+    if (pathLength > 1024)
+        throw std::runtime_error("The session path is too long");
+    const pos_t header[5] = { 0, command, sequence, nPositions, (pos_t)pathLength };
+    for (unsigned int i = 0; i < socketPool->nSockets; i++) {
+        socketPool->write(i, header, sizeof(header));
+        socketPool->write(i, path, pathLength);
+    }
+}
+
+bool Inference::readKvSessionReplies(pos_t expected) {
+    bool isOk = true;
+    for (unsigned int i = 0; i < socketPool->nSockets; i++) {
+        pos_t result;
+        socketPool->read(i, &result, sizeof(pos_t));
+        isOk = isOk && result == expected;
+    }
+    return isOk;
+}
+
+bool Inference::saveKvCache(const char* path, pos_t sequence, pos_t nPositions, const int* tokens) {
+    sendKvSessionCommand(KV_CACHE_SAVE, path, sequence, nPositions);
+    char slicePath[strlen(path) + 16];
+    getKvSessionPath(slicePath, sizeof(slicePath), path, transformer->sliceIndex);
+    bool isOk = true;
+    try {
+        transformer->saveKvCache(slicePath, sequence, nPositions, tokens, nPositions);
+    } catch (std::runtime_error& e) {
+        printf("❌ %s: %s\n", slicePath, e.what());
+        isOk = false;
+    }
+    return readKvSessionReplies(nPositions) && isOk;
+}
+
+pos_t Inference::loadKvCache(const char* path, pos_t sequence, int* tokens) {
+    sendKvSessionCommand(KV_CACHE_LOAD, path, sequence, 0);
+    char slicePath[strlen(path) + 16];
+    getKvSessionPath(slicePath, sizeof(slicePath), path, transformer->sliceIndex);
+    pos_t nPositions = 0;
+    try {
+        pos_t nTokens;
+        nPositions = transformer->loadKvCache(slicePath, sequence, tokens, &nTokens);
+        if (nTokens != nPositions)
+            throw std::runtime_error("The session file does not contain the tokens");
+    } catch (std::runtime_error& e) {
+        printf("❌ %s: %s\n", slicePath, e.what());
+        nPositions = 0;
+    }
+    // every node must restore the same positions
+    if (!readKvSessionReplies(nPositions))
+        return 0;
+    return nPositions;
+}
+
 void Inference::getStats(unsigned long* inferenceTime, unsigned long* transferTime) {
     *inferenceTime = taskLoop->executionTime[TASK_TYPE_INFERENCE];
     *transferTime = taskLoop->executionTime[TASK_TYPE_TRANSFER];
 }
 
-Worker::Worker(TransformerArch* arch, unsigned int nThreads, Transformer* transformer, Socket* socket) {
+void Inference::startTrace() {
+    taskLoop->startTrace(&context.currentBlockIndex);
+}
+
+void Inference::saveTrace(const char* path) {
+    taskLoop->saveTrace(path, "root", 0, taskTypeNames, "layer");
+}
+
+Worker::Worker(TransformerArch* arch, unsigned int nThreads, unsigned int spinBudget, Transformer* transformer, Socket* socket) {
     this->transformer = transformer;
     this->socket = socket;
     context.transformer = transformer;
     context.socket = socket;
     context.socketPool = NULL;
-    taskLoop = new TaskLoop(nThreads, arch->worker.nTasks, TASK_N_TYPES, arch->worker.tasks, (void*)&context);
+    taskLoop = new TaskLoop(nThreads, arch->worker.nTasks, TASK_N_TYPES, arch->worker.tasks, (void*)&context, spinBudget);
 }
 
 Worker::~Worker() {
     delete taskLoop;
 }
 
+void Worker::startTrace() {
+    taskLoop->startTrace(&context.currentBlockIndex);
+}
+
+void Worker::saveTrace(const char* path) {
+    char processName[32];
+    snprintf(processName, sizeof(processName), "worker %u", transformer->sliceIndex);
+    taskLoop->saveTrace(path, processName, transformer->sliceIndex, taskTypeNames, "layer");
+}
+
 void Worker::work() {
     const unsigned long maxAttempts = 10000;
 
@@ -6,10 +6,18 @@
 
 #define TASK_ARGS unsigned int nThreads, unsigned int threadIndex, void* userData
 
+// A step header without tokens carries a KV cache command instead of a forward pass.
+#define KV_CACHE_COPY 0
+#define KV_CACHE_SAVE 1
+#define KV_CACHE_LOAD 2
+
 #define TASK_N_TYPES 2
 #define TASK_TYPE_INFERENCE 0
 #define TASK_TYPE_TRANSFER 1
 
+// Expands to the handler and its name, the name is used by the trace.
+#define TASK(handler) handler, #handler
+
 struct TransformerContext {
     Transformer* transformer;
     Socket* socket;
@@ -24,6 +32,17 @@ struct TransformerTasks {
     TaskLoopTask* tasks;
 };
 
+#define TASK_FUSION_MAX_HANDLERS 4
+
+// Adjacent tasks with the listed handlers are replaced by a single task with the `fused` handler. The fused handler
+// must produce the same result as the listed handlers, but without the barriers between them.
+struct TaskFusion {
+    unsigned int nHandlers;
+    TaskLoopHandler* handlers[TASK_FUSION_MAX_HANDLERS];
+    TaskLoopHandler* fused;
+    const char* fusedName;
+};
+
 class TransformerArch {
 public:
     TransformerTasks inference;
@@ -32,8 +51,12 @@ public:
     TransformerArch();
     ~TransformerArch();
 
-    void I(TaskLoopHandler* handler, unsigned int taskType);
-    void W(TaskLoopHandler* handler, unsigned int taskType);
+    void I(TaskLoopHandler* handler, const char* name, unsigned int taskType);
+    void I(TaskLoopHandler* handler, const char* name, unsigned int taskType, unsigned int flags);
+    void W(TaskLoopHandler* handler, const char* name, unsigned int taskType);
+    void W(TaskLoopHandler* handler, const char* name, unsigned int taskType, unsigned int flags);
+    void fuseI(unsigned int nFusions, const TaskFusion* fusions);
+    void fuseW(unsigned int nFusions, const TaskFusion* fusions);
 };
 
 #define TASK_VARIABLES \
@@ -48,6 +71,8 @@ void syncMissingSlicesOfSlicedBuffer(unsigned int nThreads, unsigned int threadI
 void quantizeUnitBuffer(unsigned int nThreads, unsigned int threadIndex, TransformerContext* ctx, uint8_t sourceBufferIndex, uint8_t targetBufferIndex);
 void quantizeSlicedBuffer(unsigned int nThreads, unsigned int threadIndex, TransformerContext* ctx, bool quantizeRootSlice, uint8_t sourceBufferIndex, uint8_t targetBufferIndex);
 void dequantizeSlicedBuffer(unsigned int nThreads, unsigned int threadIndex, TransformerContext* ctx, bool dequantizeRootSlice, uint8_t sourceBufferIndex, uint8_t targetBufferIndex);
+void rmsnormUnitBuffer(unsigned int nThreads, unsigned int threadIndex, TransformerContext* ctx, const float* x, const float* weight, uint8_t targetBufferIndex, bool quantize, uint8_t quantizedBufferIndex);
+void dequantizeAndMergeSlicedBuffer(unsigned int nThreads, unsigned int threadIndex, TransformerContext* ctx, uint8_t sourceBufferIndex, uint8_t targetBufferIndex, float* output);
 void sendPos(TASK_ARGS);
 
 class Inference {
@@ -57,11 +82,31 @@ private:
     TransformerContext context;
     TaskLoop *taskLoop;
     TransformerArch *arch;
+    void sendKvSessionCommand(pos_t command, const char* path, pos_t sequence, pos_t nPositions);
+    bool readKvSessionReplies(pos_t expected);
 public:
-    Inference(TransformerArch* arch, unsigned int nThreads, Transformer* transformer, SocketPool* socketPool);
+    Inference(TransformerArch* arch, unsigned int nThreads, unsigned int spinBudget, Transformer* transformer, SocketPool* socketPool);
     ~Inference();
     float* infer(int token, pos_t pos);
+    // Processes `nTokens` tokens at positions `pos`, `pos + 1`, ... in one forward pass, returns the logits of the last token.
+    float* inferBatch(const int* tokens, unsigned int nTokens, pos_t pos);
+    // The same as above, but returns the logits of the last `nLogits` tokens, `vocabSize` numbers per token.
+    float* inferBatch(const int* tokens, unsigned int nTokens, pos_t pos, unsigned int nLogits);
+    // Processes the token `tokens[i]` of the sequence `sequences[i]` at the position `positions[i]` for every `i` in one
+    // forward pass. Returns the logits of the last `nLogits` tokens, `vocabSize` numbers per token. The positions must be
+    // consecutive if the KV cache is not staged (`isKvCacheStaged`).
+    float* inferBatch(const int* tokens, const pos_t* positions, const pos_t* sequences, unsigned int nTokens, unsigned int nLogits);
+    // Copies the KV cache of the positions [start, end) of one sequence to another sequence on all nodes.
+    void copyKvCache(pos_t sourceSequence, pos_t targetSequence, pos_t start, pos_t end);
+    // Saves the KV cache of the positions [0, nPositions) of the sequence on all nodes, every node writes the file
+    // `path.<slice index>`, the file of the root contains the tokens too. Returns false if any node failed.
+    bool saveKvCache(const char* path, pos_t sequence, pos_t nPositions, const int* tokens);
+    // Restores the session saved by `saveKvCache` to the sequence on all nodes. Returns the number of the restored
+    // positions, 0 if any node failed. The tokens are written to `tokens` (up to `seqLen` tokens).
+    pos_t loadKvCache(const char* path, pos_t sequence, int* tokens);
     void getStats(unsigned long* inferenceTime, unsigned long* transferTime);
+    void startTrace();
+    void saveTrace(const char* path);
 };
 
 class Worker {
@@ -71,9 +116,11 @@ private:
     TransformerContext context;
     TaskLoop *taskLoop;
 public:
-    Worker(TransformerArch* arch, unsigned int nThreads, Transformer* transformer, Socket* socket);
+    Worker(TransformerArch* arch, unsigned int nThreads, unsigned int spinBudget, Transformer* transformer, Socket* socket);
     ~Worker();
     void work();
+    void startTrace();
+    void saveTrace(const char* path);
 };
 
 #endif
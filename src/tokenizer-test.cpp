@@ -1,6 +1,7 @@
 #include <cassert>
 #include <cstring>
 #include <cstdlib>
+#include <cmath>
 #include "tokenizer.hpp"
 
 #define ASSERT_EOS_TYPE(type, expected) \
@@ -11,6 +12,13 @@
 
 #define EOS_ID 10000
 
+static void expect(bool condition, const char* message) {
+    if (!condition) {
+        printf("❌ %s\n", message);
+        exit(EXIT_FAILURE);
+    }
+}
+
 void testChatTemplate() {
     ChatTemplate t0("{\% set loop_messages = messages \%}{\% for message in loop_messages \%}{\% set content = '<|start_header_id|>' + message['role'] + '<|end_header_id|>\n\n'+ message['content'] | trim + '<|eot_id|>' \%}{\% if loop.index0 == 0 \%}{\% set content = bos_token + content \%}{\% endif \%}{{ content }}{\% endfor \%}{\% if add_generation_prompt \%}{{ '<|start_header_id|>assistant<|end_header_id|>\n\n' }}{\% endif \%}", "<eos>");
     assert(t0.type == TEMPLATE_LLAMA3);
@@ -175,10 +183,119 @@ void testEosDetectorWithoutPadding() {
     printf("✅ EosDetector without padding\n");
 }
 
+void testSamplerProbs() {
+    const float expected[4] = { 0.1f, 0.2f, 0.3f, 0.4f };
+    float probs[4];
+
+    Sampler topp(4, 1.0f, 0.5f, 1);
+    for (int i = 0; i < 4; i++) probs[i] = logf(expected[i]);
+    topp.probs(probs);
+    expect(probs[0] == 0.0f && probs[1] == 0.0f, "top-p probs() must zero the tokens outside the nucleus");
+    expect(fabs(probs[2] - 0.3f / 0.7f) < 0.0001f && fabs(probs[3] - 0.4f / 0.7f) < 0.0001f, "top-p probs() must renormalize the nucleus");
+
+    Sampler greedy(4, 0.0f, 0.9f, 1);
+    for (int i = 0; i < 4; i++) probs[i] = expected[i];
+    greedy.probs(probs);
+    expect(probs[0] == 0.0f && probs[1] == 0.0f && probs[2] == 0.0f && probs[3] == 1.0f, "greedy probs() must be one-hot");
+
+    printf("✅ Sampler probs\n");
+}
+
+void testSamplerVerify() {
+    // The tokens accepted or drawn by the verification must follow the target distribution, whatever the draft is.
+    const float target[4] = { 0.1f, 0.2f, 0.3f, 0.4f };
+    const float draft[4] = { 0.4f, 0.3f, 0.2f, 0.1f };
+    const int n = 200000;
+    Sampler drafter(4, 1.0f, 1.0f, 1);
+    Sampler sampler(4, 1.0f, 1.0f, 2);
+    int counts[4] = { 0, 0, 0, 0 };
+    int nAccepted = 0;
+    float probs[4];
+    for (int i = 0; i < n; i++) {
+        int draftToken = drafter.sampleProbs(draft);
+        memcpy(probs, target, sizeof(probs));
+        int next;
+        bool isAccepted = sampler.verify(probs, draft, draftToken, &next);
+        if (isAccepted) {
+            expect(next == draftToken, "an accepted draft token must be the next token");
+            nAccepted++;
+        }
+        counts[next]++;
+    }
+    for (int i = 0; i < 4; i++) {
+        float freq = counts[i] / (float)n;
+        if (fabs(freq - target[i]) > 0.01f) {
+            printf("❌ Token %d: expected %f, got %f\n", i, target[i], freq);
+            exit(EXIT_FAILURE);
+        }
+    }
+    // The acceptance rate is the sum of min(p, q).
+    expect(fabs(nAccepted / (float)n - 0.6f) < 0.01f, "the acceptance rate must be the sum of min(p, q)");
+
+    // The greedy sampler accepts only the argmax of the target.
+    Sampler greedy(4, 0.0f, 1.0f, 1);
+    const float oneHot[4] = { 0.0f, 1.0f, 0.0f, 0.0f };
+    int next;
+    memcpy(probs, oneHot, sizeof(probs));
+    bool isAccepted = greedy.verify(probs, oneHot, 1, &next);
+    expect(isAccepted && next == 1, "greedy verify() must accept the argmax");
+    const float draftOneHot[4] = { 0.0f, 0.0f, 1.0f, 0.0f };
+    memcpy(probs, oneHot, sizeof(probs));
+    isAccepted = greedy.verify(probs, draftOneHot, 2, &next);
+    expect(!isAccepted && next == 1, "greedy verify() must replace another token with the argmax");
+
+    // A draft token without a distribution is accepted with its target probability.
+    nAccepted = 0;
+    for (int i = 0; i < n; i++) {
+        memcpy(probs, target, sizeof(probs));
+        int next;
+        bool isAccepted = sampler.verify(probs, 3, &next);
+        if (isAccepted) {
+            nAccepted++;
+        } else {
+            expect(next != 3, "a rejected draft token must not be the next token");
+        }
+    }
+    expect(fabs(nAccepted / (float)n - 0.4f) < 0.01f, "the acceptance rate must be the target probability of the draft token");
+
+    printf("✅ Sampler verify\n");
+}
+
+void testLookupNgramDraft() {
+    const int history[] = { 1, 2, 3, 4, 5, 9, 2, 3, 7, 8, 2, 3 };
+    int draft[4];
+    unsigned int nDraft;
+
+    // the first match of "2 3" wins
+    nDraft = lookupNgramDraft(history, 12, 2, 2, draft);
+    expect(nDraft == 2 && draft[0] == 4 && draft[1] == 5, "lookupNgramDraft() must copy the tokens after the first match");
+    // the copied tokens may reach the suffix
+    const int history1[] = { 7, 8, 7, 8 };
+    nDraft = lookupNgramDraft(history1, 4, 2, 4, draft);
+    expect(nDraft == 2 && draft[0] == 7 && draft[1] == 8, "lookupNgramDraft() must copy the tokens up to the end of the history");
+
+    // the longest n-gram wins
+    const int history2[] = { 1, 2, 3, 0, 9, 2, 3, 4, 5, 6, 9, 2, 3 };
+    nDraft = lookupNgramDraft(history2, 13, 3, 3, draft);
+    expect(nDraft == 3 && draft[0] == 4 && draft[1] == 5 && draft[2] == 6, "lookupNgramDraft() must prefer the longest n-gram");
+    nDraft = lookupNgramDraft(history2, 13, 2, 3, draft);
+    expect(nDraft == 3 && draft[0] == 0 && draft[1] == 9 && draft[2] == 2, "lookupNgramDraft() must respect maxNgram");
+
+    nDraft = lookupNgramDraft(history, 5, 3, 4, draft);
+    expect(nDraft == 0, "lookupNgramDraft() must not draft without a match");
+    nDraft = lookupNgramDraft(history, 1, 3, 4, draft);
+    expect(nDraft == 0, "lookupNgramDraft() must not draft from one token");
+
+    printf("✅ lookupNgramDraft\n");
+}
+
 int main() {
     testChatTemplate();
     testEosDetectorWithPadding();
     testEosDetectorWithLongPadding();
     testEosDetectorWithoutPadding();
+    testSamplerProbs();
+    testSamplerVerify();
+    testLookupNgramDraft();
     return EXIT_SUCCESS;
 }
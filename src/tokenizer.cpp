@@ -304,7 +304,7 @@ int sample_argmax(float* probabilities, int n) {
     return max_i;
 }
 
-int sample_mult(float* probabilities, int n, float coin) {
+int sample_mult(const float* probabilities, int n, float coin) {
     // sample index from probabilities (they must sum to 1!)
     // coin is a random number in [0, 1), usually from random_f32()
     float cdf = 0.0f;
@@ -406,6 +406,96 @@ int Sampler::sample(float* logits) {
     return next;
 }
 
+void Sampler::probs(float* logits) {
+    if (temperature == 0.0f) {
+        int next = sample_argmax(logits, vocab_size);
+        memset(logits, 0, vocab_size * sizeof(float));
+        logits[next] = 1.0f;
+        return;
+    }
+    for (int q = 0; q < vocab_size; q++) { logits[q] /= temperature; }
+    softmax(logits, vocab_size);
+    if (topp <= 0 || topp >= 1) return;
+
+    // keep the same nucleus as sample_topp and renormalize it
+    int n0 = 0;
+    const float cutoff = (1.0f - topp) / (vocab_size - 1);
+    for (int i = 0; i < vocab_size; i++) {
+        if (logits[i] >= cutoff) {
+            probindex[n0].index = i;
+            probindex[n0].prob = logits[i];
+            n0++;
+        }
+    }
+    qsort(probindex, n0, sizeof(ProbIndex), compare);
+
+    float cumulative_prob = 0.0f;
+    int last_idx = n0 - 1;
+    for (int i = 0; i < n0; i++) {
+        cumulative_prob += probindex[i].prob;
+        if (cumulative_prob > topp) {
+            last_idx = i;
+            break;
+        }
+    }
+
+    memset(logits, 0, vocab_size * sizeof(float));
+    for (int i = 0; i <= last_idx; i++) {
+        logits[probindex[i].index] = probindex[i].prob / cumulative_prob;
+    }
+}
+
+int Sampler::sampleProbs(const float* probs) {
+    float coin = randomF32(&rngState);
+    return sample_mult(probs, vocab_size, coin);
+}
+
+bool Sampler::verify(float* probs, const float* draftProbs, int draftToken, int* next) {
+    const float p = probs[draftToken];
+    const float q = draftProbs[draftToken];
+    float coin = randomF32(&rngState);
+    if (coin * q < p) {
+        *next = draftToken;
+        return true;
+    }
+
+    float sum = 0.0f;
+    for (int i = 0; i < vocab_size; i++) {
+        const float r = probs[i] - draftProbs[i];
+        probs[i] = r > 0.0f ? r : 0.0f;
+        sum += probs[i];
+    }
+    if (sum <= 0.0f) {
+        // both distributions are equal (rounding errors only), so the draft token is as good as any other
+        *next = draftToken;
+        return true;
+    }
+    coin = randomF32(&rngState);
+    *next = sample_mult(probs, vocab_size, coin * sum);
+    return false;
+}
+
+bool Sampler::verify(float* probs, int draftToken, int* next) {
+    float coin = randomF32(&rngState);
+    if (coin < probs[draftToken]) {
+        *next = draftToken;
+        return true;
+    }
+
+    probs[draftToken] = 0.0f;
+    float sum = 0.0f;
+    for (int i = 0; i < vocab_size; i++) {
+        sum += probs[i];
+    }
+    if (sum <= 0.0f) {
+        *next = draftToken;
+        return true;
+    }
+    coin = randomF32(&rngState);
+    *next = sample_mult(probs, vocab_size, coin * sum);
+    return false;
+}
+
 void Sampler::setTemp(float temp) {
     this->temperature = temp;
 }
@@ -414,6 +504,23 @@ void Sampler::setSeed(unsigned long long seed) {
     this->rngState = seed;
 }
 
+unsigned int lookupNgramDraft(const int* history, unsigned int nHistory, unsigned int maxNgram, unsigned int maxDraft, int* draft) {
+    if (maxDraft == 0 || nHistory < 2) return 0;
+    unsigned int n = maxNgram < nHistory - 1 ? maxNgram : nHistory - 1;
+    for (; n > 0; n--) {
+        const int* suffix = &history[nHistory - n];
+        for (unsigned int start = 0; start + n < nHistory; start++) {
+            if (memcmp(&history[start], suffix, n * sizeof(int)) != 0)
+                continue;
+            unsigned int nDraft = nHistory - (start + n);
+            if (nDraft > maxDraft) nDraft = maxDraft;
+            memcpy(draft, &history[start + n], nDraft * sizeof(int));
+            return nDraft;
+        }
+    }
+    return 0;
+}
+
 TokenizerChatStops::TokenizerChatStops(Tokenizer* tokenizer) {
     const bool hasExtraStop = tokenizer->chatStop != NULL;
     nStops = hasExtraStop ? 2 : 1;
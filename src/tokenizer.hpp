@@ -75,10 +75,24 @@ public:
     Sampler(int vocab_size, float temperature, float topp, unsigned long long rngSeed);
     ~Sampler();
     int sample(float* logits);
+    // Converts the logits to the distribution that `sample` draws from: temperature, softmax and top-p cut. The greedy
+    // sampler (temperature 0) produces a one-hot distribution.
+    void probs(float* logits);
+    int sampleProbs(const float* probs);
+    // Speculative sampling: accepts `draftToken` drawn from `draftProbs` with the probability min(1, p / q), otherwise
+    // draws the next token from the residual distribution max(0, p - q) and overwrites `probs` with it. Both
+    // distributions must come from `probs`. The accepted or drawn token is written to `next`.
+    bool verify(float* probs, const float* draftProbs, int draftToken, int* next);
+    // The same for a draft token that was chosen without a distribution (q = 1), e.g. by the prompt lookup.
+    bool verify(float* probs, int draftToken, int* next);
     void setTemp(float temp);
     void setSeed(unsigned long long rngSeed);
 };
 
+// Prompt lookup: finds the first occurrence of the longest suffix of `history` (up to `maxNgram` tokens) and copies up
+// to `maxDraft` tokens that followed it to `draft`. Returns the number of the copied tokens.
+unsigned int lookupNgramDraft(const int* history, unsigned int nHistory, unsigned int maxNgram, unsigned int maxDraft, int* draft);
+
 class TokenizerChatStops {
 public:
     const char** stops;
@@ -3,13 +3,14 @@
 #include <stdexcept>
 #include <string.h>
 #include "utils.hpp"
+#include "funcs.hpp"
 #include "socket.hpp"
 #include "commands.hpp"
 #include "transformer.hpp"
 
 #define IS_ROOT_SLICE(sliceIndex) (sliceIndex == 0)
 
-TransformerSpec Transformer::loadSpecFromFile(const char* path, const unsigned int nSlices, FloatType weightsFloatType, FloatType bufferFloatType) {
+TransformerSpec Transformer::loadSpecFromFile(const char* path, const unsigned int nSlices, FloatType weightsFloatType, FloatType bufferFloatType, FloatType kvCacheFloatType, bool ropeCache, unsigned int nBatches, unsigned int nSequences) {
     TransformerSpec spec;
     memset(&spec, 0, sizeof(TransformerSpec));
     spec.hiddenAct = SILU;
@@ -83,8 +84,26 @@ TransformerSpec Transformer::loadSpecFromFile(const char* path, const unsigned i
     spec.kvDim = (spec.dim * spec.nKvHeads) / spec.nHeads;
     spec.weightsFloatType = weightsFloatType;
     spec.bufferFloatType = bufferFloatType;
+    spec.kvCacheFloatType = kvCacheFloatType;
+    spec.ropeCache = ropeCache;
+    // The experts are selected per token, so the MoE archs process one token at a time.
+    spec.nBatches = spec.archType == LLAMA ? nBatches : 1;
+    if (spec.nBatches > (unsigned int)spec.seqLen) spec.nBatches = spec.seqLen;
+    spec.nSequences = nSequences;
     spec.nSlices = nSlices;
 
+    if (kvCacheFloatType != F32 && kvCacheFloatType != F16 && kvCacheFloatType != Q80)
+        throw std::runtime_error("Unsupported KV cache float type");
+    if (kvCacheFloatType == Q80 && spec.headSize % QK80 != 0)
+        throw std::runtime_error("The Q80 KV cache requires the head size to be divisible by 32");
+    if (nBatches < 1)
+        throw std::runtime_error("The number of batches must be at least 1");
+    // The KV cache row is `sequence * seqLen + pos`, only the sequence index has to fit in pos_t
+    if (nSequences < 1 || nSequences > 65535)
+        throw std::runtime_error("The number of sequences must be between 1 and 65535");
+    if (!ropeCache && spec.headSize > ROPE_MAX_HEAD_SIZE)
+        throw std::runtime_error("RoPE without the cache supports the head size up to 256");
+
     if (spec.nSlices > spec.nKvHeads) {
         // TODO: https://github.com/b4rtaz/distributed-llama/issues/70
         throw std::runtime_error("This version does not support more nodes than the number of KV heads in the model.");
@@ -117,7 +136,11 @@ TransformerSpec Transformer::loadSpecFromFile(const char* path, const unsigned i
     printf("💡 vocabSize: %d\n", spec.vocabSize);
     printf("💡 seqLen: %d\n", spec.seqLen);
     printf("💡 nSlices: %d\n", spec.nSlices);
+    printf("💡 nBatches: %d\n", spec.nBatches);
+    if (spec.nSequences > 1)
+        printf("💡 nSequences: %d\n", spec.nSequences);
     printf("💡 ropeTheta: %.1f\n", spec.ropeTheta);
+    printf("💡 kernels: %s\n", getKernelsName());
 
     spec.fileSize = (size_t)seekToEnd(fd);
     fclose(fd);
@@ -126,6 +149,7 @@ TransformerSpec Transformer::loadSpecFromFile(const char* path, const unsigned i
 
 TransformerBuffer::TransformerBuffer(TransformerSpec* spec) {
     nSlices = spec->nSlices;
+    nBatches = spec->nBatches;
     buffers = new void*[TB_LENGTH];
     bufferBytes = new size_t[TB_LENGTH];
 
@@ -146,20 +170,19 @@ TransformerBuffer::TransformerBuffer(TransformerSpec* spec) {
         bufferBytes[TB_UNIT_MOE_INDEXES] = spec->nActiveExperts * sizeof(uint8_t);
         bufferBytes[TB_UNIT_MOE_WEIGHTS] = spec->nActiveExperts * sizeof(float);
 
-        buffers[TB_UNIT_MOE_INDEXES] = newBuffer(bufferBytes[TB_UNIT_MOE_INDEXES]);
-        buffers[TB_UNIT_MOE_WEIGHTS] = newBuffer(bufferBytes[TB_UNIT_MOE_WEIGHTS]);
+        buffers[TB_UNIT_MOE_INDEXES] = newBuffer(bufferBytes[TB_UNIT_MOE_INDEXES] * nBatches);
+        buffers[TB_UNIT_MOE_WEIGHTS] = newBuffer(bufferBytes[TB_UNIT_MOE_WEIGHTS] * nBatches);
     } else {
         bufferBytes[TB_UNIT_MOE_INDEXES] = 0;
         bufferBytes[TB_UNIT_MOE_WEIGHTS] = 0;
     }
 
     for (int i = 0; i < TB_LENGTH - TB_NO_PAIRS; i += 2) {
-        int bytes = bufferBytes[i];
-        buffers[i] = newBuffer(bufferBytes[i]);
+        buffers[i] = newBuffer(bufferBytes[i] * nBatches);
         if (spec->bufferFloatType == F32) {
             buffers[i + 1] = buffers[i];
         } else {
-            buffers[i + 1] = newBuffer(bufferBytes[i + 1]);
+            buffers[i + 1] = newBuffer(bufferBytes[i + 1] * nBatches);
         }
     }
 }
@@ -182,17 +205,38 @@ TransformerBuffer::~TransformerBuffer() {
     delete[] buffers;
 }
 
+bool isKvCacheStaged(TransformerSpec* spec) {
+    return spec->kvCacheFloatType != F32 || spec->nSequences > 1;
+}
+
+static bool isUnitBuffer(uint8_t bufferIndex) {
+    return bufferIndex == TB_UNIT_XB || bufferIndex == TB_UNIT_XB_QUANTIZED ||
+        bufferIndex == TB_UNIT_MOE_INDEXES || bufferIndex == TB_UNIT_MOE_WEIGHTS;
+}
+
 void* TransformerBuffer::getUnit(uint8_t bufferIndex) {
     return buffers[bufferIndex];
 }
 
+void* TransformerBuffer::getUnit(uint8_t bufferIndex, unsigned int batchIndex) {
+    assert(batchIndex == 0 || isUnitBuffer(bufferIndex));
+    return ((char*)buffers[bufferIndex]) + bufferBytes[bufferIndex] * batchIndex;
+}
+
 size_t TransformerBuffer::getUnitBytes(uint8_t bufferIndex) {
     return bufferBytes[bufferIndex];
 }
 
 void* TransformerBuffer::getSliced(uint8_t bufferIndex, slice_index_t sliceIndex) {
+    return getSliced(bufferIndex, sliceIndex, 0);
+}
+
+void* TransformerBuffer::getSliced(uint8_t bufferIndex, slice_index_t sliceIndex, unsigned int batchIndex) {
     size_t sliceBytes = getSlicedBytes(bufferIndex);
-    return ((char*)buffers[bufferIndex]) + sliceBytes * sliceIndex;
+    if (isUnitBuffer(bufferIndex)) {
+        return ((char*)getUnit(bufferIndex, batchIndex)) + sliceBytes * sliceIndex;
+    }
+    return ((char*)buffers[bufferIndex]) + sliceBytes * (sliceIndex * nBatches + batchIndex);
 }
 
 size_t TransformerBuffer::getSlicedBytes(uint8_t bufferIndex) {
@@ -219,15 +263,23 @@ Transformer::Transformer(TransformerSpec* spec, slice_index_t sliceIndex, Accele
 
         wclsMm = new MatmulCommand(spec->dim, spec->vocabSize, F32, spec->weightsFloatType, acc);
 
-        x = (float*)newBuffer(spec->dim * sizeof(float));
-        logits = (float*)newBuffer(spec->vocabSize * sizeof(float));
+        x = (float*)newBuffer(spec->dim * spec->nBatches * sizeof(float));
+        logits = (float*)newBuffer(spec->vocabSize * spec->nBatches * sizeof(float));
     }
 
+    batchSize = 1;
+    positions = new pos_t[spec->nBatches];
+    sequences = new pos_t[spec->nBatches];
+    memset(positions, 0, spec->nBatches * sizeof(pos_t));
+    memset(sequences, 0, spec->nBatches * sizeof(pos_t));
+    nLogits = 1;
+    rms = new float[spec->nBatches];
+
     ropeSlice = new RopeSlice(spec->dim, spec->kvDim, spec->nKvHeads, spec->nSlices, spec->seqLen, spec->headSize, spec->ropeTheta, sliceIndex);
     if (spec->archType == GROK1 || spec->archType == MIXTRAL) {
-        rope = new FalconRopeCommand(ropeSlice);
+        rope = new FalconRopeCommand(ropeSlice, spec->ropeCache);
     } else {
-        rope = new LlamaRopeCommand(ropeSlice);
+        rope = new LlamaRopeCommand(ropeSlice, spec->ropeCache);
     }
 
     TransformerBlock* b = blocks[0];
@@ -238,6 +290,118 @@ Transformer::Transformer(TransformerSpec* spec, slice_index_t sliceIndex, Accele
     assert(b->kvCacheSlice->kvDim0 == ropeSlice->kvDim0);
 }
 
+void Transformer::copyKvCache(pos_t sourceSequence, pos_t targetSequence, pos_t start, pos_t end) {
+    if (sourceSequence >= spec->nSequences || targetSequence >= spec->nSequences || sourceSequence == targetSequence || start > end || end > spec->seqLen)
+        throw std::runtime_error("Invalid KV cache copy");
+    const unsigned int sourceRow = sourceSequence * spec->seqLen + start;
+    const unsigned int targetRow = targetSequence * spec->seqLen + start;
+    for (unsigned int i = 0; i < spec->nLayers; i++) {
+        TransformerBlock* block = blocks[i];
+        KvCacheSlice* slice = block->kvCacheSlice;
+        const size_t bytes = (char*)slice->at(block->keyCache, end - start, 0) - (char*)block->keyCache;
+        memcpy(slice->at(block->keyCache, targetRow, 0), slice->at(block->keyCache, sourceRow, 0), bytes);
+        memcpy(slice->at(block->valueCache, targetRow, 0), slice->at(block->valueCache, sourceRow, 0), bytes);
+    }
+}
+
+#define KV_SESSION_MAGIC 0xA00C5E55
+
+struct KvSessionHeader {
+    uint32_t magic;
+    uint32_t nLayers;
+    uint32_t kvDim;
+    uint32_t nSlices;
+    uint32_t sliceIndex;
+    uint32_t kvCacheFloatType;
+    uint32_t nPositions;
+    uint32_t nTokens;
+};
+
+void Transformer::saveKvCache(const char* path, pos_t sequence, pos_t nPositions, const int* tokens, pos_t nTokens) {
+    if (sequence >= spec->nSequences || nPositions > spec->seqLen || nTokens > spec->seqLen)
+        throw std::runtime_error("Invalid KV cache session");
+    FILE* file = fopen(path, "wb");
+    if (file == NULL)
+        throw std::runtime_error("Cannot create the session file");
+
+    KvSessionHeader header;
+    header.magic = KV_SESSION_MAGIC;
+    header.nLayers = spec->nLayers;
+    header.kvDim = spec->kvDim;
+    header.nSlices = spec->nSlices;
+    header.sliceIndex = sliceIndex;
+    header.kvCacheFloatType = spec->kvCacheFloatType;
+    header.nPositions = nPositions;
+    header.nTokens = nTokens;
+    bool isOk = fwrite(&header, sizeof(header), 1, file) == 1;
+    if (nTokens > 0)
+        isOk = isOk && fwrite(tokens, sizeof(int), nTokens, file) == nTokens;
+
+    const unsigned int row = sequence * spec->seqLen;
+    for (unsigned int i = 0; i < spec->nLayers && isOk; i++) {
+        TransformerBlock* block = blocks[i];
+        KvCacheSlice* slice = block->kvCacheSlice;
+        const size_t bytes = (char*)slice->at(block->keyCache, nPositions, 0) - (char*)block->keyCache;
+        isOk = fwrite(slice->at(block->keyCache, row, 0), 1, bytes, file) == bytes &&
+            fwrite(slice->at(block->valueCache, row, 0), 1, bytes, file) == bytes;
+    }
+    isOk = fclose(file) == 0 && isOk;
+    if (!isOk)
+        throw std::runtime_error("Cannot write the session file");
+}
+
+pos_t Transformer::loadKvCache(const char* path, pos_t sequence, int* tokens, pos_t* nTokens) {
+    if (sequence >= spec->nSequences)
+        throw std::runtime_error("Invalid KV cache session");
+    FILE* f = fopen(path, "rb");
+    if (f == NULL)
+        throw std::runtime_error("Cannot open the session file");
+    fseek(f, 0, SEEK_END);
+    const size_t fileSize = ftell(f);
+    fclose(f);
+    if (fileSize < sizeof(KvSessionHeader))
+        throw std::runtime_error("Invalid session file");
+
+    MmapFile file;
+    openMmapFile(&file, path, fileSize);
+    const KvSessionHeader* header = (const KvSessionHeader*)file.data;
+    KvCacheSlice* slice = blocks[0]->kvCacheSlice;
+    const size_t bytes = header->nPositions <= spec->seqLen
+        ? (char*)slice->at(blocks[0]->keyCache, header->nPositions, 0) - (char*)blocks[0]->keyCache
+        : 0;
+    if (header->magic != KV_SESSION_MAGIC ||
+        header->nLayers != spec->nLayers ||
+        header->kvDim != spec->kvDim ||
+        header->nSlices != spec->nSlices ||
+        header->sliceIndex != sliceIndex ||
+        header->kvCacheFloatType != spec->kvCacheFloatType ||
+        header->nPositions > spec->seqLen ||
+        header->nTokens > spec->seqLen ||
+        (header->nTokens > 0 && tokens == NULL) ||
+        fileSize != sizeof(KvSessionHeader) + header->nTokens * sizeof(int) + 2 * spec->nLayers * bytes) {
+        closeMmapFile(&file);
+        throw std::runtime_error("The session file does not match the model");
+    }
+
+    const char* data = (const char*)file.data + sizeof(KvSessionHeader);
+    if (header->nTokens > 0)
+        memcpy(tokens, data, header->nTokens * sizeof(int));
+    data += header->nTokens * sizeof(int);
+    if (nTokens != NULL)
+        *nTokens = header->nTokens;
+
+    const unsigned int row = sequence * spec->seqLen;
+    for (unsigned int i = 0; i < spec->nLayers; i++) {
+        TransformerBlock* block = blocks[i];
+        memcpy(block->kvCacheSlice->at(block->keyCache, row, 0), data, bytes);
+        memcpy(block->kvCacheSlice->at(block->valueCache, row, 0), data + bytes, bytes);
+        data += 2 * bytes;
+    }
+    const pos_t nPositions = header->nPositions;
+    closeMmapFile(&file);
+    return nPositions;
+}
+
 Transformer::~Transformer() {
     delete buffer;
     for (int i = 0; i < spec->nLayers; i++) {
@@ -254,6 +418,9 @@ Transformer::~Transformer() {
         freeBuffer(logits);
     }
 
+    delete[] positions;
+    delete[] sequences;
+    delete[] rms;
     delete ropeSlice;
     delete rope;
 }
@@ -277,12 +444,17 @@ TransformerBlock::TransformerBlock(TransformerSpec* spec, slice_index_t sliceInd
         }
     }
 
-    kvCacheSlice = new KvCacheSlice(spec->kvDim, spec->seqLen, spec->nSlices);
-    keyCache = (float*)newBuffer(kvCacheSlice->keyCacheSize);
-    valueCache = (float*)newBuffer(kvCacheSlice->valueCacheSize);
+    // Every sequence has own `seqLen` rows of the cache.
+    kvCacheSlice = new KvCacheSlice(spec->kvCacheFloatType, spec->kvDim, spec->seqLen * spec->nSequences, spec->nSlices);
+    keyCache = newBuffer(kvCacheSlice->keyCacheSize);
+    valueCache = newBuffer(kvCacheSlice->valueCacheSize);
+    if (isKvCacheStaged(spec)) {
+        k0 = (float*)newBuffer(kvCacheSlice->kvDim0 * spec->nBatches * sizeof(float));
+        v0 = (float*)newBuffer(kvCacheSlice->kvDim0 * spec->nBatches * sizeof(float));
+    }
 
-    multiHeadAttSlice = new MultiHeadAttSlice(spec->nHeads, spec->seqLen, spec->nSlices, sliceIndex);
-    att = (float*)newBuffer(multiHeadAttSlice->attSize);
+    multiHeadAttSlice = new MultiHeadAttSlice(spec->nHeads, spec->headSize, spec->nSlices);
+    attPartials = (float*)newBuffer(multiHeadAttSlice->partialsSize);
 
     q0Slice = new RowMatmulSlice(spec->weightsFloatType, spec->nSlices, spec->dim, spec->dim);
     k0Slice = new RowMatmulSlice(spec->weightsFloatType, spec->nSlices, spec->dim, spec->kvDim);
@@ -294,7 +466,7 @@ TransformerBlock::TransformerBlock(TransformerSpec* spec, slice_index_t sliceInd
     v0mm = new MatmulCommand(v0Slice->n, v0Slice->d0, spec->bufferFloatType, spec->weightsFloatType, acc);
     wo0mm = new MatmulCommand(wo0Slice->n0, wo0Slice->d, spec->bufferFloatType, spec->weightsFloatType, acc);
 
-    qo0 = (float*)newBuffer(q0Slice->d0 * sizeof(float));
+    qo0 = (float*)newBuffer(q0Slice->d0 * spec->nBatches * sizeof(float));
 
     if (spec->nExperts > 0) {
         moeUpAndGate0Slice = new RowMatmulSlice(spec->weightsFloatType, spec->nSlices, spec->dim, spec->hiddenDim);
@@ -324,7 +496,7 @@ TransformerBlock::TransformerBlock(TransformerSpec* spec, slice_index_t sliceInd
         w20mm = new MatmulCommand(w20Slice->n0, w20Slice->d, spec->bufferFloatType, spec->weightsFloatType, acc);
         w30mm = new MatmulCommand(w30Slice->n, w30Slice->d0, spec->bufferFloatType, spec->weightsFloatType, acc);
 
-        hb20 = (float*)newBuffer(w30Slice->d0 * sizeof(float));
+        hb20 = (float*)newBuffer(w30Slice->d0 * spec->nBatches * sizeof(float));
     }
 }
 
@@ -341,8 +513,12 @@ TransformerBlock::~TransformerBlock() {
     delete kvCacheSlice;
     freeBuffer(keyCache);
     freeBuffer(valueCache);
+    if (isKvCacheStaged(spec)) {
+        freeBuffer(k0);
+        freeBuffer(v0);
+    }
     delete multiHeadAttSlice;
-    freeBuffer(att);
+    freeBuffer(attPartials);
 
     delete q0Slice;
     delete k0Slice;
@@ -493,6 +669,7 @@ Transformer Transformer::loadSlice(TransformerSpec* spec, Socket* socket, Accele
 
     printf("💡 sliceIndex: %d\n", sliceIndex);
     printf("💡 nSlices: %d\n", spec->nSlices);
+    printf("💡 kernels: %s\n", getKernelsName());
 
     assert(sliceIndex >= 1);
     Transformer transformer(spec, sliceIndex, acc);
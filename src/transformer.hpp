@@ -68,9 +68,19 @@ struct TransformerSpec {
 
     FloatType weightsFloatType;
     FloatType bufferFloatType;
+    FloatType kvCacheFloatType;
+    bool ropeCache;
+    // The largest number of tokens processed in one forward pass.
+    unsigned int nBatches;
+    // The number of sequences with own KV cache, a batch may contain tokens of different sequences.
+    unsigned int nSequences;
     uint8_t nSlices;
 };
 
+// True if the keys and the values are computed to `k0` and `v0` first, and then stored in the cache by a separate task.
+// A F32 cache of a single sequence is written directly.
+bool isKvCacheStaged(TransformerSpec* spec);
+
 class TransformerBlock {
 public:
     slice_index_t sliceIndex;
@@ -115,10 +125,14 @@ public:
     float* hb20;
 
     KvCacheSlice* kvCacheSlice;
-    float* keyCache;
-    float* valueCache;
+    void* keyCache;
+    void* valueCache;
+    // The keys and the values of the current batch before they are stored in a F16 or Q80 cache, or in the rows
+    // of different sequences.
+    float* k0;
+    float* v0;
     MultiHeadAttSlice* multiHeadAttSlice;
-    float* att;
+    float* attPartials;
     float* qo0;
 
     TransformerBlock(TransformerSpec* spec, slice_index_t sliceIndex, AcceleratorContext* acc);
@@ -139,17 +153,23 @@ public:
 #define TB_UNIT_MOE_INDEXES 8
 #define TB_UNIT_MOE_WEIGHTS 9
 
+// Every buffer holds one row per token of the batch. The rows of a unit buffer follow each other. A sliced buffer
+// is stored slice by slice, the rows of one slice follow each other, so one transfer sends a slice of all rows.
 class TransformerBuffer {
 public:
     uint8_t nSlices;
+    unsigned int nBatches;
     void** buffers;
+    // The size of one row.
     size_t* bufferBytes;
 
     TransformerBuffer(TransformerSpec* spec);
     ~TransformerBuffer();
     void* getUnit(uint8_t bufferIndex);
+    void* getUnit(uint8_t bufferIndex, unsigned int batchIndex);
     size_t getUnitBytes(uint8_t bufferIndex);
     void* getSliced(uint8_t bufferIndex, slice_index_t sliceIndex);
+    void* getSliced(uint8_t bufferIndex, slice_index_t sliceIndex, unsigned int batchIndex);
     size_t getSlicedBytes(uint8_t bufferIndex);
 };
 
@@ -167,8 +187,13 @@ public:
     float* rmsFinal;
     MatmulCommand* wclsMm;
 
-    pos_t pos;
-    float rms;
+    // The number of tokens of the current batch, the position and the sequence of every token.
+    pos_t batchSize;
+    pos_t* positions;
+    pos_t* sequences;
+    // The logits are computed for the last `nLogits` tokens of the batch (root only).
+    pos_t nLogits;
+    float* rms;
     float* x;
     float* logits;
     RopeSlice* ropeSlice;
@@ -176,7 +201,15 @@ public:
 
     ~Transformer();
 
-    static TransformerSpec loadSpecFromFile(const char* path, const unsigned int nSlices, FloatType weightsFloatType, FloatType bufferFloatType);
+    // Copies the KV cache of the positions [start, end) of one sequence to another sequence.
+    void copyKvCache(pos_t sourceSequence, pos_t targetSequence, pos_t start, pos_t end);
+    // Writes the KV cache of the positions [0, nPositions) of the sequence and `nTokens` tokens to a session file.
+    void saveKvCache(const char* path, pos_t sequence, pos_t nPositions, const int* tokens, pos_t nTokens);
+    // Restores a session file saved by the same slice of the same model to the sequence. Returns the number of the
+    // restored positions, the tokens are written to `tokens` (up to `seqLen` tokens).
+    pos_t loadKvCache(const char* path, pos_t sequence, int* tokens, pos_t* nTokens);
+
+    static TransformerSpec loadSpecFromFile(const char* path, const unsigned int nSlices, FloatType weightsFloatType, FloatType bufferFloatType, FloatType kvCacheFloatType, bool ropeCache, unsigned int nBatches, unsigned int nSequences);
     static Transformer loadRootFromFile(const char* path, TransformerSpec* spec, SocketPool* socketPool, AcceleratorContext* acc);
     static Transformer loadRoot(char* data, TransformerSpec* spec, SocketPool* socketPool, AcceleratorContext* acc);
     static Transformer loadSlice(TransformerSpec* spec, Socket* socket, AcceleratorContext* acc);
@@ -1,6 +1,7 @@
 #include <cstdio>
 #include <cstdlib>
 #include <cstring>
+#include <chrono>
 #include <iostream>
 #include <vector>
 #include <sys/time.h>
@@ -16,6 +17,30 @@
 #include <unistd.h>
 #endif
 
+#ifdef __linux__
+#include <climits>
+#include <linux/futex.h>
+#include <sys/syscall.h>
+#endif
+
+#if defined(__aarch64__) && defined(__linux__)
+#include <sys/auxv.h>
+#ifndef HWCAP_ASIMDDP
+#define HWCAP_ASIMDDP (1 << 20)
+#endif
+#elif defined(__aarch64__) && defined(__APPLE__)
+#include <sys/sysctl.h>
+#endif
+
+#if defined(__x86_64__) || defined(__i386__) || defined(_M_X64) || defined(_M_IX86)
+#include <immintrin.h>
+#define SPIN_PAUSE() _mm_pause()
+#elif defined(__aarch64__) || defined(__arm__)
+#define SPIN_PAUSE() __asm__ __volatile__("yield")
+#else
+#define SPIN_PAUSE()
+#endif
+
 void* newBuffer(size_t size) {
     void* buffer;
 #ifdef _WIN32
@@ -50,6 +75,34 @@ unsigned long timeMs() {
     return te.tv_sec * 1000LL + te.tv_usec / 1000;
 }
 
+unsigned long timeNs() {
+    // The wall clock is used, so traces from different processes may be aligned.
+    return std::chrono::duration_cast<std::chrono::nanoseconds>(std::chrono::system_clock::now().time_since_epoch()).count();
+}
+
+unsigned int getCpuFeatures() {
+    unsigned int features = 0;
+#if (defined(__x86_64__) || defined(__i386__)) && defined(__GNUC__)
+    // May be called by a static initializer, before the runtime initializes the CPU model.
+    __builtin_cpu_init();
+    if (__builtin_cpu_supports("avx2") && __builtin_cpu_supports("fma") && __builtin_cpu_supports("f16c")) {
+        features |= CPU_AVX2;
+        if (__builtin_cpu_supports("avx512f") && __builtin_cpu_supports("avx512bw") &&
+            __builtin_cpu_supports("avx512vl") && __builtin_cpu_supports("avx512vnni"))
+            features |= CPU_AVX512;
+    }
+#elif defined(__aarch64__) && defined(__linux__)
+    if (getauxval(AT_HWCAP) & HWCAP_ASIMDDP)
+        features |= CPU_DOTPROD;
+#elif defined(__aarch64__) && defined(__APPLE__)
+    int value = 0;
+    size_t size = sizeof(value);
+    if (sysctlbyname("hw.optional.arm.FEAT_DotProd", &value, &size, NULL, 0) == 0 && value != 0)
+        features |= CPU_DOTPROD;
+#endif
+    return features;
+}
+
 unsigned int randomU32(unsigned long long *state) {
     // xorshift rng: https://en.wikipedia.org/wiki/Xorshift#xorshift.2A
     *state ^= *state >> 12;
@@ -123,12 +176,89 @@ void closeMmapFile(MmapFile* file) {
 #endif
 }
 
-TaskLoop::TaskLoop(unsigned int nThreads, unsigned int nTasks, unsigned int nTypes, TaskLoopTask* tasks, void* userData) {
+SpinFutex::SpinFutex() {
+    value.exchange(0);
+    nSleeping.exchange(0);
+#ifndef __linux__
+    dl_mutex_init(&mutex);
+    dl_cond_init(&cond);
+#endif
+}
+
+SpinFutex::~SpinFutex() {
+#ifndef __linux__
+    dl_cond_destroy(&cond);
+    dl_mutex_destroy(&mutex);
+#endif
+}
+
+unsigned int SpinFutex::load() {
+    return value.load();
+}
+
+void SpinFutex::store(unsigned int newValue) {
+    value.store(newValue);
+    wake();
+}
+
+unsigned int SpinFutex::fetchAdd(unsigned int delta) {
+    unsigned int oldValue = value.fetch_add(delta);
+    wake();
+    return oldValue;
+}
+
+unsigned int SpinFutex::fetchSub(unsigned int delta) {
+    unsigned int oldValue = value.fetch_sub(delta);
+    wake();
+    return oldValue;
+}
+
+void SpinFutex::wake() {
+    // A sleeper increments `nSleeping` before it checks the value for the last time,
+    // so the waker skips the syscall only if nobody can miss the change.
+    if (nSleeping.load() == 0)
+        return;
+#ifdef __linux__
+    syscall(SYS_futex, (unsigned int*)&value, FUTEX_WAKE_PRIVATE, INT_MAX, NULL, NULL, 0);
+#else
+    dl_mutex_lock(&mutex);
+    dl_cond_broadcast(&cond);
+    dl_mutex_unlock(&mutex);
+#endif
+}
+
+void SpinFutex::wait(unsigned int expected, unsigned int spinBudget) {
+    for (unsigned int i = 0; i < spinBudget; i++) {
+        if (value.load() != expected)
+            return;
+        SPIN_PAUSE();
+    }
+
+#ifdef __linux__
+    nSleeping.fetch_add(1);
+    while (value.load() == expected) {
+        // The kernel returns immediately if the value is not equal to `expected` anymore.
+        syscall(SYS_futex, (unsigned int*)&value, FUTEX_WAIT_PRIVATE, expected, NULL, NULL, 0);
+    }
+    nSleeping.fetch_sub(1);
+#else
+    dl_mutex_lock(&mutex);
+    nSleeping.fetch_add(1);
+    while (value.load() == expected) {
+        dl_cond_wait(&cond, &mutex);
+    }
+    nSleeping.fetch_sub(1);
+    dl_mutex_unlock(&mutex);
+#endif
+}
+
+TaskLoop::TaskLoop(unsigned int nThreads, unsigned int nTasks, unsigned int nTypes, TaskLoopTask* tasks, void* userData, unsigned int spinBudget) {
     this->nThreads = nThreads;
     this->nTasks = nTasks;
     this->nTypes = nTypes;
     this->tasks = tasks;
     this->userData = userData;
+    this->spinBudget = spinBudget;
     executionTime = new unsigned int[nTypes];
 
     threads = new TaskLoopThread[nThreads];
@@ -137,15 +267,65 @@ TaskLoop::TaskLoop(unsigned int nThreads, unsigned int nTasks, unsigned int nTyp
         threads[i].nTasks = nTasks;
         threads[i].loop = this;
     }
+
+    isPoolStopped = false;
+
+    for (unsigned int i = 1; i < nThreads; i++) {
+        int result = pthread_create(&threads[i].handler, NULL, (thread_func_t)poolThreadHandler, (void*)&threads[i]);
+        if (result != 0) {
+            printf("Cannot created thread\n");
+            exit(EXIT_FAILURE);
+        }
+    }
+
+    nAsyncTasks = 0;
+    asyncTaskIndexes = new unsigned int[nTasks];
+    nAsyncTasksBefore = new unsigned int[nTasks + 1];
+    for (unsigned int i = 0; i < nTasks; i++) {
+        nAsyncTasksBefore[i] = nAsyncTasks;
+        if (tasks[i].flags & TASK_FLAG_ASYNC) {
+            asyncTaskIndexes[nAsyncTasks++] = i;
+        }
+    }
+    nAsyncTasksBefore[nTasks] = nAsyncTasks;
+    asyncBase = 0;
+
+    isTracing = false;
+    traceTag = NULL;
+    traceEvents = NULL;
+
+    if (nAsyncTasks > 0) {
+        int result = pthread_create(&ioThread, NULL, (thread_func_t)ioThreadHandler, (void*)this);
+        if (result != 0) {
+            printf("Cannot created thread\n");
+            exit(EXIT_FAILURE);
+        }
+    }
 }
 
 TaskLoop::~TaskLoop() {
+    isPoolStopped = true;
+    poolGeneration.fetchAdd(1);
+    nStartedAsyncTasks.fetchAdd(1);
+
+    for (unsigned int i = 1; i < nThreads; i++) {
+        pthread_join(threads[i].handler, NULL);
+    }
+    if (nAsyncTasks > 0) {
+        pthread_join(ioThread, NULL);
+    }
+
+    delete[] asyncTaskIndexes;
+    delete[] nAsyncTasksBefore;
+    if (traceEvents != NULL) {
+        delete[] traceEvents;
+    }
     delete[] executionTime;
     delete[] threads;
 }
 
 void TaskLoop::run() {
-    currentTaskIndex.exchange(0);
+    currentTaskIndex.store(0);
     doneThreadCount.exchange(0);
 
     unsigned int i;
@@ -154,19 +334,152 @@ void TaskLoop::run() {
         executionTime[i] = 0;
     }
 
-    for (i = 1; i < nThreads; i++) {
-        int result = pthread_create(&threads[i].handler, NULL, (thread_func_t)threadHandler, (void*)&threads[i]);
-        if (result != 0) {
-            printf("Cannot created thread\n");
-            exit(EXIT_FAILURE);
+    asyncBase = nDoneAsyncTasks.load();
+    currentTaskIndex.store(startTask(0));
+
+    nRunningPoolThreads.store(nThreads - 1);
+    poolGeneration.fetchAdd(1);
+
+    threadHandler((void*)&threads[0]);
+
+    // The next run may reset the task index only when all pool threads have left the current one.
+    unsigned int nRunning;
+    while ((nRunning = nRunningPoolThreads.load()) > 0) {
+        nRunningPoolThreads.wait(nRunning, spinBudget);
+    }
+}
+
+unsigned int TaskLoop::startTask(unsigned int taskIndex) {
+    while (taskIndex < nTasks && (tasks[taskIndex].flags & TASK_FLAG_ASYNC)) {
+        nStartedAsyncTasks.fetchAdd(1);
+        taskIndex++;
+    }
+    if (taskIndex == nTasks || (tasks[taskIndex].flags & TASK_FLAG_JOIN)) {
+        waitForAsyncTasks(nAsyncTasksBefore[taskIndex]);
+    }
+    return taskIndex;
+}
+
+void TaskLoop::waitForAsyncTasks(unsigned int n) {
+    unsigned int nDone = nDoneAsyncTasks.load();
+    if (nDone - asyncBase >= n) {
+        return;
+    }
+    do {
+        nDoneAsyncTasks.wait(nDone, spinBudget);
+        nDone = nDoneAsyncTasks.load();
+    } while (nDone - asyncBase < n);
+
+    // The compute threads were blocked by the async task, so the waiting time is counted as its type.
+    unsigned int currentTime = timeMs();
+    executionTime[tasks[asyncTaskIndexes[n - 1]].taskType] += currentTime - lastTime;
+    lastTime = currentTime;
+}
+
+void TaskLoop::startTrace(const unsigned int* tag) {
+    if (traceEvents == NULL) {
+        traceEvents = new std::vector<TaskLoopTraceEvent>[nThreads + 1];
+    }
+    traceTag = tag;
+    isTracing = true;
+}
+
+void TaskLoop::recordTraceEvent(unsigned int threadIndex, unsigned int taskIndex, unsigned int tag, unsigned long startNs) {
+    TaskLoopTraceEvent event;
+    event.taskIndex = taskIndex;
+    event.tag = tag;
+    event.startNs = startNs;
+    event.endNs = timeNs();
+    traceEvents[threadIndex].push_back(event);
+}
+
+void TaskLoop::saveTrace(const char* path, const char* processName, unsigned int processId, const char** typeNames, const char* tagName) {
+    FILE* file = fopen(path, "w");
+    if (file == NULL) {
+        printf("Cannot open file %s\n", path);
+        exit(EXIT_FAILURE);
+    }
+
+    // Chrome trace event format, timestamps are in microseconds.
+    fprintf(file, "{\"traceEvents\":[\n");
+    fprintf(file, "{\"name\":\"process_name\",\"ph\":\"M\",\"pid\":%u,\"args\":{\"name\":\"%s\"}}", processId, processName);
+    for (unsigned int t = 0; t <= nThreads; t++) {
+        if (t == nThreads && traceEvents[t].empty()) {
+            continue;
+        }
+        char threadName[32];
+        if (t == nThreads) {
+            snprintf(threadName, sizeof(threadName), "io");
+        } else {
+            snprintf(threadName, sizeof(threadName), "thread %u", t);
+        }
+        fprintf(file, ",\n{\"name\":\"thread_name\",\"ph\":\"M\",\"pid\":%u,\"tid\":%u,\"args\":{\"name\":\"%s\"}}", processId, t, threadName);
+    }
+    for (unsigned int t = 0; t <= nThreads; t++) {
+        for (size_t e = 0; e < traceEvents[t].size(); e++) {
+            const TaskLoopTraceEvent* event = &traceEvents[t][e];
+            const TaskLoopTask* task = &tasks[event->taskIndex];
+            const unsigned long durationNs = event->endNs - event->startNs;
+            fprintf(file, ",\n{\"name\":\"%s\",\"cat\":\"%s\",\"ph\":\"X\",\"pid\":%u,\"tid\":%u,\"ts\":%lu.%03lu,\"dur\":%lu.%03lu,\"args\":{\"task\":%u,\"%s\":%u}}",
+                task->name != NULL ? task->name : "?",
+                typeNames[task->taskType],
+                processId,
+                t,
+                event->startNs / 1000, event->startNs % 1000,
+                durationNs / 1000, durationNs % 1000,
+                event->taskIndex,
+                tagName,
+                event->tag);
         }
     }
+    fprintf(file, "\n]}\n");
+    fclose(file);
+}
 
-    threadHandler((void*)&threads[0]);
+void* TaskLoop::ioThreadHandler(void* arg) {
+    TaskLoop* loop = (TaskLoop*)arg;
+    unsigned int nDone = 0;
 
-    for (i = 1; i < nThreads; i++) {
-        pthread_join(threads[i].handler, NULL);
+    while (true) {
+        loop->nStartedAsyncTasks.wait(nDone, loop->spinBudget);
+        if (loop->isPoolStopped) {
+            break;
+        }
+
+        const unsigned int taskIndex = loop->asyncTaskIndexes[nDone % loop->nAsyncTasks];
+        const TaskLoopTask* task = &loop->tasks[taskIndex];
+        if (loop->isTracing) {
+            const unsigned int tag = *loop->traceTag;
+            const unsigned long startNs = timeNs();
+            task->handler(1, 0, loop->userData);
+            loop->recordTraceEvent(loop->nThreads, taskIndex, tag, startNs);
+        } else {
+            task->handler(1, 0, loop->userData);
+        }
+
+        nDone++;
+        loop->nDoneAsyncTasks.fetchAdd(1);
     }
+    return 0;
+}
+
+void* TaskLoop::poolThreadHandler(void* arg) {
+    TaskLoopThread* context = (TaskLoopThread*)arg;
+    TaskLoop* loop = context->loop;
+    unsigned int generation = 0;
+
+    while (true) {
+        loop->poolGeneration.wait(generation, loop->spinBudget);
+        generation = loop->poolGeneration.load();
+
+        if (loop->isPoolStopped) {
+            break;
+        }
+
+        threadHandler(arg);
+        loop->nRunningPoolThreads.fetchSub(1);
+    }
+    return 0;
 }
 
 void* TaskLoop::threadHandler(void* arg) {
@@ -182,7 +495,14 @@ void* TaskLoop::threadHandler(void* arg) {
 
         const TaskLoopTask* task = &loop->tasks[currentTaskIndex % loop->nTasks];
 
-        task->handler(loop->nThreads, threadIndex, loop->userData);
+        if (loop->isTracing) {
+            const unsigned int tag = *loop->traceTag;
+            const unsigned long startNs = timeNs();
+            task->handler(loop->nThreads, threadIndex, loop->userData);
+            loop->recordTraceEvent(threadIndex, currentTaskIndex, tag, startNs);
+        } else {
+            task->handler(loop->nThreads, threadIndex, loop->userData);
+        }
 
         int currentCount = loop->doneThreadCount.fetch_add(1);
 
@@ -192,11 +512,9 @@ void* TaskLoop::threadHandler(void* arg) {
             loop->lastTime = currentTime;
 
             loop->doneThreadCount.store(0);
-            loop->currentTaskIndex.fetch_add(1);
+            loop->currentTaskIndex.store(loop->startTask(currentTaskIndex + 1));
         } else {
-            while (loop->currentTaskIndex.load() == currentTaskIndex) {
-                // NOP
-            }
+            loop->currentTaskIndex.wait(currentTaskIndex, loop->spinBudget);
         }
     }
 
@@ -3,6 +3,7 @@
 
 #include <atomic>
 #include <cstdio>
+#include <vector>
 #include "common/pthread.h"
 
 #ifdef _WIN32
@@ -22,10 +23,18 @@ void* newBuffer(size_t size);
 void freeBuffer(void* buffer);
 
 unsigned long timeMs();
+unsigned long timeNs();
 unsigned int randomU32(unsigned long long *state);
 float randomF32(unsigned long long *state);
 long seekToEnd(FILE* file);
 
+// Instruction sets detected at runtime, used to select the kernels (see kernels.hpp).
+#define CPU_AVX2 1 // AVX2, FMA and F16C
+#define CPU_AVX512 2 // AVX-512 F, BW, VL and VNNI
+#define CPU_DOTPROD 4 // ARMv8.2 dot product
+
+unsigned int getCpuFeatures();
+
 struct MmapFile {
     void* data;
     size_t size;
@@ -40,12 +49,51 @@ struct MmapFile {
 void openMmapFile(MmapFile* file, const char* path, size_t size);
 void closeMmapFile(MmapFile* file);
 
+// How many times a waiting thread polls before it goes to sleep. One poll takes roughly 100 cycles.
+#define TASK_LOOP_DEFAULT_SPIN_BUDGET 20000
+
+// An atomic value that threads can wait on. A waiter spins for a bounded number of polls and then
+// sleeps in the kernel (futex on Linux, a condition variable elsewhere) until the value is changed.
+class SpinFutex {
+private:
+    std::atomic_uint value;
+    std::atomic_uint nSleeping;
+#ifndef __linux__
+    dl_mutex mutex;
+    dl_cond cond;
+#endif
+    void wake();
+public:
+    SpinFutex();
+    ~SpinFutex();
+    unsigned int load();
+    void store(unsigned int newValue);
+    unsigned int fetchAdd(unsigned int delta);
+    unsigned int fetchSub(unsigned int delta);
+    // Returns when the value is different than `expected`.
+    void wait(unsigned int expected, unsigned int spinBudget);
+};
+
+// The task is executed by the I/O thread, the compute threads continue with the next task immediately.
+#define TASK_FLAG_ASYNC 1
+// Before the task starts, all preceding async tasks must be done.
+#define TASK_FLAG_JOIN 2
+
 typedef void (TaskLoopHandler)(unsigned int nThreads, unsigned int threadIndex, void* userData);
 typedef struct {
     TaskLoopHandler* handler;
     unsigned int taskType;
+    unsigned int flags;
+    const char* name;
 } TaskLoopTask;
 
+struct TaskLoopTraceEvent {
+    unsigned int taskIndex;
+    unsigned int tag;
+    unsigned long startNs;
+    unsigned long endNs;
+};
+
 class TaskLoop;
 
 struct TaskLoopThread {
@@ -62,16 +110,45 @@ public:
     unsigned int nTypes;
     TaskLoopTask* tasks;
     void* userData;
-    std::atomic_uint currentTaskIndex;
+    unsigned int spinBudget;
+    SpinFutex currentTaskIndex;
     std::atomic_uint doneThreadCount;
     unsigned int lastTime;
     unsigned int* executionTime;
     TaskLoopThread* threads;
 
-    TaskLoop(unsigned int nThreads, unsigned int nTasks, unsigned int nTypes, TaskLoopTask* tasks, void* userData);
+    // Threads 1..nThreads-1 are created once and parked between runs. Each run bumps the generation to wake them up.
+    SpinFutex poolGeneration;
+    bool isPoolStopped;
+    SpinFutex nRunningPoolThreads;
+
+    // Async tasks are executed in order by the I/O thread, which exists only if the list contains any.
+    // Both counters grow across runs, `asyncBase` is the value of `nDoneAsyncTasks` at the start of the current run.
+    unsigned int nAsyncTasks;
+    unsigned int* asyncTaskIndexes;
+    unsigned int* nAsyncTasksBefore;
+    SpinFutex nStartedAsyncTasks;
+    SpinFutex nDoneAsyncTasks;
+    unsigned int asyncBase;
+    dl_thread ioThread;
+
+    // When tracing, each thread records the start and the end of every task it executes. The I/O thread has
+    // the index `nThreads`. `traceTag` is read at the start of a task and stored in its event.
+    bool isTracing;
+    const unsigned int* traceTag;
+    std::vector<TaskLoopTraceEvent>* traceEvents;
+
+    TaskLoop(unsigned int nThreads, unsigned int nTasks, unsigned int nTypes, TaskLoopTask* tasks, void* userData, unsigned int spinBudget);
     ~TaskLoop();
     void run();
+    unsigned int startTask(unsigned int taskIndex);
+    void waitForAsyncTasks(unsigned int n);
+    void startTrace(const unsigned int* tag);
+    void recordTraceEvent(unsigned int threadIndex, unsigned int taskIndex, unsigned int tag, unsigned long startNs);
+    void saveTrace(const char* path, const char* processName, unsigned int processId, const char** typeNames, const char* tagName);
     static void* threadHandler(void* args);
+    static void* poolThreadHandler(void* args);
+    static void* ioThreadHandler(void* args);
 };
 
 #endif